@@ -1,4 +1,4 @@
-function d = DTW_Cpp(ts1, ts2, r)
+function [d, path] = DTW_Cpp(ts1, ts2, r, cutoff)
 %DISTS.DTW_Cpp   Calculate the DTW distance between two time series using
 %Sakoe-Chiba band and an auxiliary MEX function.
 %   DTW_Cpp(S,Z) returns the DTW distance between the time series S and Z
@@ -8,15 +8,36 @@ function d = DTW_Cpp(ts1, ts2, r)
 %   DTW_Cpp(S,Z,r) returns the DTW distance between S and Z using r
 %   observations as the length of the Sakoe-Chiba window.
 %
+%   DTW_Cpp(S,Z,r,cutoff) returns Inf if the distance is larger than
+%   cutoff, which allows the calculation to stop early. Distances not
+%   larger than cutoff are exact.
+%
+%   [D,PATH] = DTW_Cpp(...) also returns the warping path as a K-by-2
+%   matrix of indices of S and Z. The path is found with memory linear in
+%   the length of the series, so it can be used with very long series.
+%
+%   Long series are calculated by one thread per processor, which share
+%   the tiles of each anti-diagonal of the band. The MEX also calculates
+%   many pairs per call, in parallel: see +dists/DTW_mex.cpp, and
+%   MODELS.NN, which uses it for @DISTS.DTW_Cpp.
+%
+%   If both S and Z are single, the MEX reads them in single precision,
+%   but the distance is calculated in double precision.
+%
 %   Notice: this function requires that the file +dists/DTW_mex.cpp be
 %   compiled into a MEX binary.
 
-%   Revision 0.1
+%   Revision 0.4
     ts1=ts1(:)';
     ts2=ts2(:)';    
     n = length(ts1);
     m = length(ts2);
     
     if (~exist('r','var')), r=ceil( min(n,m)*0.1); end
-    d = dists.DTW_mex(ts1,ts2,r);    
+    if (~exist('cutoff','var')), cutoff=Inf; end
+    if nargout < 2
+        d = dists.DTW_mex(ts1,ts2,r,cutoff);
+    else
+        [d, path] = dists.DTW_mex(ts1,ts2,r,cutoff);
+    end    
 end
\ No newline at end of file
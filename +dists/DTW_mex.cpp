@@ -2,7 +2,7 @@
   * provided by the authors.
   */
 
-/* Revision 0.1
+/* Revision 0.3
  */
 
 /***********************************************************************/
@@ -32,39 +32,47 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
+#include <vector>
+#include <thread>
+#include <atomic>
 #define min(x,y) ((x)<(y)?(x):(y))
 #define max(x,y) ((x)>(y)?(x):(y))
 #define inf 1e20
 
+// Pairs per thread below which no threads are started
+#define PAIRS_PER_THREAD 4
+
 // Euclidean Distance of 2 values
 double dist(double x, double y) 
 {   return (x-y)*(x-y);
 }
 
-double dtw(double* A, double* B, int m, int n, int r)
+// The cost rows have 2*r+1 cells each and are reused across calls. If the
+// root of the smallest cost of a row is larger than cutoff, the distance
+// can only be larger than cutoff, so +Inf is returned right away
+double dtw(const double* A, const double* B, int m, int n, int r,
+        double* cost, double* cost_prev, double cutoff)
 {       
     //int r = (int)(ceil(min(m,n)*0.1));
         
     if (abs(m-n) > r)       return -1; 
    
-    double *cost;
-    double *cost_prev;
     double *cost_tmp;
     int i,j,k;
     double x,y,z;
+    double rowmin;
     
-    cost = (double*)malloc(sizeof(double)*(2*r+1));                
     for(k=0; k<2*r+1; k++)    cost[k]=inf;
-                    
-    cost_prev = (double*)malloc(sizeof(double)*(2*r+1));                
     for(k=0; k<2*r+1; k++)    cost_prev[k]=inf;
         
     for (i=0; i<m; i++)
     {   k = max(0,r-i);
+        rowmin = inf;
         for(j=max(0,i-r); j<=min(n-1,i+r); j++)
         {   
             if ((i==0)&&(j==0)) 
             {   cost[r]=dist(A[0],B[0]);
+                rowmin = cost[r];
                 k++;              
                 continue;
             }            
@@ -78,8 +86,11 @@ double dtw(double* A, double* B, int m, int n, int r)
             //printf("[%d,%d], k:%d, r=%d, x:%d, y:%d, z:%d\n",i,j,k,r,(int)x,(int)y,(int)z);
                     
             cost[k] = min( min( x, y) , z) + dist(A[i],B[j]);            
+            rowmin = min(rowmin, cost[k]);
             k++;  
         }
+        if (sqrt(rowmin) > cutoff)
+            return HUGE_VAL;
         
         cost_tmp = cost;
         cost = cost_prev;
@@ -89,60 +100,438 @@ double dtw(double* A, double* B, int m, int n, int r)
     
     k--;
     //printf("cost_prev[%d]=%d\n",k,(int)cost_prev[k]);
-    double final_dtw = sqrt(cost_prev[k]);
-    free(cost);
-    free(cost_prev);
+    return sqrt(cost_prev[k]);
+}
+
+// Copy the series in row "row" of a p-by-len matrix, whose observations may
+// be double or single, into a contiguous array of double
+template <typename T>
+void getseries(const T* data, int p, int len, int row, double* series)
+{
+    for (int k=0; k<len; k++)
+        series[k] = data[row + (size_t)k*p];
+}
+
+// Calculate the distances of all pairs. Each thread takes the next pair
+// from a shared counter and keeps its cost rows and series copies for all
+// of its pairs
+template <typename T>
+bool dtwpairs(const T* A, const T* B, int p, int q, int m, int n, int r,
+        const double* cutoff, int numcutoffs, int numthreads, double* out)
+{
+    int numpairs = max(p,q);
+    std::atomic<int> next(0);
+    std::atomic<bool> failed(false);
+    std::vector<std::thread> workers;
+
+    auto work = [&]() {
+        int rr = r > 0 ? r : 0;
+        double *buffer = (double*)malloc(sizeof(double)*(2*(2*rr+1)+m+n));
+        int pair;
+        if (!buffer) {
+            failed = true;
+            return;
+        }
+        double *cost = buffer, *cost_prev = cost + 2*rr+1;
+        double *a = cost_prev + 2*rr+1, *b = a + m;
+        while ((pair = next.fetch_add(1)) < numpairs && !failed) {
+            getseries(A, p, m, p == 1 ? 0 : pair, a);
+            getseries(B, q, n, q == 1 ? 0 : pair, b);
+            out[pair] = dtw(a, b, m, n, r, cost, cost_prev,
+                    cutoff[numcutoffs == 1 ? 0 : pair]);
+        }
+        free(buffer);
+    };
+
+    numthreads = min(numthreads, numpairs / PAIRS_PER_THREAD);
+    for (int i=1; i<numthreads; i++)
+        workers.push_back(std::thread(work));
+    work();
+    for (size_t i=0; i<workers.size(); i++)
+        workers[i].join();
+    return !failed;
+}
+
+
+// Side of the square tiles of the wavefront
+#define WAVEFRONT_TILE 256
+
+// Smallest band, in cells, for which a single pair is calculated by the
+// wavefront when there are several threads
+#define WAVEFRONT_CELLS (1 << 22)
+
+// Largest part of the cost matrix whose warping path is traced back from
+// all of its cells
+#define PATH_CELLS (1 << 16)
+
+// Part of the cost matrix above which the two halves of a split of the
+// warping path are calculated by two threads
+#define PATH_PARALLEL_CELLS (1 << 20)
 
-    return final_dtw;    
+// Barrier of the threads of the wavefront, which spin between
+// anti-diagonals
+struct barrier {
+    std::atomic<int> count, generation;
+    int numthreads;
+
+    barrier(int numthreads) : count(0), generation(0), numthreads(numthreads) { }
+    void wait()
+    {
+        int gen = generation;
+        if (count.fetch_add(1) == numthreads - 1) {
+            count = 0;
+            generation++;
+        }
+        else {
+            while (generation == gen)
+                std::this_thread::yield();
+        }
+    }
+};
+
+// Calculate the tile of rows i0 to i0+T-1 and columns j0 to j0+T-1. The
+// row above it is read from "rowbound", the column to its left from
+// "colbound", and the cell above and to the left is "corner". The last row
+// and column of the tile replace them, and its last cell goes to
+// "cornerout". Cells out of the band are inf, as in dtw()
+void filltile(const double* A, const double* B, int m, int n, int r, int i0, int j0,
+        double* rowbound, double* colbound, double corner, double* cornerout,
+        double* prev, double* cur)
+{
+    int i1 = min(m, i0+WAVEFRONT_TILE), j1 = min(n, j0+WAVEFRONT_TILE);
+    int w = j1-j0;
+    int i,j,jj;
+    double x,y,z,*tmp;
+
+    prev[0] = corner;
+    for (jj=0; jj<w; jj++)    prev[jj+1] = rowbound[j0+jj];
+    for (i=i0; i<i1; i++)
+    {   cur[0] = colbound[i];
+        for (j=j0; j<j1; j++)
+        {   jj = j-j0+1;
+            if (abs(i-j) > r)
+                cur[jj] = inf;
+            else if ((i==0)&&(j==0))
+                cur[jj] = dist(A[0],B[0]);
+            else
+            {   x = prev[jj];
+                y = cur[jj-1];
+                z = prev[jj-1];
+                cur[jj] = min( min( x, y) , z) + dist(A[i],B[j]);
+            }
+        }
+        colbound[i] = cur[w];
+        tmp = cur;
+        cur = prev;
+        prev = tmp;
+    }
+    for (jj=0; jj<w; jj++)    rowbound[j0+jj] = prev[jj+1];
+    *cornerout = prev[w];
+}
+
+// DTW of one pair of long series. The band is split into square tiles,
+// and the tiles of each anti-diagonal, which depend only on the two
+// anti-diagonals before it, are shared by the threads. Only the last row
+// of every tile column, the last column of every tile row, and the last
+// cells of the tiles of the last three anti-diagonals are kept, so memory
+// is O(m+n). Every cell is the same as in dtw(), and so is the distance
+double dtwwavefront(const double* A, const double* B, int m, int n, int r,
+        int numthreads)
+{
+    if (abs(m-n) > r)       return -1; 
+
+    int rowtiles = (m+WAVEFRONT_TILE-1)/WAVEFRONT_TILE;
+    int coltiles = (n+WAVEFRONT_TILE-1)/WAVEFRONT_TILE;
+    std::vector<double> rowbound(n, inf), colbound(m, inf);
+    std::vector<double> corners(3*coltiles, inf);
+    std::atomic<int> next[2];
+    std::vector<std::thread> workers;
+    barrier sync(numthreads);
+
+    next[0] = 0;
+    next[1] = 0;
+    auto work = [&](bool first) {
+        std::vector<double> rows(2*(WAVEFRONT_TILE+1));
+        for (int d=0; d<rowtiles+coltiles-1; d++)
+        {   int firsttile = max(0, d-coltiles+1), lasttile = min(d, rowtiles-1);
+            int t;
+            if (first)
+                next[(d+1)%2] = 0;
+            while ((t = firsttile + next[d%2].fetch_add(1)) <= lasttile)
+            {   int I = t, J = d-t;
+                int i0 = I*WAVEFRONT_TILE, j0 = J*WAVEFRONT_TILE;
+                int i1 = min(m, i0+WAVEFRONT_TILE)-1, j1 = min(n, j0+WAVEFRONT_TILE)-1;
+                double *cornerout = &corners[(d%3)*coltiles+J];
+                if (j0-i1 > r || j1-i0 < -r)
+                {   *cornerout = inf;
+                    continue;
+                }
+                filltile(A, B, m, n, r, i0, j0, &rowbound[0], &colbound[0],
+                        (I>0 && J>0) ? corners[((d-2)%3)*coltiles+J-1] : inf,
+                        cornerout, &rows[0], &rows[WAVEFRONT_TILE+1]);
+            }
+            sync.wait();
+        }
+    };
+    for (int i=1; i<numthreads; i++)
+        workers.push_back(std::thread(work, false));
+    work(true);
+    for (size_t i=0; i<workers.size(); i++)
+        workers[i].join();
+    return sqrt(rowbound[n-1]);
+}
+
+// Costs of the best paths within the band and the columns j0 to j1 from
+// (i0,j0) to each cell of row "last" or, if "backward", from each cell of
+// row "last" to (i1,j1). "row" receives the costs of columns j0 to j1, and
+// both "row" and "tmp" have room for j1-j0+3 cells
+void pathcosts(const double* A, const double* B, int r, int i0, int j0, int i1,
+        int j1, int last, bool backward, double* row, double* tmp)
+{
+    int w = j1-j0+1, s = backward ? -1 : 1;
+    int istart = backward ? i1 : i0, jstart = backward ? j1 : j0;
+    double *prev = tmp, *cur = row, *out;
+    int i,j,jj;
+
+    for (jj=0; jj<w+2; jj++)    prev[jj] = cur[jj] = inf;
+    for (i=istart; ; i+=s)
+    {   for (j=jstart; j>=j0 && j<=j1; j+=s)
+        {   jj = j-j0+1;
+            if (abs(i-j) > r)
+                cur[jj] = inf;
+            else if ((i==istart)&&(j==jstart))
+                cur[jj] = dist(A[i],B[j]);
+            else
+                cur[jj] = min( min( prev[jj], cur[jj-s]) , prev[jj-s]) + dist(A[i],B[j]);
+        }
+        if (i == last)
+            break;
+        out = cur;
+        cur = prev;
+        prev = out;
+    }
+    if (cur != row)
+        for (jj=0; jj<w+2; jj++)    row[jj] = cur[jj];
+}
+
+// Append to "path" the best path within the band from (i0,j0) to (i1,j1).
+// Small parts are traced back from all of their costs; larger parts are
+// split at their middle row, where the best path crosses to the next row
+// at the cell that minimizes the cost from (i0,j0) plus the cost to
+// (i1,j1), as in Hirschberg's algorithm, so memory stays linear
+bool warpingpath(const double* A, const double* B, int r, int i0, int j0, int i1,
+        int j1, int numthreads, std::vector<int>& path)
+{
+    int h = i1-i0+1, w = j1-j0+1;
+    int i,j;
+
+    if (i0 == i1 || j0 == j1)
+    {   for (i=i0; i<=i1; i++)
+            for (j=j0; j<=j1; j++)
+            {   path.push_back(i);
+                path.push_back(j);
+            }
+        return true;
+    }
+
+    if ((double)h*w <= PATH_CELLS)
+    {   std::vector<double> D(h*w);
+        std::vector<int> reversed;
+        for (i=i0; i<=i1; i++)
+            for (j=j0; j<=j1; j++)
+            {   double x = i>i0 ? D[(i-i0-1)*w+j-j0] : inf;
+                double y = j>j0 ? D[(i-i0)*w+j-j0-1] : inf;
+                double z = (i>i0 && j>j0) ? D[(i-i0-1)*w+j-j0-1] : inf;
+                if (abs(i-j) > r)
+                    D[(i-i0)*w+j-j0] = inf;
+                else if ((i==i0)&&(j==j0))
+                    D[0] = dist(A[i],B[j]);
+                else
+                    D[(i-i0)*w+j-j0] = min( min( x, y) , z) + dist(A[i],B[j]);
+            }
+        i = i1;
+        j = j1;
+        while (true)
+        {   reversed.push_back(j);
+            reversed.push_back(i);
+            if ((i==i0)&&(j==j0))
+                break;
+            double x = i>i0 ? D[(i-i0-1)*w+j-j0] : inf;
+            double y = j>j0 ? D[(i-i0)*w+j-j0-1] : inf;
+            double z = (i>i0 && j>j0) ? D[(i-i0-1)*w+j-j0-1] : inf;
+            if (z <= x && z <= y)     { i--; j--; }
+            else if (x <= y)          i--;
+            else                      j--;
+        }
+        path.insert(path.end(), reversed.rbegin(), reversed.rend());
+        return true;
+    }
+
+    int mid = i0+(h-1)/2;
+    double *buffer = (double*)malloc(sizeof(double)*4*(w+2));
+    if (!buffer)
+        return false;
+    double *forward = buffer, *backward = buffer+2*(w+2);
+    if (numthreads > 1 && (double)h*w > PATH_PARALLEL_CELLS)
+    {   std::thread other(pathcosts, A, B, r, i0, j0, i1, j1, mid+1, true,
+                backward, backward+w+2);
+        pathcosts(A, B, r, i0, j0, i1, j1, mid, false, forward, forward+w+2);
+        other.join();
+    }
+    else
+    {   pathcosts(A, B, r, i0, j0, i1, j1, mid+1, true, backward, backward+w+2);
+        pathcosts(A, B, r, i0, j0, i1, j1, mid, false, forward, forward+w+2);
+    }
+
+    // The path goes down from (mid,j) to (mid+1,j) or (mid+1,j+1)
+    double best = HUGE_VAL;
+    int bestj = j0, bestnext = j0;
+    for (j=j0; j<=j1; j++)
+    {   double down = forward[j-j0+1] + backward[j-j0+1];
+        double diagonal = j<j1 ? forward[j-j0+1] + backward[j-j0+2] : HUGE_VAL;
+        if (diagonal < best)
+        {   best = diagonal;
+            bestj = j;
+            bestnext = j+1;
+        }
+        if (down < best)
+        {   best = down;
+            bestj = j;
+            bestnext = j;
+        }
+    }
+    free(buffer);
+    return warpingpath(A, B, r, i0, j0, mid, bestj, numthreads, path) &&
+        warpingpath(A, B, r, mid+1, bestnext, i1, j1, numthreads, path);
 }
 
 
 void mexFunction( int nlhs, mxArray *plhs[],
                   int nrhs, const mxArray *prhs[] )
 {
-  double  mwSize, a_nrows,a_ncols,b_nrows,b_ncols;
+  /*
+   *  Usage:
+   *
+   *     [D, path] = DTW_mex(A, B, r[, cutoff[, threads]])
+   *
+   *  A and B are matrices of double or single with one series in each row.
+   *  If they have the same number of rows, D(i) is the distance between
+   *  A(i,:) and B(i,:); if one of them has a single row, D(i) is the
+   *  distance between that series and the i-th series of the other. D is a
+   *  column vector. With row arrays, this is the single distance between
+   *  them, as in the original version.
+   *
+   *  If "cutoff" is present, as a scalar or with one element per pair, a
+   *  pair whose distance is larger than its cutoff may be abandoned before
+   *  the end, and its distance is returned as +Inf. Distances not larger
+   *  than the cutoff are exact. "threads" is the number of threads; 0, the
+   *  default, means one per processor.
+   *
+   *  A single pair of long series is calculated by several threads along
+   *  the anti-diagonals of its band (see dtwwavefront()), with the same
+   *  result. If "path" is requested, A and B must be a single pair, and
+   *  path is the K-by-2 matrix of the (1-based) indices of the cells of
+   *  the warping path, found in linear memory; it is empty if the distance
+   *  is -1 or larger than the cutoff.
+   */
+  int p, q, m, n, numpairs, numcutoffs, numthreads;
+  double inf_cutoff = HUGE_VAL;
+  const double *cutoff;
   
   /* Check for proper number of arguments. */
-  if(nrhs!=3) {
-    printf("");
-    printf("      ");
-    mexErrMsgTxt("Three inputs required. \nExample of usage:\n\tdist = DTW(TS1, TS2, r)\n");
+  if(nrhs<3 || nrhs>5) {
+    mexErrMsgTxt("Three to five inputs required. \nExample of usage:\n\tdist = DTW(TS1, TS2, r)\n");
   } 
-  else if(nlhs>1) {
-    mexErrMsgTxt("At most one output required.");
+  else if(nlhs>2) {
+    mexErrMsgTxt("At most two outputs required.");
   }
   
-  /* The input must be a noncomplex scalar double.*/
-  a_nrows = mxGetM(prhs[0]);
-  a_ncols = mxGetN(prhs[0]);
-  if( !mxIsDouble(prhs[0]) || mxIsComplex(prhs[0]) ||
-      !(a_nrows==1) ) {
-    mexErrMsgTxt("First input (TS) must be a noncomplex row array double.");            
+  /* The inputs must be noncomplex matrices of double or single, with
+   * series in rows. */
+  p = (int)mxGetM(prhs[0]);
+  m = (int)mxGetN(prhs[0]);
+  if( !(mxIsDouble(prhs[0]) || mxIsSingle(prhs[0])) || mxIsComplex(prhs[0]) ) {
+    mexErrMsgTxt("First input (TS) must be a noncomplex matrix of double or single.");            
   }
   
-  b_nrows = mxGetM(prhs[0]);
-  b_ncols = mxGetN(prhs[0]);  
-  if( !mxIsDouble(prhs[1]) || mxIsComplex(prhs[0]) ||
-      !(b_nrows==1) ) {
-    mexErrMsgTxt("Second input (Mark) must be a noncomplex row array double.");
+  q = (int)mxGetM(prhs[1]);
+  n = (int)mxGetN(prhs[1]);
+  if( mxGetClassID(prhs[1]) != mxGetClassID(prhs[0]) || mxIsComplex(prhs[1]) ) {
+    mexErrMsgTxt("Second input (Mark) must be a noncomplex matrix of the same class as the first.");
   }  
+  if( p != q && p != 1 && q != 1 ) {
+    mexErrMsgTxt("The first two inputs must have the same number of rows, or one of them a single row.");
+  }
+  numpairs = (p == 0 || q == 0) ? 0 : max(p,q);
+
+  if (nrhs >= 4 && !mxIsEmpty(prhs[3])) {
+    numcutoffs = (int)mxGetNumberOfElements(prhs[3]);
+    if( !mxIsDouble(prhs[3]) || mxIsComplex(prhs[3]) ||
+        (numcutoffs != 1 && numcutoffs != numpairs) ) {
+      mexErrMsgTxt("Fourth input (cutoff) must be a noncomplex scalar or have one element per pair.");
+    }
+    cutoff = mxGetPr(prhs[3]);
+  }
+  else {
+    numcutoffs = 1;
+    cutoff = &inf_cutoff;
+  }
+
+  numthreads = nrhs >= 5 ? (int)mxGetScalar(prhs[4]) : 0;
+  if (numthreads <= 0)
+    numthreads = std::thread::hardware_concurrency();
+  numthreads = max(numthreads, 1);
   
   /* Create matrix for the return argument. */
-  plhs[0] = mxCreateDoubleMatrix(1,1, mxREAL);
-  
-  /* Assign pointers to each input and output. */
-  double *A, *B, *In3, *Out;
-  A = mxGetPr(prhs[0]);     // TS1
-  B = mxGetPr(prhs[1]);     // TS2
-  In3 = mxGetPr(prhs[2]);     // TS2
-  
-  Out = mxGetPr(plhs[0]);      // Motif = [bsf, index1, index2]
-    
-  int m = (int)a_ncols;
-  int n = (int)b_ncols;
-  int r = (int)(*In3);
+  plhs[0] = mxCreateDoubleMatrix(numpairs, 1, mxREAL);
+  double *Out = mxGetPr(plhs[0]);
+  // A window wider than the series changes nothing
+  double window = mxGetScalar(prhs[2]);
+  int r = window > max(m,n) ? max(m,n) : (int)window;
 
-    
-  double d = dtw(A,B,m,n,r);    
-  Out[0] = d;
+  bool ok;
+  if (nlhs == 2 && numpairs != 1)
+    mexErrMsgTxt("The warping path requires a single pair of series.");
+  if (numpairs == 1 && (nlhs == 2 ||
+              (numthreads > 1 && (double)m*(2*r+1) >= WAVEFRONT_CELLS))) {
+    std::vector<double> a(m), b(n);
+    std::vector<int> cells;
+    if (mxIsSingle(prhs[0])) {
+      getseries((float*)mxGetData(prhs[0]), 1, m, 0, &a[0]);
+      getseries((float*)mxGetData(prhs[1]), 1, n, 0, &b[0]);
+    }
+    else {
+      getseries(mxGetPr(prhs[0]), 1, m, 0, &a[0]);
+      getseries(mxGetPr(prhs[1]), 1, n, 0, &b[0]);
+    }
+    if (numthreads > 1 && (double)m*(2*r+1) >= WAVEFRONT_CELLS) {
+      Out[0] = dtwwavefront(&a[0], &b[0], m, n, r, numthreads);
+    }
+    else {
+      std::vector<double> cost(2*(2*max(r,0)+1));
+      Out[0] = dtw(&a[0], &b[0], m, n, r, &cost[0], &cost[2*max(r,0)+1], HUGE_VAL);
+    }
+    if (Out[0] > cutoff[0])
+      Out[0] = HUGE_VAL;
+    if (nlhs == 2) {
+      if (Out[0] >= 0 && Out[0] < HUGE_VAL &&
+              !warpingpath(&a[0], &b[0], r, 0, 0, m-1, n-1, numthreads, cells))
+        mexErrMsgTxt("Error allocating memory.");
+      plhs[1] = mxCreateDoubleMatrix(cells.size()/2, 2, mxREAL);
+      double *P = mxGetPr(plhs[1]);
+      for (size_t k=0; k<cells.size()/2; k++) {
+        P[k] = cells[2*k] + 1;
+        P[k + cells.size()/2] = cells[2*k+1] + 1;
+      }
+    }
+    return;
+  }
+  if (mxIsSingle(prhs[0]))
+    ok = dtwpairs((float*)mxGetData(prhs[0]), (float*)mxGetData(prhs[1]), p, q, m, n, r,
+            cutoff, numcutoffs, numthreads, Out);
+  else
+    ok = dtwpairs(mxGetPr(prhs[0]), mxGetPr(prhs[1]), p, q, m, n, r,
+            cutoff, numcutoffs, numthreads, Out);
+  if (!ok)
+    mexErrMsgTxt("Error allocating memory.");
 }
@@ -0,0 +1,276 @@
+function buildcache(path, train, test, distfun, options)
+%DISTS.BUILDCACHE Calculate distance matrices into a binary cache file that
+%may be read row by row.
+%   BUILDCACHE(PATH,TRAIN,TEST,DIST) calculates the distance between each
+%   pair of training series and from each test series to each training
+%   series, as DISTS.CALCMATRIX(TRAIN,TEST,DIST) would, and writes them to
+%   the binary cache file PATH. TEST and DIST may be [], as for
+%   DISTS.CALCMATRIX. The file is read with DISTS.OPENCACHE and
+%   DISTS.CACHEROWS, and its format is described in DISTS.OPENCACHE.
+%
+%   BUILDCACHE(PATH,TRAIN,TEST,DIST,OPTS) takes options from the OPTS
+%   object OPTS. These are also passed to DISTS.CALCMATRIX.
+%
+%   BUILDCACHE(PATH,DSFILE,[],...), where DSFILE is the path to a .mat file
+%   with the variables "train" and "test" (as written by TS.SAVE) or a
+%   MATFILE object of such a file, reads the series from the file by parts
+%   instead of from memory. Saved with the -v7.3 flag, the file is read
+%   only a block at a time, so the data sets need not fit in memory.
+%
+%   The matrices are calculated in blocks of "dists::cache rows" rows, and
+%   each block is flagged in the file as soon as it is written. When
+%   resuming, the number of rows of the existing cache is used by default.
+%   If PATH already exists, it must be a cache of the same sizes and class,
+%   and only the blocks not yet flagged are calculated, so an interrupted
+%   build resumes where it stopped.
+%
+%   Options:
+%       dists::cache class      (default: 'double')
+%       dists::cache rows       (default: 256)
+%       dists::cache previous   (default: '')
+%       dists::memory           (default: Inf)
+%       dists::reflexive        (default: 1)
+%
+%   The option "dists::memory" is a budget, in bytes, for the series and
+%   the distances held in memory at once. If finite, the number of rows of
+%   each block is chosen so that a block of the output takes half the
+%   budget, unless "dists::cache rows" is given, and the distances of each
+%   block are calculated against as many training series at a time as fit
+%   in the other half. The native engine still runs all its threads over
+%   each chunk. Memory used by MATLAB itself is not counted.
+%
+%   The option "dists::cache class" is the class of the distances in the
+%   file: 'double', 'single', or 'uint16'. With 'uint16', the distances of
+%   each row are quantized to 65535 levels between the smallest and the
+%   largest distance of that row, which quarters the file size. Infinite
+%   distances are stored as NaN in uint16 caches.
+%
+%   Each block of rows is calculated as a test vs. training matrix, so
+%   both (i,j) and (j,i) are calculated for pairs of training series. If
+%   "dists::reflexive" is true, the diagonal of the training matrix is set
+%   to 0.
+%
+%   If "dists::cache previous" is the path to a complete cache of the first
+%   series of TRAIN and TEST, the distances between those series are read
+%   from it instead of calculated. This is how DISTS.EXTENDCACHE extends a
+%   cache after series are appended. The distances read from a uint16
+%   cache are quantized again.
+
+%   This file is part of TimeBox. Copyright 2015-17 Rafael Giusti
+%   Revision 0.3.1
+if ~exist('test', 'var')
+    test = [];
+end
+if ~exist('distfun', 'var')
+    distfun = [];
+end
+if ~exist('options', 'var')
+    options = opts.empty;
+end
+payload = opts.get(options, 'dists::cache class', 'double');
+reflexive = opts.get(options, 'dists::reflexive', 1);
+budget = opts.get(options, 'dists::memory', Inf);
+classcode = find(strcmp(payload, {'double', 'single', 'uint16'}));
+tb.assert(~isempty(classcode), 'Option "dists::cache class" must be ''double'', ''single'', or ''uint16''');
+tb.assert(budget > 0, 'Option "dists::memory" must be positive');
+
+% The data sets may be read by parts from a file
+if ischar(train)
+    train = matfile(train);
+end
+if isa(train, 'matlab.io.MatFile')
+    tb.assert(isempty(test), 'TEST must be [] when TRAIN is a file');
+    test = train;
+    ntrain = size(train, 'train', 1);
+    ntest = size(train, 'test', 1);
+    numcols = size(train, 'train', 2);
+else
+    ntrain = size(train, 1);
+    ntest = size(test, 1);
+    numcols = size(train, 2);
+end
+
+% Half of the memory budget goes to a block of rows of the output and the
+% series of those rows, and the other half to a chunk of training series
+% and their distances to the block. Each series is counted twice, since
+% DISTS.CALCMATRIX transposes it
+seriesbytes = 8 * numcols;
+if opts.has(options, 'dists::cache rows')
+    blockrows = opts.get(options, 'dists::cache rows');
+elseif exist(path, 'file')
+    cache = dists.opencache(path);
+    blockrows = cache.blockrows;
+elseif isfinite(budget)
+    blockrows = max(1, floor(budget / 2 / (8 * ntrain + 2 * seriesbytes)));
+else
+    blockrows = 256;
+end
+tb.assert(blockrows >= 1 && blockrows == round(blockrows), 'Option "dists::cache rows" must be a positive integer');
+chunkcols = max(1, floor(budget / 2 / (2 * seriesbytes + 16 * blockrows)));
+
+if ~exist(path, 'file')
+    createcache(path, classcode, ntrain, ntest, blockrows);
+end
+cache = dists.opencache(path);
+tb.assert(strcmp(cache.class, payload) && cache.ntrain == ntrain && cache.ntest == ntest && ...
+    cache.blockrows == blockrows, 'Cache %s was created for other sizes or class; delete it to start over', path);
+
+[blockoffset, rowoffset, payloadoffset] = sectionoffsets(classcode, ntrain, ntest, blockrows);
+bytes = numel(typecast(zeros(1, payload), 'uint8'));
+f = fopen(path, 'r+', 'l');
+tb.assert(f ~= -1, 'Can''t open cache %s for writing', path);
+closefile = onCleanup(@() fclose(f));
+
+% Only the test matrix of each block is calculated
+blockoptions = opts.clone(options);
+blockoptions('dists::traintrain') = 0;
+
+previous = opts.get(options, 'dists::cache previous', '');
+if ~isempty(previous)
+    previous = dists.opencache(previous);
+    tb.assert(previous.complete && previous.ntrain <= ntrain && previous.ntest <= ntest, ...
+        'Previous cache %s is incomplete or larger than the data sets', previous.path);
+end
+
+trainblocks = ceil(ntrain / blockrows);
+for block = 1:size(cache.blocks, 1)
+    if cache.blocks(block, 1)
+        continue
+    end
+    if block <= trainblocks
+        first = (block - 1) * blockrows + 1;
+        rows = first:min(first + blockrows - 1, ntrain);
+        series = readseries(train, 'train', rows);
+        D = calcblock(train, ntrain, chunkcols, series, rows, previous, 'traintrain', distfun, blockoptions);
+        if reflexive
+            D(sub2ind(size(D), 1:numel(rows), rows)) = 0;
+        end
+        firstrow = first;
+        sectionoffset = payloadoffset;
+    else
+        first = (block - trainblocks - 1) * blockrows + 1;
+        rows = first:min(first + blockrows - 1, ntest);
+        series = readseries(test, 'test', rows);
+        D = calcblock(train, ntrain, chunkcols, series, rows, previous, 'testtrain', distfun, blockoptions);
+        firstrow = ntrain + first;
+        sectionoffset = payloadoffset + bytes * ntrain ^ 2;
+    end
+
+    % Write the distances, then the quantization of the rows, and only
+    % then flag the block
+    blockmax = max([-Inf; D(:)]);
+    if classcode == 3
+        [D, table] = quantize(D);
+        fseek(f, rowoffset + 16 * (firstrow - 1), 'bof');
+        fwrite(f, table', 'double');
+    end
+    fseek(f, sectionoffset + bytes * ntrain * (first - 1), 'bof');
+    fwrite(f, D', payload);
+    fseek(f, blockoffset + 16 * (block - 1), 'bof');
+    fwrite(f, [1 blockmax], 'double');
+end
+clear closefile
+end
+
+
+function D = calcblock(train, ntrain, chunkcols, series, rows, previous, section, distfun, options)
+%Calculate the distances from SERIES, which are the rows ROWS of SECTION,
+%to the training series, "chunkcols" training series at a time. Distances
+%already in the previous cache are read from it instead
+D = zeros(numel(rows), ntrain);
+if isempty(previous)
+    isold = false(size(rows));
+    oldcols = 0;
+else
+    if strcmp(section, 'traintrain')
+        isold = rows <= previous.ntrain;
+    else
+        isold = rows <= previous.ntest;
+    end
+    oldcols = previous.ntrain;
+    if any(isold)
+        D(isold, 1:oldcols) = dists.cacherows(previous, section, rows(isold));
+    end
+end
+
+for first = 1:chunkcols:ntrain
+    cols = first:min(first + chunkcols - 1, ntrain);
+    newcols = cols(cols > oldcols);
+    if all(isold) && isempty(newcols)
+        continue
+    end
+    chunk = readseries(train, 'train', cols);
+    if any(~isold)
+        [~, D(~isold, cols)] = dists.calcmatrix(chunk, series(~isold, :), distfun, options);
+    end
+    if any(isold) && ~isempty(newcols)
+        [~, D(isold, newcols)] = dists.calcmatrix(chunk(newcols - first + 1, :), series(isold, :), distfun, ...
+            options);
+    end
+end
+end
+
+
+function S = readseries(data, name, rows)
+%Return the rows ROWS, which must be consecutive, of a data set in memory
+%or of the variable NAME of a MATFILE
+if ~isa(data, 'matlab.io.MatFile')
+    S = data(rows, :);
+elseif strcmp(name, 'train')
+    S = data.train(rows(1):rows(end), :);
+else
+    S = data.test(rows(1):rows(end), :);
+end
+end
+
+
+function createcache(path, classcode, ntrain, ntest, blockrows)
+%Write the header and empty tables, and extend the file to its full size
+[blockoffset, rowoffset, payloadoffset, filesize] = sectionoffsets(classcode, ntrain, ntest, blockrows);
+f = fopen(path, 'w', 'l');
+tb.assert(f ~= -1, 'Can''t create cache %s', path);
+fwrite(f, 'TBDMCACH', 'char');
+fwrite(f, [1 classcode], 'uint32');
+fwrite(f, [ntrain ntest blockrows blockoffset rowoffset payloadoffset], 'uint64');
+% FSEEK does not go past the end of the file, so the payload is filled
+% with zeros in chunks of up to 64 MB
+remaining = filesize - 64;
+while remaining > 0
+    chunk = min(remaining, 2 ^ 26);
+    fwrite(f, zeros(1, chunk, 'uint8'), 'uint8');
+    remaining = remaining - chunk;
+end
+fclose(f);
+end
+
+
+function [blockoffset, rowoffset, payloadoffset, filesize] = sectionoffsets(classcode, ntrain, ntest, blockrows)
+%Return the offsets of the sections of the cache file
+numblocks = ceil(ntrain / blockrows) + ceil(ntest / blockrows);
+bytes = [8 4 2];
+blockoffset = 64;
+if classcode == 3
+    rowoffset = blockoffset + 16 * numblocks;
+    payloadoffset = rowoffset + 16 * (ntrain + ntest);
+else
+    rowoffset = 0;
+    payloadoffset = blockoffset + 16 * numblocks;
+end
+filesize = payloadoffset + bytes(classcode) * ntrain * (ntrain + ntest);
+end
+
+
+function [Q, table] = quantize(D)
+%Quantize each row of D to 0..65534 between its smallest and largest
+%finite distances; 65535 is NaN
+D(~isfinite(D)) = NaN;
+lo = min(D, [], 2);
+hi = max(D, [], 2);
+lo(isnan(lo)) = 0;
+hi(isnan(hi)) = 0;
+scale = (hi - lo) / 65534;
+scale(scale == 0) = 1;
+Q = round(bsxfun(@rdivide, bsxfun(@minus, D, lo), scale));
+Q(isnan(Q)) = 65535;
+table = [lo scale];
+end
@@ -19,10 +19,28 @@ function [traintrain, testtrain] = cached(dsname, varargin)
 %   between the pairs of the time series in the training data set as well
 %   the the m-by-n matrix for the distance between each test time series
 %   and training time series.
+%
+%   If a complete binary cache written by DISTS.BUILDCACHE exists at the
+%   path given by DISTS.CACHEPATH, the matrices are read from it instead of
+%   the .mat file. If the binary cache is incomplete, because its build was
+%   interrupted or is still running, the .mat file is read, and an
+%   exception is raised if there is none. To read only some rows, use
+%   DISTS.OPENCACHE and DISTS.CACHEROWS.
 
 %   This file is part of TimeBox. Copyright 2015-16 Rafael Giusti
-%   Revision 0.1.1
-cachepath = dists.cachepath(dsname, varargin{:});
+%   Revision 0.2.1
+[cachepath, binpath] = dists.cachepath(dsname, varargin{:});
+if exist(binpath, 'file')
+    cache = dists.opencache(binpath);
+    if cache.complete
+        traintrain = dists.cacherows(cache, 'traintrain');
+        if nargout >= 2
+            testtrain = dists.cacherows(cache, 'testtrain');
+        end
+        return
+    end
+    tb.assert(exist(cachepath, 'file'), 'Cache %s is incomplete', binpath);
+end
 tb.assert(exist(cachepath, 'file'), 'Cache %s does not exist', cachepath);
 data = load(cachepath);
 traintrain = data.traintrain;
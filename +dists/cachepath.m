@@ -1,4 +1,4 @@
-function path = cachepath(dsname, varargin)
+function [path, binpath] = cachepath(dsname, varargin)
 %DISTS.CACHEPATH Returns a path to be used as cache for a particular
 %combination of data set, distance function, and decision space. This is an
 %internal function for DISTS.ISCACHED, DISTS.CACHEMATRIX, and DISTS.CACHED.
@@ -15,9 +15,12 @@ function path = cachepath(dsname, varargin)
 %
 %   CACHEPATH(DSNAME,DIST,REPNAME) both distance and representation are
 %   taken from the argument list
+%
+%   [P,B] = CACHEPATH(...) also returns the path B to the binary cache of
+%   DISTS.BUILDCACHE, which is P with the extension .tbdm instead of .mat
 
 %   This file is part of TimeBox. Copyright 2016 Rafael Giusti
-%   Revision 0.1.1
+%   Revision 0.2.0
 tb.assert(nargin >= 1 && nargin <= 3, 'Function called with wrong number of arguments (should be 1, 2, or 3)');
 if nargin == 1
     % Called as CACHEPATH(DSNAME)
@@ -48,4 +51,5 @@ if ~timedomain
 else
     path = [dspath dsname '/distances/' dsname '-' distname '.mat'];    
 end
+binpath = [path(1:end-4) '.tbdm'];
 end
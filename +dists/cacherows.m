@@ -0,0 +1,50 @@
+function D = cacherows(cache, section, rows)
+%DISTS.CACHEROWS Read rows of a distance matrix from a binary cache.
+%   CACHEROWS(CACHE,SECTION,ROWS) returns the rows ROWS of the distance
+%   matrix SECTION, which must be either 'traintrain' or 'testtrain', as a
+%   matrix of double with one column per training series. CACHE is either
+%   a struct returned by DISTS.OPENCACHE or the path to the cache file.
+%   Only the requested rows are read from the file.
+%
+%   CACHEROWS(CACHE,SECTION) returns the whole matrix.
+%
+%   Rows of blocks that DISTS.BUILDCACHE has not calculated yet are
+%   returned as NaN.
+
+%   This file is part of TimeBox. Copyright 2015-17 Rafael Giusti
+%   Revision 0.1
+if ischar(cache)
+    cache = dists.opencache(cache);
+end
+switch section
+    case 'traintrain'
+        numrows = cache.ntrain;
+        firstblock = 0;
+        firstrow = 0;
+    case 'testtrain'
+        numrows = cache.ntest;
+        firstblock = ceil(cache.ntrain / cache.blockrows);
+        firstrow = cache.ntrain;
+    otherwise
+        error(['Unknown cache section: ' section]);
+end
+if ~exist('rows', 'var')
+    rows = 1:numrows;
+end
+rows = rows(:)';
+tb.assert(all(rows >= 1 & rows <= numrows & rows == round(rows)), 'Rows out of range for section %s', section);
+
+if isempty(rows)
+    D = zeros(0, cache.ntrain);
+    return
+end
+D = double(cache.(section).Data.x(:, rows)');
+if strcmp(cache.class, 'uint16')
+    table = cache.rowtable(firstrow + rows, :);
+    nanmask = D == 65535;
+    D = bsxfun(@plus, table(:, 1), bsxfun(@times, D, table(:, 2)));
+    D(nanmask) = NaN;
+end
+done = cache.blocks(firstblock + floor((rows - 1) / cache.blockrows) + 1, 1);
+D(~done, :) = NaN;
+end
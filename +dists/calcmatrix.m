@@ -16,6 +16,19 @@ function [traintrain, testtrain] = calcmatrix(train, test, distfun, options)
 %   If your distance function does not guarantee reflexivity or symmetry,
 %   this must be specified in an OPTS object.
 %
+%   CALCMATRIX(DS,[],DISTNAME), where DISTNAME is a char array, calculates
+%   the matrix with the native engine in +dists/calcmatrix_mex.cpp. The
+%   accepted names are those of MODELS.NN1FAST, including the elastic
+%   distances, and 'squared_euclidean'. CALCMATRIX(DS) is the same as
+%   CALCMATRIX(DS,[],'euclidean'). The engine splits the matrix into tiles,
+%   which are calculated by several threads, and, for a symmetric distance,
+%   only the pairs above the diagonal are calculated. The distances are the
+%   ones of MODELS.NN1FAST_MEX, which guard some divisions and logarithms
+%   with "epsilon", so they may differ from the functions in the +DISTS
+%   package for series with zeros or negative observations. The DTW is the
+%   same as DISTS.DTW_Cpp, and the handle @DISTS.DTW_Cpp is also calculated
+%   by the native engine.
+%
 %   [TRAINTRAIN,TESTTRAIN] = CALCMATRIX(TRAIN,TEST,...) does the same as
 %   the previous formats, but in addition to calculating the distance
 %   between pairs of series in the training data set, returns the distance
@@ -44,12 +57,43 @@ function [traintrain, testtrain] = calcmatrix(train, test, distfun, options)
 %       dists::arg              (default: --)
 %       dists::symmetric        (default: 1)
 %       dists::reflexive        (default: 1)
+%       dists::threads          (default: 0)
+%       dists::gemm             (default: 1)
+%       dists::batch            (default: 1)
+%       dists::traintrain       (default: 1)
+%       epsilon                 (default: 1e-10)
 %
 %   If the "measure arg" option is present, its value is passed as a third
-%   argument to the distance function.
+%   argument to the distance function. For DTW, it is the length of the
+%   Sakoe-Chiba window, which is 10% of the series length by default,
+%   unless "dists::window" is present. The window and the parameters of the
+%   other elastic distances are the options of DISTS.ELASTICPARAMS.
+%
+%   The option "dists::threads" sets the number of threads of the native
+%   engine. If 0, one thread per processor is used.
+%
+%   If "dists::gemm" is true, the native engine calculates the Euclidean
+%   and the cosine distances from the dot products between the series,
+%   which are multiplied in cache-sized blocks, and from the norms of the
+%   series. This is much faster for large data sets. The distances differ
+%   from those of the pairwise calculation only by rounding; near-duplicate
+%   series, whose distance would be lost to cancellation, are calculated
+%   again from the differences of their observations.
+%
+%   If "dists::batch" is true, the native engine calculates the DTW and
+%   DDTW of 4, 8 or 16 pairs at once, one pair per lane of the vector
+%   instructions of the processor. The distances are exactly those of the
+%   pairwise calculation.
+%
+%   If "dists::traintrain" is false, only TESTTRAIN is calculated and
+%   TRAINTRAIN is returned as [].
+%
+%   The matrices are returned in memory. For data sets whose matrices (or
+%   series) do not fit in memory, DISTS.BUILDCACHE calculates them block by
+%   block into a file, within a memory budget.
 
 %   This file is part of TimeBox. Copyright 2015-16 Rafael Giusti
-%   Revision 0.1
+%   Revision 0.7.1
 if ~exist('test', 'var')
     test = [];
 end
@@ -64,32 +108,61 @@ else
     measurearg = [];
 end
 
-if exist('distfun', 'var') && ~isempty(distfun)
+if ~exist('distfun', 'var') || isempty(distfun)
+    distfun = 'euclidean';
+elseif isequal(distfun, @dists.DTW_Cpp)
+    distfun = 'dtw';
+end
+
+if ischar(distfun)
+    squared = strcmpi(distfun, 'squared_euclidean');
+    if squared
+        distcode = 1;
+    else
+        distcode = models.nn1fast([], [], distfun);
+    end
+    if strcmpi(distfun, 'dtw') && ~measurehasarg
+        measurearg = ceil(0.1 * (size(train, 2) - 1));
+    end
+    tb.assert(~isempty(distcode), ['Unsupported distance: ' distfun]);
+    mexoptions = struct('symmetric', opts.get(options, 'dists::symmetric', 1), ...
+        'reflexive', opts.get(options, 'dists::reflexive', 1), ...
+        'threads', opts.get(options, 'dists::threads', 0), ...
+        'epsilon', opts.get(options, 'epsilon', 1e-10), ...
+        'squared', squared, ...
+        'gemm', opts.get(options, 'dists::gemm', 1), ...
+        'batch', opts.get(options, 'dists::batch', 1), ...
+        'traintrain', opts.get(options, 'dists::traintrain', 1));
+    params = dists.elasticparams(options);
+    for name = fieldnames(params)'
+        mexoptions.(name{1}) = params.(name{1});
+    end
+    if distcode == 60 && ~opts.has(options, 'dists::window')
+        mexoptions.window = measurearg;
+    elseif distcode == 4 && measurehasarg && ~opts.has(options, 'dists::minkowski p')
+        mexoptions.minkowski_p = measurearg;
+    end
+
+    % As for MODELS.NN1FAST_MEX, series go in columns with the class in the
+    % first row
+    if isempty(test)
+        testdata = zeros(0, 0, class(train));
+    else
+        testdata = test';
+    end
+    [traintrain, testtrain] = dists.calcmatrix_mex(train', testdata, distcode, mexoptions);
+else
     symmetric = opts.get(options, 'dists::symmetric', 1);
     reflexive = opts.get(options, 'dists::reflexive', 1);
     
-    traintrain = distoftraintrain(train, distfun, symmetric, reflexive, measurehasarg, measurearg);
+    if opts.get(options, 'dists::traintrain', 1)
+        traintrain = distoftraintrain(train, distfun, symmetric, reflexive, measurehasarg, measurearg);
+    else
+        traintrain = [];
+    end
     if ~isempty(test)
         testtrain = distoftesttrain(train, test, distfun, measurehasarg, measurearg);
     end
-else
-    % For the Euclidean distance we use the native DIST(X) function, which
-    % returns the distance between all pairs of objects in the X matrix.
-    % DIST works column-wise, that is, each object is a column. In our data
-    % sets, time series are rows, so we have to fix for that
-    if isempty(test)
-        traintrain = dist(train(:, 2:end)')';
-    else
-        % If is usually faster to calculate the distance between all
-        % possible pairs and then get the relevant parts than running a FOR
-        % for test vs. train
-        fulldata = [train(:, 2:end); test(:, 2:end)];
-        fullmatrix = dist(fulldata')';
-        n = size(train, 1);
-        traintrain = fullmatrix(1:n, 1:n);
-        testtrain = fullmatrix(n+1:end, 1:n);        
-    end    
-end
 end
 
 
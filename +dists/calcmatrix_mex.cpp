@@ -0,0 +1,690 @@
+/* Native engine for DISTS.CALCMATRIX. Calculates the train vs. train and
+ * the test vs. train distance matrices of a data set with any distance of
+ * MODELS.NN1FAST, including the elastic distances, splitting the matrices
+ * into tiles that are calculated by several threads. DTW and DDTW are
+ * calculated for several pairs at once by the kernels of calcmatrix_simd.cpp.
+ */
+
+/* This file is part of TimeBox. Copyright 2015-17 Rafael Giusti
+ * Revision 0.5.3
+ */
+
+#include "mex.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include <thread>
+#include <atomic>
+
+/* The distance functions of nn1fast_mex.c print nothing here
+ */
+#define debug(...) do { } while (0)
+
+/* Points "ptr" to the first observation of an instance
+ */
+#define seekstack(_ptr, _stack, _instance, _len) do { \
+	(_ptr) = (_stack) + ((_instance) - 1) * (_len) + 1; \
+} while (0)
+
+/* Check if a float is larger
+ */
+#define FLT_GT(_flt1, _flt2, _eps) \
+	(fabs((_flt1) - (_flt2)) > (_eps) && (_flt1) > (_flt2))
+
+/* Only the pairwise distances of nn1fast_distances.c are used here, not
+ * its vectorized searches
+ */
+#define NN1_NOSIMD
+
+#define real double
+#define PRECISION(_name) _name
+#include "../+models/nn1fast_distances.c"
+#undef real
+#undef PRECISION
+
+#define real float
+#define PRECISION(_name) _name ## _single
+#include "../+models/nn1fast_distances.c"
+#undef real
+#undef PRECISION
+
+/* The batched DTW kernels take two vectors of pairs per cell, that is, 4,
+ * 8 or 16 pairs with SSE, AVX2 or AVX-512
+ */
+#define BATCH_LANES(_width) (2 * (_width))
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_SIMD 1
+#include <immintrin.h>
+
+#pragma GCC push_options
+#pragma GCC optimize ("fp-contract=off")
+#pragma GCC target ("sse4.1")
+#define SIMD_SUFFIX sse4
+#define SIMD_WIDTH 2
+#include "calcmatrix_simd.cpp"
+#undef SIMD_SUFFIX
+#undef SIMD_WIDTH
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC optimize ("fp-contract=off")
+#pragma GCC target ("avx2")
+#define SIMD_SUFFIX avx2
+#define SIMD_WIDTH 4
+#include "calcmatrix_simd.cpp"
+#undef SIMD_SUFFIX
+#undef SIMD_WIDTH
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC optimize ("fp-contract=off")
+#pragma GCC target ("avx512f")
+#define SIMD_SUFFIX avx512
+#define SIMD_WIDTH 8
+#include "calcmatrix_simd.cpp"
+#undef SIMD_SUFFIX
+#undef SIMD_WIDTH
+#pragma GCC pop_options
+#else
+#define HAVE_SIMD 0
+#endif
+
+typedef void (*batchkernel)(const double *a, const double *b, int n, int w,
+		double *rows, double *out);
+
+/* Side of the square tiles the matrices are split into
+ */
+#define TILE 64
+
+/* The Euclidean and the cosine distances are calculated from the dot
+ * products of a tile, which are multiplied in blocks of GEMM_K observations
+ * so that the packed series of both sides stay in the cache
+ */
+#define GEMM_K 256
+
+/* Pairs whose squared Euclidean distance is smaller than this fraction of
+ * the sum of their squared norms (or whose cosine distance is smaller
+ * than this) lose too many digits to cancellation, so they are calculated
+ * again from the differences of the observations
+ */
+#define CANCELLATION 1e-3
+
+/* A block of one of the output matrices. Rows are series of "rowset"
+ * (the training or the test set) and columns are training series
+ */
+struct tile {
+	double *out;
+	int nrows;          /* number of rows of the output matrix */
+	int firstrow, firstcol;
+	bool traintrain;
+};
+
+/* Everything the threads need to fill the tiles
+ */
+template <typename T>
+struct engine {
+	T *train, *test;
+	int rows;           /* observations per series, plus the class */
+	int ntrain, ntest;
+	int distcode;
+	bool symmetric, reflexive;
+	bool squared;       /* do not take the root of the Euclidean distance */
+	bool gemm;          /* use dot products for codes 1 and 20 */
+	double epsilon;
+	double (*distfun)(T *, T *, int, double, double);
+	double (*elasticfun)(T *, T *, int, double, double, double *);
+	batchkernel batch;  /* batched DTW for codes 60 and 61, or NULL */
+	int lanes;          /* pairs per call of "batch" */
+	int window;         /* window of the batched DTW */
+	std::vector<double> trainnorms, testnorms;
+	std::vector<tile> tiles;
+};
+
+/* Buffers of a thread. These are allocated with malloc() because
+ * mxCalloc() may not be called from the workers
+ */
+struct workspace {
+	double *packa, *packb;  /* GEMM_K rows of TILE observations each */
+	double *gram;           /* TILE-by-TILE dot products */
+	double *batcha, *batchb;  /* interleaved series of a batch of pairs */
+	double *batchrows;      /* cost rows of the batched DTW */
+	double *batchout;       /* distances of the batch */
+	int *batchpairs;        /* row and column of each pair in the batch */
+	int batchsize;          /* pairs in the batch */
+	double *elasticrows;    /* cost rows of the elastic distances */
+};
+
+/* Distance between two series, each pointing at its class
+ */
+template <typename T>
+inline double distance(engine<T> *e, T *s, T *z, workspace *w)
+{
+	if (e->elasticfun) {
+		return e->elasticfun(s + 1, z + 1, e->rows, INFINITY, e->epsilon,
+				w->elasticrows);
+	}
+	if (e->distcode == 1 && !e->squared)
+		return sqrt(e->distfun(s + 1, z + 1, e->rows, INFINITY, e->epsilon));
+	return e->distfun(s + 1, z + 1, e->rows, INFINITY, e->epsilon);
+}
+
+/* Choose the batched DTW kernel for the widest instruction set supported
+ * by the processor, if "batch" is set and the distance is DTW or DDTW
+ */
+template <typename T>
+void selectbatch(engine<T> *e, bool batch)
+{
+	e->batch = NULL;
+	e->lanes = 1;
+	e->window = elasticwindow(e->rows - 1);
+#if HAVE_SIMD
+	if (!batch || (e->distcode != 60 && e->distcode != 61))
+		return;
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f")) {
+		e->batch = dtwbatch_avx512;
+		e->lanes = BATCH_LANES(8);
+	}
+	else if (__builtin_cpu_supports("avx2")) {
+		e->batch = dtwbatch_avx2;
+		e->lanes = BATCH_LANES(4);
+	}
+	else if (__builtin_cpu_supports("sse4.1")) {
+		e->batch = dtwbatch_sse4;
+		e->lanes = BATCH_LANES(2);
+	}
+#endif
+}
+
+/* Derivative of DDTW at observation i, in the precision of the series
+ */
+inline double seriesderivative(double *s, int i, int n)
+{
+	return derivative(s, i, n);
+}
+
+inline double seriesderivative(float *s, int i, int n)
+{
+	return derivative_single(s, i, n);
+}
+
+/* Copy the observations (or, for DDTW, the derivatives) of a series into
+ * lane "lane" of an interleaved batch
+ */
+template <typename T>
+void interleave(engine<T> *e, T *s, int lane, double *batch)
+{
+	int n = e->rows - 1;
+
+	s++;
+	for (int i = 0; i < n; i++) {
+		batch[(long long)i * e->lanes + lane] = e->distcode == 61 ?
+			seriesderivative(s, i, n) : (double)s[i];
+	}
+}
+
+/* Sum of the squared observations of each series, to complete the dot
+ * products into distances
+ */
+template <typename T>
+void squarednorms(T *stack, int rows, int n, std::vector<double> &norms)
+{
+	norms.resize(n);
+	for (int i = 0; i < n; i++) {
+		T *s = stack + (long long)i * rows + 1;
+		double norm = 0;
+		for (int k = 0; k < rows - 1; k++)
+			norm += (double)s[k] * s[k];
+		norms[i] = norm;
+	}
+}
+
+/* Copy observations "first" to "first + count - 1" of the series "index"
+ * to "index + n - 1" into "pack", observation by observation, converted to
+ * double and padded with zeros up to TILE series
+ */
+template <typename T>
+void packseries(T *stack, int rows, int index, int n, int first, int count,
+		double *pack)
+{
+	for (int i = 0; i < n; i++) {
+		T *s = stack + (long long)(index + i) * rows + 1 + first;
+		for (int k = 0; k < count; k++)
+			pack[k * TILE + i] = s[k];
+	}
+	for (int i = n; i < TILE; i++) {
+		for (int k = 0; k < count; k++)
+			pack[k * TILE + i] = 0;
+	}
+}
+
+/* Add the products of "count" packed observations to the dot products of a
+ * 4-by-8 block of the tile. The block is summed in registers and the
+ * inner loop is simple enough for the compiler to vectorize
+ */
+inline void gemmblock(const double *packa, const double *packb, int count,
+		double *gram)
+{
+	double acc[4][8] = {{0}};
+	for (int k = 0; k < count; k++) {
+		const double *a = packa + k * TILE;
+		const double *b = packb + k * TILE;
+		for (int i = 0; i < 4; i++) {
+			for (int j = 0; j < 8; j++)
+				acc[i][j] += a[i] * b[j];
+		}
+	}
+	for (int i = 0; i < 4; i++) {
+		for (int j = 0; j < 8; j++)
+			gram[i + j * TILE] += acc[i][j];
+	}
+}
+
+/* Fill w->gram with the dot products between series "firstrow" to
+ * "firstrow + nr - 1" of "rowset" and the training series "firstcol" to
+ * "firstcol + nc - 1"
+ */
+template <typename T>
+void gramtile(engine<T> *e, T *rowset, int firstrow, int nr, int firstcol,
+		int nc, workspace *w)
+{
+	int len = e->rows - 1;
+
+	memset(w->gram, 0, sizeof (double) * TILE * TILE);
+	for (int first = 0; first < len; first += GEMM_K) {
+		int count = len - first < GEMM_K ? len - first : GEMM_K;
+		packseries(rowset, e->rows, firstrow, nr, first, count, w->packa);
+		packseries(e->train, e->rows, firstcol, nc, first, count, w->packb);
+		for (int j = 0; j < nc; j += 8) {
+			for (int i = 0; i < nr; i += 4)
+				gemmblock(w->packa + i, w->packb + j, count,
+						w->gram + i + j * TILE);
+		}
+	}
+}
+
+/* Euclidean or cosine distance from the dot product "dot" of two series
+ * and their squared norms. Near-duplicate pairs are calculated again from
+ * the observations: the squared Euclidean distance by the pairwise kernel
+ * and the cosine distance as half the squared distance between the series
+ * scaled to unit norm, which does not cancel
+ */
+template <typename T>
+double gemmdistance(engine<T> *e, T *s, T *z, double dot, double norms,
+		double normz, workspace *w)
+{
+	double dist;
+
+	if (e->distcode == 1) {
+		dist = norms + normz - 2 * dot;
+		if (dist < CANCELLATION * (norms + normz))
+			return distance(e, s, z, w);
+		return e->squared ? dist : sqrt(dist);
+	}
+
+	dist = 1 - dot / (sqrt(norms) * sqrt(normz));
+	if (dist < CANCELLATION) {
+		double scales = 1 / sqrt(norms), scalez = 1 / sqrt(normz);
+		dist = 0;
+		for (int k = 1; k < e->rows; k++) {
+			double diff = s[k] * scales - z[k] * scalez;
+			dist += diff * diff;
+		}
+		dist /= 2;
+	}
+	return dist;
+}
+
+/* Write the distance of the pair (i,j) of a tile, and mirror it if the
+ * distance is symmetric
+ */
+template <typename T>
+inline void storecell(engine<T> *e, tile *t, int i, int j, double dist)
+{
+	t->out[i + (long long)j * t->nrows] = dist;
+	if (i != j && t->traintrain && e->symmetric)
+		t->out[j + (long long)i * t->nrows] = dist;
+}
+
+/* Calculate the pairs collected in the batch of "w" and store them. Empty
+ * lanes repeat the first pair, and their results are dropped
+ */
+template <typename T>
+void flushbatch(engine<T> *e, tile *t, workspace *w)
+{
+	T *rowset = t->traintrain ? e->train : e->test;
+
+	if (!w->batchsize)
+		return;
+	for (int l = 0; l < e->lanes; l++) {
+		int p = l < w->batchsize ? l : 0;
+		int i = w->batchpairs[2 * p], j = w->batchpairs[2 * p + 1];
+		interleave(e, rowset + (long long)i * e->rows, l, w->batcha);
+		interleave(e, e->train + (long long)j * e->rows, l, w->batchb);
+	}
+	e->batch(w->batcha, w->batchb, e->rows - 1, e->window, w->batchrows,
+			w->batchout);
+	for (int l = 0; l < w->batchsize; l++) {
+		storecell(e, t, w->batchpairs[2 * l], w->batchpairs[2 * l + 1],
+				w->batchout[l]);
+	}
+	w->batchsize = 0;
+}
+
+/* Fill one tile. With a symmetric distance, only the tiles on and above
+ * the diagonal of the train vs. train matrix are listed, and each pair is
+ * also written to the mirrored cell. With a batched kernel, the pairs are
+ * collected and calculated "lanes" at a time
+ */
+template <typename T>
+void filltile(engine<T> *e, tile *t, workspace *w)
+{
+	T *rowset = t->traintrain ? e->train : e->test;
+	double *rownorms = t->traintrain ? &e->trainnorms[0] : &e->testnorms[0];
+	int lastrow = t->firstrow + TILE < t->nrows ? t->firstrow + TILE : t->nrows;
+	int lastcol = t->firstcol + TILE < e->ntrain ? t->firstcol + TILE : e->ntrain;
+	bool gemm = e->gemm && (e->distcode == 1 || e->distcode == 20);
+
+	if (gemm) {
+		gramtile(e, rowset, t->firstrow, lastrow - t->firstrow,
+				t->firstcol, lastcol - t->firstcol, w);
+	}
+
+	for (int j = t->firstcol; j < lastcol; j++) {
+		T *z = e->train + (long long)j * e->rows;
+		for (int i = t->firstrow; i < lastrow; i++) {
+			T *s = rowset + (long long)i * e->rows;
+			double dist;
+			if (t->traintrain && ((e->symmetric && i > j) ||
+						(e->reflexive && i == j))) {
+				if (i == j)
+					t->out[i + (long long)j * t->nrows] = 0;
+				continue;
+			}
+			if (e->batch) {
+				w->batchpairs[2 * w->batchsize] = i;
+				w->batchpairs[2 * w->batchsize + 1] = j;
+				if (++w->batchsize == e->lanes)
+					flushbatch(e, t, w);
+				continue;
+			}
+			if (gemm) {
+				dist = w->gram[(i - t->firstrow) + (j - t->firstcol) * TILE];
+				dist = gemmdistance(e, s, z, dist, rownorms[i],
+						e->trainnorms[j], w);
+			}
+			else {
+				dist = distance(e, s, z, w);
+			}
+			storecell(e, t, i, j, dist);
+		}
+	}
+	flushbatch(e, t, w);
+}
+
+/* List the tiles and fill them with "numthreads" threads, each taking the
+ * next tile available
+ */
+template <typename T>
+void calcmatrix(engine<T> *e, double *traintrain, double *testtrain,
+		int numthreads, bool batch)
+{
+	std::atomic<int> next(0);
+	std::vector<std::thread> workers;
+	tile t;
+
+	t.out = traintrain;
+	t.nrows = e->ntrain;
+	t.traintrain = true;
+	for (t.firstcol = 0; traintrain && t.firstcol < e->ntrain; t.firstcol += TILE) {
+		for (t.firstrow = 0; t.firstrow < e->ntrain; t.firstrow += TILE) {
+			if (!e->symmetric || t.firstrow <= t.firstcol)
+				e->tiles.push_back(t);
+		}
+	}
+	t.out = testtrain;
+	t.nrows = e->ntest;
+	t.traintrain = false;
+	for (t.firstcol = 0; t.firstcol < e->ntrain; t.firstcol += TILE) {
+		for (t.firstrow = 0; t.firstrow < e->ntest; t.firstrow += TILE)
+			e->tiles.push_back(t);
+	}
+
+	if (e->gemm && (e->distcode == 1 || e->distcode == 20)) {
+		squarednorms(e->train, e->rows, e->ntrain, e->trainnorms);
+		squarednorms(e->test, e->rows, e->ntest, e->testnorms);
+	}
+	/* Avoid indexing empty vectors in filltile()
+	 */
+	e->trainnorms.push_back(0);
+	e->testnorms.push_back(0);
+
+	selectbatch(e, batch);
+
+	auto work = [&]() {
+		long long batchcells = e->batch ? (long long)e->lanes *
+			(2 * (e->rows - 1) + 2 * (2 * e->window + 3) + 1) : 0;
+		double *buffer = (double*)malloc(sizeof (double) *
+				(2 * GEMM_K * TILE + TILE * TILE + batchcells) +
+				sizeof (int) * 2 * e->lanes);
+		workspace w;
+		int k;
+
+		w.elasticrows = NULL;
+		if (!buffer || (e->elasticfun && !(w.elasticrows =
+					(double*)malloc(elasticsize(e->rows))))) {
+			free(buffer);
+			return;
+		}
+		w.packa = buffer;
+		w.packb = w.packa + GEMM_K * TILE;
+		w.gram = w.packb + GEMM_K * TILE;
+		w.batcha = w.gram + TILE * TILE;
+		w.batchb = w.batcha + (long long)e->lanes * (e->rows - 1);
+		w.batchrows = w.batchb + (long long)e->lanes * (e->rows - 1);
+		w.batchout = w.batchrows + 2LL * e->lanes * (2 * e->window + 3);
+		w.batchpairs = (int*)(w.gram + TILE * TILE + batchcells);
+		w.batchsize = 0;
+		while ((k = next.fetch_add(1)) < (int)e->tiles.size())
+			filltile(e, &e->tiles[k], &w);
+		free(w.elasticrows);
+		free(buffer);
+	};
+	for (int i = 1; i < numthreads; i++)
+		workers.push_back(std::thread(work));
+	work();
+	for (size_t i = 0; i < workers.size(); i++)
+		workers[i].join();
+	if (next < (int)e->tiles.size())
+		mexErrMsgTxt("Error allocating memory\n");
+}
+
+/* Read a scalar field from the OPTIONS struct
+ */
+double getoption(const mxArray *options, const char *name, double defvalue)
+{
+	mxArray *field;
+
+	if (!(field = mxGetField(options, 0, name)))
+		return defvalue;
+	if (!(mxIsDouble(field) || mxIsLogical(field)) || mxIsComplex(field) ||
+			mxGetNumberOfElements(field) != 1) {
+		char buf[1024];
+		sprintf(buf, "Field \"%s\" of OPTIONS must be a non-complex "
+				"scalar", name);
+		mexErrMsgTxt(buf);
+	}
+	return mxGetScalar(field);
+}
+
+void mexFunction(int nleft, mxArray *left[], int nright, const mxArray *right[])
+{
+	/*
+	 *  Usage:
+	 *
+	 *     [traintrain, testtrain] = mexFunction(train, test, distcode, ...
+	 *                                           options)
+	 *
+	 *  Where the input arguments are:
+	 *
+	 *     train     - the training data set* (DOUBLE or SINGLE)
+	 *     test      - the test data set*, of the same class as TRAIN, or
+	 *                 [] if there is no test data
+	 *     distcode  - a distance code of MODELS.NN1FAST
+	 *     options   - a scalar struct with the fields below
+	 *
+	 *  The fields accepted in OPTIONS are:
+	 *
+	 *     symmetric - if true, only the pairs (i,j) with i < j of the
+	 *                 training set are calculated and mirrored (default:
+	 *                 true)
+	 *     reflexive - if true, the diagonal of TRAINTRAIN is set to 0
+	 *                 instead of calculated (default: true)
+	 *     window    - the Sakoe-Chiba window of the elastic distances
+	 *                 (default: Inf)
+	 *     wdtw_g, erp_g, lcss_epsilon, msm_c, twe_nu, twe_lambda - the
+	 *                 parameters of the elastic distances, as read by
+	 *                 MODELS.NN1FAST_MEX
+	 *     epsilon   - tolerance threshold for float operations (default:
+	 *                 1e-10)
+	 *     squared   - if true, the Euclidean distance is not square-rooted
+	 *                 (default: false)
+	 *     gemm      - if true, the Euclidean and the cosine distances are
+	 *                 calculated from blocked dot products (default: true)
+	 *     batch     - if true, DTW and DDTW are calculated for several
+	 *                 pairs at once, one pair per vector lane (default:
+	 *                 true)
+	 *     traintrain - if false, TRAINTRAIN is not calculated and is
+	 *                  returned empty (default: true)
+	 *     threads   - number of threads; 0 means one per processor
+	 *                 (default: 0)
+	 *
+	 *  And the output arguments are:
+	 *
+	 *     traintrain - n-by-n matrix with the distance between each pair
+	 *                  of training series
+	 *     testtrain  - m-by-n matrix with the distance from each test
+	 *                  series to each training series
+	 *
+	 *  *As in MODELS.NN1FAST_MEX, this MEX requires the instances in the
+	 *  columns and the observations in the rows, and the first row holds
+	 *  the classes. The classes are ignored.
+	 *
+	 *  The distances are the same calculated by MODELS.NN1FAST_MEX (except
+	 *  that the Euclidean distance is not squared), and DTW (code 60) is the
+	 *  same calculated by DISTS.DTW_Cpp. Observations in single precision are
+	 *  converted to double before any arithmetic.
+	 *
+	 *  With "gemm", the squared Euclidean distance is calculated as
+	 *  |s|^2 + |z|^2 - 2 s'z and the cosine distance as 1 - s'z/(|s||z|),
+	 *  with the dot products of each tile multiplied as a small matrix
+	 *  product. The result differs from the pairwise kernels only by the
+	 *  order of the sums, except for near-duplicate pairs, which are
+	 *  calculated again from the differences of the observations.
+	 *
+	 *  With "batch", the pairs of DTW (code 60) and DDTW (code 61) of each
+	 *  tile are calculated 4, 8 or 16 at a time, according to the widest
+	 *  of SSE4.1, AVX2 and AVX-512 supported by the processor. The result
+	 *  is the same as that of the pairwise kernels.
+	 */
+	const mxArray *options;
+	bool single;
+	int rows, ntrain, ntest;
+	int distcode;
+	int numthreads;
+	double *traintrain, *testtrain;
+	mxArray *testmat = NULL;
+
+	if (nright != 4) {
+		mexErrMsgTxt("Four inputs required.");
+	}
+
+	/* First argument must be a non-complex matrix of double or single
+	 */
+	rows = mxGetM(right[0]);
+	ntrain = mxGetN(right[0]);
+	single = mxIsSingle(right[0]);
+	if (!(mxIsDouble(right[0]) || single) || mxIsComplex(right[0]) ||
+			rows <= 1) {
+		mexErrMsgTxt("First input (TRAIN) must be a non-complex "
+				"matrix of double or single");
+	}
+
+	/* Second argument may be empty; otherwise, it must have the same
+	 * class and number of rows as the first
+	 */
+	ntest = mxIsEmpty(right[1]) ? 0 : mxGetN(right[1]);
+	if (ntest && ((int)mxGetM(right[1]) != rows ||
+				mxGetClassID(right[1]) != mxGetClassID(right[0]) ||
+				mxIsComplex(right[1]))) {
+		mexErrMsgTxt("Second input (TEST) must be empty or a "
+				"non-complex matrix of the same class and with "
+				"the same number of rows as the first input");
+	}
+
+	if (!mxIsDouble(right[2]) || mxIsComplex(right[2]) ||
+			mxGetNumberOfElements(right[2]) != 1) {
+		mexErrMsgTxt("Third input (DISTCODE) must be a non-complex "
+				"scalar");
+	}
+	distcode = mxGetScalar(right[2]);
+
+	options = right[3];
+	if (!mxIsStruct(options) || mxGetNumberOfElements(options) != 1) {
+		mexErrMsgTxt("Fourth input (OPTIONS) must be a scalar struct");
+	}
+	readelasticparams(options);
+	numthreads = getoption(options, "threads", 0);
+	if (numthreads <= 0) {
+		numthreads = std::thread::hardware_concurrency();
+	}
+	numthreads = numthreads > 1 ? numthreads : 1;
+
+	if (getoption(options, "traintrain", 1)) {
+		left[0] = mxCreateDoubleMatrix(ntrain, ntrain, mxREAL);
+		traintrain = mxGetPr(left[0]);
+	}
+	else {
+		left[0] = mxCreateDoubleMatrix(0, 0, mxREAL);
+		traintrain = NULL;
+	}
+	if (nleft >= 2) {
+		testmat = mxCreateDoubleMatrix(ntest, ntrain, mxREAL);
+		left[1] = testmat;
+	}
+	else {
+		ntest = 0;
+	}
+	testtrain = testmat ? mxGetPr(testmat) : NULL;
+
+#define RUN(_T, _select, _selectelastic) do { \
+	engine<_T> e; \
+	e.train = (_T*)mxGetData(right[0]); \
+	e.test = ntest ? (_T*)mxGetData(right[1]) : NULL; \
+	e.rows = rows; \
+	e.ntrain = ntrain; \
+	e.ntest = ntest; \
+	e.distcode = distcode; \
+	e.symmetric = getoption(options, "symmetric", 1) != 0; \
+	e.reflexive = getoption(options, "reflexive", 1) != 0; \
+	e.epsilon = getoption(options, "epsilon", 1e-10); \
+	e.squared = getoption(options, "squared", 0) != 0; \
+	e.gemm = getoption(options, "gemm", 1) != 0; \
+	e.elasticfun = _selectelastic(distcode); \
+	e.distfun = e.elasticfun ? NULL : _select(distcode); \
+	calcmatrix(&e, traintrain, testtrain, numthreads, \
+			getoption(options, "batch", 1) != 0); \
+} while (0)
+
+	if (single) {
+		RUN(float, selectdistance_single, selectelastic_single);
+	}
+	else {
+		RUN(double, selectdistance, selectelastic);
+	}
+#undef RUN
+}
@@ -0,0 +1,107 @@
+/* This file contains the batched DTW kernel used by calcmatrix_mex.cpp.
+ * It is #included by that file once per instruction set, with these macros
+ * defined:
+ *
+ *     SIMD_SUFFIX   suffix of the kernel name (e.g., avx2)
+ *     SIMD_WIDTH    number of doubles in a vector register
+ *
+ * and with the instruction set enabled by "#pragma GCC target".
+ *
+ * Within one pair, each cell of DTW waits for its left neighbor, so a
+ * single pair leaves most of a vector unit idle. The kernel instead takes
+ * BATCH_LANES(SIMD_WIDTH) pairs of series of the same length and runs
+ * their matrices in lockstep, one pair per lane: observation i of the
+ * series of every lane is stored contiguously, so each row of cells is a
+ * sequence of vector loads, minimums and additions with no shuffles. Two
+ * vectors of lanes are updated per cell so that the dependency on the left
+ * neighbor of one hides the latency of the other.
+ *
+ * Every lane performs the same operations, in the same order, as the
+ * pairwise dtw() and ddtw() of nn1fast_elastic.c, so the distances are
+ * identical to theirs. The including file must compile this with
+ * "fp-contract=off", or the squared difference could be fused into the
+ * addition and rounded differently.
+ */
+
+/* This file is part of TimeBox. Copyright 2015-17 Rafael Giusti
+ * Revision 0.1.0
+ */
+
+#define SIMD_CAT2(_a, _b) _a ## _b
+#define SIMD_CAT(_a, _b) SIMD_CAT2(_a, _b)
+#define SIMD_NAME(_name) SIMD_CAT(_name, SIMD_SUFFIX)
+
+typedef double SIMD_NAME(vec_) __attribute__ ((vector_size (SIMD_WIDTH * sizeof (double))));
+#define vec SIMD_NAME(vec_)
+
+/* DTW of BATCH_LANES(SIMD_WIDTH) pairs with a window of "w" observations.
+ * Observation i of the first series of lane l is a[i * lanes + l], and
+ * likewise for the second series in "b". "rows" must have room for two
+ * rows of 2*w+3 cells of every lane. The distance of lane l, the square
+ * root of the cost of its best path, is written to out[l]
+ */
+void SIMD_NAME(dtwbatch_)(const double *a, const double *b, int n, int w,
+		double *rows, double *out)
+{
+	const int lanes = BATCH_LANES(SIMD_WIDTH);
+	double *cost = rows + lanes;
+	double *cost_prev = cost + (2 * w + 3) * lanes;
+	double *tmp;
+	vec inf = { 0 }, x[2], left[2], up, diag, d;
+	int i, j, k, h, kstart, kend;
+
+	inf += INFINITY;
+
+	/* The cells just outside the band are never written, so they stay
+	 * INF and stand in for the boundary tests of the pairwise code
+	 */
+	for (k = -1; k <= 2 * w + 1; k++) {
+		for (h = 0; h < 2; h++) {
+			memcpy(cost + k * lanes + h * SIMD_WIDTH, &inf, sizeof inf);
+			memcpy(cost_prev + k * lanes + h * SIMD_WIDTH, &inf, sizeof inf);
+		}
+	}
+
+	for (i = 0; i < n; i++) {
+		kstart = w - i > 0 ? w - i : 0;
+		kend = w + (n - 1 - i < w ? n - 1 - i : w);
+		for (h = 0; h < 2; h++) {
+			memcpy(&x[h], a + (long long)i * lanes + h * SIMD_WIDTH, sizeof x[h]);
+			left[h] = inf;
+		}
+		k = kstart;
+		if (i == 0) {
+			for (h = 0; h < 2; h++) {
+				memcpy(&d, b + h * SIMD_WIDTH, sizeof d);
+				d = x[h] - d;
+				left[h] = d * d;
+				memcpy(cost + k * lanes + h * SIMD_WIDTH, &left[h], sizeof left[h]);
+			}
+			k++;
+		}
+		for (; k <= kend; k++) {
+			j = i - w + k;
+			for (h = 0; h < 2; h++) {
+				memcpy(&up, cost_prev + (k + 1) * lanes + h * SIMD_WIDTH, sizeof up);
+				memcpy(&diag, cost_prev + k * lanes + h * SIMD_WIDTH, sizeof diag);
+				memcpy(&d, b + (long long)j * lanes + h * SIMD_WIDTH, sizeof d);
+				d = x[h] - d;
+				d = d * d;
+				up = up < left[h] ? up : left[h];
+				up = up < diag ? up : diag;
+				left[h] = up + d;
+				memcpy(cost + k * lanes + h * SIMD_WIDTH, &left[h], sizeof left[h]);
+			}
+		}
+		tmp = cost;
+		cost = cost_prev;
+		cost_prev = tmp;
+	}
+	for (h = 0; h < lanes; h++)
+		out[h] = sqrt(cost_prev[w * lanes + h]);
+}
+
+#undef vec
+#undef SIMD_NAME
+#undef SIMD_CAT
+#undef SIMD_CAT2
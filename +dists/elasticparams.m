@@ -0,0 +1,42 @@
+function params = elasticparams(options)
+%DISTS.ELASTICPARAMS Parameters of the native elastic distances. This is an
+%internal function for MODELS.NN1FAST and DISTS.CALCMATRIX.
+%   P = ELASTICPARAMS(OPTS) returns the struct read by the MEX files of
+%   MODELS.NN1FAST and DISTS.CALCMATRIX for the elastic distances 'dtw',
+%   'ddtw', 'wdtw', 'erp', 'lcss', 'msm', and 'twe', and for 'minkowski',
+%   with values taken from the OPTS object OPTS.
+%
+%   Options:
+%       dists::window           (default: Inf)
+%       dists::wdtw g           (default: 0.05)
+%       dists::erp g            (default: 0)
+%       dists::lcss epsilon     (default: 1)
+%       dists::msm c            (default: 1)
+%       dists::twe nu           (default: 0.001)
+%       dists::twe lambda       (default: 1)
+%       dists::minkowski p      (default: 2)
+%
+%   "dists::window" is the Sakoe-Chiba window of every elastic distance,
+%   in observations. "dists::wdtw g" is the steepness of the weights of
+%   WDTW, "dists::erp g" the gap value of ERP, "dists::lcss epsilon" the
+%   largest difference between observations matched by LCSS, "dists::msm
+%   c" the cost of a split or merge in MSM, and "dists::twe nu" and
+%   "dists::twe lambda" the stiffness and the deletion penalty of TWE.
+%   "dists::minkowski p" is the exponent of the Minkowski distance.
+
+%   This file is part of TimeBox. Copyright 2015-17 Rafael Giusti
+%   Revision 0.2
+if ~exist('options', 'var')
+    options = opts.empty;
+end
+params = struct('window', opts.get(options, 'dists::window', Inf), ...
+    'wdtw_g', opts.get(options, 'dists::wdtw g', 0.05), ...
+    'erp_g', opts.get(options, 'dists::erp g', 0), ...
+    'lcss_epsilon', opts.get(options, 'dists::lcss epsilon', 1), ...
+    'msm_c', opts.get(options, 'dists::msm c', 1), ...
+    'twe_nu', opts.get(options, 'dists::twe nu', 0.001), ...
+    'twe_lambda', opts.get(options, 'dists::twe lambda', 1), ...
+    'minkowski_p', opts.get(options, 'dists::minkowski p', 2));
+tb.assert(params.window >= 0, 'Option "dists::window" must be non-negative');
+tb.assert(params.minkowski_p > 0, 'Option "dists::minkowski p" must be positive');
+end
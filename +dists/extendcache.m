@@ -0,0 +1,59 @@
+function extendcache(train, test, dsname, varargin)
+%DISTS.EXTENDCACHE Extend the cached distance matrices of a data set after
+%series are appended to it.
+%   EXTENDCACHE(TRAIN,TEST,DSNAME) extends the cached Euclidean distance
+%   matrices of the data set named DSNAME. TRAIN and TEST are the whole
+%   training and test data sets, and the cache must hold the matrices of
+%   their first series. Only the distances involving the series appended
+%   after those are calculated, with DISTS.EXTENDMATRIX, and the cache is
+%   replaced. Both the .mat cache of DISTS.CACHEMATRIX and the binary cache
+%   of DISTS.BUILDCACHE are extended, if present.
+%
+%   EXTENDCACHE(TRAIN,TEST,DSNAME,DIST) extends the cache of the distance
+%   named DIST. The name must be accepted by DISTS.CALCMATRIX.
+%
+%   EXTENDCACHE(TRAIN,TEST,DSNAME,DIST,REPNAME) extends the cache of the
+%   decision space REPNAME instead of the time domain.
+%
+%   EXTENDCACHE(...,OPTS) takes options from the OPTS object OPTS, which
+%   are passed to DISTS.CALCMATRIX and DISTS.BUILDCACHE.
+%
+%   The binary cache is rebuilt into a new file next to it, reusing its
+%   distances through the option "dists::cache previous" of
+%   DISTS.BUILDCACHE, and then moved over the old file. If interrupted, a
+%   new call resumes the new file.
+
+%   This file is part of TimeBox. Copyright 2015-17 Rafael Giusti
+%   Revision 0.1
+if ~isempty(varargin) && opts.isa(varargin{end})
+    options = varargin{end};
+    varargin(end) = [];
+else
+    options = opts.empty;
+end
+if isempty(varargin)
+    distname = [];
+else
+    distname = varargin{1};
+end
+[cachepath, binpath] = dists.cachepath(dsname, varargin{:});
+tb.assert(exist(cachepath, 'file') || exist(binpath, 'file'), 'Cache %s does not exist', cachepath);
+
+if exist(binpath, 'file')
+    cache = dists.opencache(binpath);
+    buildoptions = opts.clone(options);
+    buildoptions('dists::cache previous') = binpath;
+    buildoptions('dists::cache class') = cache.class;
+    buildoptions('dists::cache rows') = cache.blockrows;
+    newpath = [binpath '.new'];
+    dists.buildcache(newpath, train, test, distname, buildoptions);
+    clear cache
+    movefile(newpath, binpath, 'f');
+end
+
+if exist(cachepath, 'file')
+    data = load(cachepath);
+    [traintrain, testtrain] = dists.extendmatrix(data.traintrain, data.testtrain, train, test, distname, options);
+    dists.cachematrix(traintrain, testtrain, dsname, varargin{:});
+end
+end
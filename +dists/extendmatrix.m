@@ -0,0 +1,66 @@
+function [traintrain, testtrain] = extendmatrix(traintrain, testtrain, train, test, distfun, options)
+%DISTS.EXTENDMATRIX Extend distance matrices after series are appended to
+%the training or test data sets.
+%   [TRAINTRAIN,TESTTRAIN] = EXTENDMATRIX(TRAINTRAIN,TESTTRAIN,TRAIN,TEST,
+%   DIST) takes matrices returned by DISTS.CALCMATRIX for the first n
+%   training series and the first m test series of TRAIN and TEST, where n
+%   and m are the number of rows of TRAINTRAIN and TESTTRAIN, and returns
+%   the matrices of the whole TRAIN and TEST. Only the distances involving
+%   the appended series are calculated. TEST may be [] if there are no
+%   test series, and DIST may be anything accepted by DISTS.CALCMATRIX;
+%   with a distance name, the new rows and columns are calculated by the
+%   native engine, in parallel.
+%
+%   EXTENDMATRIX(...,OPTS) takes options from the OPTS object OPTS, which
+%   are passed to DISTS.CALCMATRIX.
+%
+%   Options:
+%       dists::symmetric        (default: 1)
+%       dists::reflexive        (default: 1)
+%
+%   If "dists::symmetric" is true, the distances from the old training
+%   series to the new ones are copied from the new rows instead of
+%   calculated.
+
+%   This file is part of TimeBox. Copyright 2015-17 Rafael Giusti
+%   Revision 0.1
+if ~exist('distfun', 'var')
+    distfun = [];
+end
+if ~exist('options', 'var')
+    options = opts.empty;
+end
+n = size(traintrain, 1);
+m = size(testtrain, 1);
+numtrain = size(train, 1);
+numtest = size(test, 1);
+tb.assert(size(traintrain, 2) == n && numtrain >= n && numtest >= m && (m == 0 || size(testtrain, 2) == n), ...
+    'The matrices do not match the first series of TRAIN and TEST');
+
+% Each call to CALCMATRIX calculates only a test vs. training matrix
+blockoptions = opts.clone(options);
+blockoptions('dists::traintrain') = 0;
+
+if numtrain > n
+    newtrain = train(n+1:end, :);
+    [~, newrows] = dists.calcmatrix(train, newtrain, distfun, blockoptions);
+    if opts.get(options, 'dists::reflexive', 1)
+        newrows(sub2ind(size(newrows), 1:numtrain-n, n+1:numtrain)) = 0;
+    end
+    if opts.get(options, 'dists::symmetric', 1)
+        newcols = newrows(:, 1:n)';
+    else
+        [~, newcols] = dists.calcmatrix(newtrain, train(1:n, :), distfun, blockoptions);
+    end
+    traintrain = [traintrain newcols; newrows];
+
+    if m > 0
+        [~, newcols] = dists.calcmatrix(newtrain, test(1:m, :), distfun, blockoptions);
+        testtrain = [testtrain newcols];
+    end
+end
+if numtest > m
+    [~, newrows] = dists.calcmatrix(train, test(m+1:end, :), distfun, blockoptions);
+    testtrain = [reshape(testtrain, m, []); newrows];
+end
+end
@@ -0,0 +1,83 @@
+function [neighbors, distances] = extendneighbors(neighbors, distances, distmatrix, numcols, options)
+%DISTS.EXTENDNEIGHBORS Update lists of nearest neighbors after a distance
+%matrix is extended with DISTS.EXTENDMATRIX.
+%   [N,P] = EXTENDNEIGHBORS(N,P,D,C) takes the r-by-k matrices N and P with
+%   the indices and the distances of the k nearest neighbors of each of
+%   the first r rows of the distance matrix D, found when D had only its
+%   first C columns, and returns the lists for all rows of D. Each list is
+%   sorted from the nearest to the k-th nearest neighbor, and neighbors at
+%   the same distance are sorted by index, so the first neighbor is the
+%   one chosen by RUNS.DMNN. The old rows are updated by merging their
+%   lists with the new columns only; the lists of the new rows are found
+%   from their whole rows.
+%
+%   EXTENDNEIGHBORS(N,P,D,C,OPTS) takes options from the OPTS object OPTS.
+%
+%   Options:
+%       dists::similarity           (default: 0)
+%       dists::exclude diagonal     (default: 0)
+%
+%   If "dists::similarity" is true, D holds similarities and the neighbors
+%   are those with the largest values. If "dists::exclude diagonal" is
+%   true, D is a training vs. training matrix and a series is never its
+%   own neighbor, as in the leave-one-out validation of RUNS.DMNN.
+
+%   This file is part of TimeBox. Copyright 2015-17 Rafael Giusti
+%   Revision 0.1
+if ~exist('options', 'var')
+    options = opts.empty;
+end
+[r, k] = size(neighbors);
+[numrows, totalcols] = size(distmatrix);
+tb.assert(isequal(size(distances), [r k]) && r <= numrows && numcols <= totalcols, ...
+    'Neighbor lists do not match the distance matrix');
+
+% Neighbors are sorted by ascending keys
+similarity = opts.get(options, 'dists::similarity', 0);
+if similarity
+    keys = -distmatrix;
+    oldkeys = -distances;
+else
+    keys = distmatrix;
+    oldkeys = distances;
+end
+if opts.get(options, 'dists::exclude diagonal', 0)
+    diagonal = 1:min(numrows, totalcols);
+    keys(sub2ind(size(keys), diagonal, diagonal)) = NaN;
+end
+
+% Candidates of the old rows are their old neighbors and the new columns.
+% Sorting them first by index makes the stable sort by key break ties by
+% index
+candidates = [neighbors, repmat(numcols+1:totalcols, r, 1)];
+candidatekeys = [oldkeys, keys(1:r, numcols+1:end)];
+[candidates, candidatekeys] = sortrowsby(candidates, candidatekeys, candidates);
+[candidatekeys, candidates] = sortrowsby(candidatekeys, candidates, candidatekeys);
+numkept = min(k, size(candidates, 2));
+oldneighbors = candidates(:, 1:numkept);
+oldkeys = candidatekeys(:, 1:numkept);
+
+% New rows are sorted whole
+[newkeys, newneighbors] = sort(keys(r+1:end, :), 2);
+numkept = min(k, totalcols);
+newkeys = newkeys(:, 1:numkept);
+newneighbors = newneighbors(:, 1:numkept);
+
+neighbors = [oldneighbors; newneighbors];
+distances = [oldkeys; newkeys];
+if similarity
+    distances = -distances;
+end
+end
+
+
+function [A, B] = sortrowsby(A, B, sortkeys)
+%Sort the elements of each row of A and B by the elements of SORTKEYS
+[~, order] = sort(sortkeys, 2);
+if isempty(order)
+    return
+end
+index = sub2ind(size(A), repmat((1:size(A, 1))', 1, size(A, 2)), order);
+A = A(index);
+B = B(index);
+end
@@ -14,9 +14,18 @@ function is = iscached(dsname, varargin)
 %
 %   ISCACHED(DSNAME,DIST,REPNAME) checks if the distance has been cached on
 %   the decision domains REPNAME for the distance DIST
+%
+%   Either a .mat cache of DISTS.CACHEMATRIX or a binary cache of
+%   DISTS.BUILDCACHE counts as cached, but a binary cache counts only once
+%   every block has been calculated: one whose build was interrupted or is
+%   still running does not.
 
 %   This file is part of TimeBox. Copyright 2015-16 Rafael Giusti
-%   Revision 0.1
-cachepath = dists.cachepath(dsname, varargin{:});
+%   Revision 0.2.1
+[cachepath, binpath] = dists.cachepath(dsname, varargin{:});
 is = exist(cachepath, 'file') ~= 0;
+if ~is && exist(binpath, 'file')
+    cache = dists.opencache(binpath);
+    is = cache.complete ~= 0;
+end
 end
\ No newline at end of file
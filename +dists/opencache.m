@@ -0,0 +1,96 @@
+function cache = opencache(path)
+%DISTS.OPENCACHE Open a binary distance matrix cache written by
+%DISTS.BUILDCACHE.
+%   OPENCACHE(PATH) returns a struct describing the cache file in PATH. The
+%   distance matrices are mapped into memory with MEMMAPFILE, so opening
+%   the cache does not read them; rows are read only when requested with
+%   DISTS.CACHEROWS. The struct has these fields:
+%
+%       path        the path to the cache file
+%       class       'double', 'single', or 'uint16'
+%       ntrain      number of training series
+%       ntest       number of test series
+%       blockrows   number of rows calculated at a time by BUILDCACHE
+%       complete    1 if every block of both matrices has been calculated
+%       trainmax    largest distance in the training matrix
+%       testmax     largest distance in the test matrix
+%       blocks      k-by-2 matrix with one row per block of rows, first
+%                   those of the training matrix and then those of the
+%                   test matrix, flagging the blocks already calculated
+%                   and holding their largest distance
+%       rowtable    offset and scale of each row, for uint16 payloads
+%       traintrain  MEMMAPFILE of the training matrix, or []
+%       testtrain   MEMMAPFILE of the test matrix, or []
+%
+%   The cache file holds a header of 64 bytes, the table of blocks (two
+%   doubles per block), the table of rows for uint16 payloads (two doubles
+%   per training row and per test row), and then the training and the test
+%   matrices, both row by row, so that a range of rows is contiguous. All
+%   numbers are little-endian. The header holds, in this order:
+%
+%       char[8]     'TBDMCACH'
+%       uint32      format version (1)
+%       uint32      payload class (1 double, 2 single, 3 uint16)
+%       uint64      number of training series
+%       uint64      number of test series
+%       uint64      rows per block
+%       uint64      offset of the table of blocks
+%       uint64      offset of the table of rows (0 if not uint16)
+%       uint64      offset of the training matrix
+%
+%   The test matrix follows the training matrix. A uint16 distance "q" in
+%   row "i" stands for offset(i) + q * scale(i), except that 65535 stands
+%   for NaN.
+
+%   This file is part of TimeBox. Copyright 2015-17 Rafael Giusti
+%   Revision 0.1
+f = fopen(path, 'r', 'l');
+tb.assert(f ~= -1, 'Can''t open cache %s for reading', path);
+magic = fread(f, [1 8], '*char');
+version = fread(f, 1, 'uint32');
+classcode = fread(f, 1, 'uint32');
+sizes = fread(f, 6, 'uint64');
+tb.assert(isequal(magic, 'TBDMCACH') && version == 1 && numel(sizes) == 6, 'File %s is not a distance cache', path);
+
+classes = {'double', 'single', 'uint16'};
+cache.path = path;
+cache.class = classes{classcode};
+cache.ntrain = sizes(1);
+cache.ntest = sizes(2);
+cache.blockrows = sizes(3);
+blockoffset = sizes(4);
+rowoffset = sizes(5);
+payloadoffset = sizes(6);
+
+numblocks = ceil(cache.ntrain / cache.blockrows) + ceil(cache.ntest / cache.blockrows);
+fseek(f, blockoffset, 'bof');
+cache.blocks = reshape(fread(f, 2 * numblocks, 'double'), 2, numblocks)';
+if rowoffset
+    fseek(f, rowoffset, 'bof');
+    cache.rowtable = reshape(fread(f, 2 * (cache.ntrain + cache.ntest), 'double'), 2, [])';
+else
+    cache.rowtable = [];
+end
+fclose(f);
+
+trainblocks = ceil(cache.ntrain / cache.blockrows);
+cache.complete = all(cache.blocks(:, 1));
+cache.trainmax = max([-Inf; cache.blocks(1:trainblocks, 2)]);
+cache.testmax = max([-Inf; cache.blocks(trainblocks+1:end, 2)]);
+
+% Each column of the mapped matrices is a row of the distance matrix
+cache.traintrain = mapmatrix(path, payloadoffset, cache.class, cache.ntrain, cache.ntrain);
+bytes = numel(typecast(zeros(1, cache.class), 'uint8'));
+cache.testtrain = mapmatrix(path, payloadoffset + bytes * cache.ntrain ^ 2, cache.class, cache.ntrain, ...
+    cache.ntest);
+end
+
+
+function m = mapmatrix(path, offset, class, numcols, numrows)
+%Map a distance matrix stored row by row, or return [] if it is empty
+if numcols == 0 || numrows == 0
+    m = [];
+else
+    m = memmapfile(path, 'Offset', offset, 'Format', {class, double([numcols numrows]), 'x'}, 'Repeat', 1);
+end
+end
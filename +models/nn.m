@@ -35,6 +35,7 @@ function [neighbor, distance, label, hit] = nn(stack, needle, varargin)
 %   Options:
 %       dists::arg*         (default: --)
 %       dists::similarity   (default: 0)
+%       dists::threads      (default: 0)
 %       nn::tie break       (default: 'first')
 %       epsilon             (default: 1e-10)
 %
@@ -56,9 +57,15 @@ function [neighbor, distance, label, hit] = nn(stack, needle, varargin)
 %       % Run for a single instance of the data set using the dtw distance
 %       % with a Sakoe-Chiba window of width 12
 %       models.nn(train, test(1,:), @dists.dtw, opts.set('dists::arg', 12))
+%
+%   If DIST is @DISTS.DTW_Cpp, the candidates are passed to its MEX in
+%   batches of growing size, which are calculated by "dists::threads"
+%   threads (0 for one per processor). Each batch is abandoned early at the
+%   distance to the nearest neighbor found before it. The neighbors are
+%   the same found by calling DIST for each candidate.
 
 %   This file is part of TimeBox. Copyright 2015-16 Rafael Giusti
-%   Revision 1.0
+%   Revision 1.1
 tb.narginchk(nargin, 2, 4);
 if nargin == 2
     distfun = @dists.euclidean;
@@ -115,27 +122,45 @@ distance = similarityfix * inf;
 numinstances = size(stack, 1);
 
 % Run 1-NN
-for i = 1 : numinstances
-    % If this is being ran in loco, then skipindex contains the index of
-    % the needle in the stack
-    if i == skipindex
-        continue
-    end
-    
-    % First index of each time series contains class, so series are
-    % compared by their [2,end] intervals
+if isequal(distfun, @dists.DTW_Cpp) && ~issimilarity
+    % Candidates farther than the nearest neighbor so far (plus epsilon,
+    % so that ties are kept) come back as Inf, so they are neither
+    % neighbors nor ties, exactly as if they were calculated in full
     if measuretakesarg
-        dist = similarityfix * distfun(stack(i, 2:end), needle(2:end), measurearg);
+        window = measurearg;
     else
-        dist = similarityfix * distfun(stack(i, 2:end), needle(2:end));
+        window = ceil(0.1 * (size(stack, 2) - 1));
     end
-    
-    % Is this the closest or just as close as the closest we previously found?
-    if abs(dist - distance) < epsilon
-        bestidx = [bestidx; i]; %#ok<AGROW>
-    elseif dist < distance
-        bestidx = i;
-        distance = dist;
+    threads = opts.get(options, 'dists::threads', 0);
+    candidates = 1:numinstances;
+    candidates(candidates == skipindex) = [];
+    batchsize = 1;
+    first = 1;
+    while first <= numel(candidates)
+        batch = candidates(first:min(first + batchsize - 1, end));
+        batchdists = dists.DTW_mex(stack(batch, 2:end), needle(2:end), window, distance + epsilon, threads);
+        for k = 1:numel(batch)
+            [bestidx, distance] = addcandidate(bestidx, distance, batch(k), batchdists(k), epsilon);
+        end
+        first = first + numel(batch);
+        batchsize = min(2 * batchsize, 256);
+    end
+else
+    for i = 1 : numinstances
+        % If this is being ran in loco, then skipindex contains the index
+        % of the needle in the stack
+        if i == skipindex
+            continue
+        end
+
+        % First index of each time series contains class, so series are
+        % compared by their [2,end] intervals
+        if measuretakesarg
+            dist = similarityfix * distfun(stack(i, 2:end), needle(2:end), measurearg);
+        else
+            dist = similarityfix * distfun(stack(i, 2:end), needle(2:end));
+        end
+        [bestidx, distance] = addcandidate(bestidx, distance, i, dist, epsilon);
     end
 end
 
@@ -165,3 +190,14 @@ else
     hit = abs(label - needle(1)) < epsilon;
 end
 end
+
+
+function [bestidx, distance] = addcandidate(bestidx, distance, i, dist, epsilon)
+%Is this the closest or just as close as the closest we previously found?
+if abs(dist - distance) < epsilon
+    bestidx = [bestidx; i];
+elseif dist < distance
+    bestidx = i;
+    distance = dist;
+end
+end
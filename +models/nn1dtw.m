@@ -1,4 +1,4 @@
-function [neighbor, distance, label, hit] = nn1dtw(stack, needle, windowlength_or_optsobj)
+function [neighbor, distance, label, hit, stats] = nn1dtw(stack, needle, windowlength_or_optsobj)
 %MODELS.NN1DTW    Run the 1-Nearest Neighbor classification model for a
 %single instance on a data set using the UCR Suite for 1-NNDTW. Has similar
 %behavior to MODELS.NN with @DISTS.DTW_Cpp, but much faster. 
@@ -15,7 +15,9 @@ function [neighbor, distance, label, hit] = nn1dtw(stack, needle, windowlength_o
 %
 %   NN1DTW(DS,S,w), where "w" is a double scalar, does the same as
 %   explained above, however a Sakoe-Chiba window with widh "w" will be
-%   used instead.
+%   used instead. If "w" is as large as the series or larger (e.g., Inf),
+%   the DTW is unconstrained. The lower bounds and early abandoning are
+%   used all the same.
 %   
 %   NN1DTW(DS,S,options), where "options" is an OPTS object, does the same
 %   as the previous calls, however options are taken from the OPTS object
@@ -31,6 +33,77 @@ function [neighbor, distance, label, hit] = nn1dtw(stack, needle, windowlength_o
 %   flag indicating if the nearest neighbor belongs to the same class as
 %   the test sample (1 or 0).
 %
+%   [N,P,C,H,R] = NN1DTW(DS,S, ...) also returns a struct R with counters
+%   of the search, with one row per test instance: the candidates pruned
+%   by each lower bound of "nn::cascade" (fields 'kim', 'keogh', 'keogh2',
+%   'improved', 'enhanced', and 'webb') and by the scheduling bound
+%   ('schedule'), the DTW calculations that reached the distance to the
+%   nearest neighbor so far and those that did not ('abandoned' and
+%   'completed'), the cells of the cost matrix calculated, not counting
+%   those skipped by pruning ('cells'), and the nanoseconds spent in each
+%   step ('time'). These counters are only kept by the MEX when R is
+%   requested.
+%
+%   NN1DTW(DS,T,...), where T is a k-by-m matrix of double with k > 1
+%   representing a test data set, classifies all instances of T in a single
+%   call. The outputs N, P, C, and H are k-by-1 column vectors. This is
+%   much faster than calling NN1DTW once per test instance, because the
+%   envelopes of the training series are computed only once.
+%
+%   Options:
+%       dists::arg          (default: 10% of the series length)
+%       epsilon             (default: 1e-10)
+%       nn::threads         (default: 1)
+%       nn::schedule        (default: 'storage')
+%       nn::k               (default: 1)
+%       nn::simd            (default: 'auto')
+%       nn::precision       (default: 'double')
+%       nn::cascade         (default: {'kim', 'keogh', 'keogh2'})
+%       nn::enhanced bands  (default: 5)
+%
+%   If "nn::threads" is larger than 1, the training data set is searched
+%   by that many threads, which share the distance to the best neighbor
+%   found so far to prune candidates. If set to 0, one thread per processor
+%   is used. The neighbor is the same found by a single thread.
+%
+%   The option "nn::schedule" sets the order in which training instances
+%   are visited. With 'storage', they are visited in the order they appear
+%   in DS. With 'kim' or 'keogh', the LB_Kim or the LB_Keogh lower bound is
+%   calculated for every training instance first; instances are then
+%   visited from the smallest to the largest bound, and the search stops
+%   as soon as the bound reaches the distance to the nearest neighbor found
+%   so far. This usually saves many DTW calculations. The neighbor found is
+%   the same in all schedules.
+%
+%   If "nn::k" is larger than 1, the k nearest neighbors are searched
+%   instead, using the distance to the k-th nearest neighbor found so far
+%   to prune candidates. Then N, P, and C have k columns, from the nearest
+%   to the k-th nearest neighbor, and H flags each neighbor that belongs to
+%   the same class as the test sample. If k is larger than the number of
+%   training instances, it is truncated silently.
+%
+%   The option "nn::simd" sets the instruction set used to calculate
+%   LB_Keogh and DTW. With 'auto', the widest instruction set supported by
+%   the processor is used. It may be set to 'scalar', 'sse4', 'avx2', or
+%   'avx512' to force one of them. The distances are exactly the same with
+%   any instruction set.
+%
+%   If "nn::precision" is 'single', the training and test instances are
+%   stored in single precision by the MEX. This halves the memory read
+%   during the search of long series. Lower bounds and DTW are still
+%   calculated in double precision, so the only difference to the double
+%   precision search is the rounding of the observations to single.
+%
+%   The option "nn::cascade" is a cell array with the lower bounds tried,
+%   in that order, before DTW is calculated for a training instance. The
+%   bounds are 'kim' (LB_Kim), 'keogh' (LB_Keogh with the envelope of the
+%   test instance), 'keogh2' (LB_Keogh with the envelope of the training
+%   instance), 'improved' (LB_Improved), 'enhanced' (LB_Enhanced), and
+%   'webb' (LB_Webb). The last three are tighter but slower; they pay off
+%   with wide windows, when LB_Keogh prunes few candidates. LB_Enhanced
+%   uses "nn::enhanced bands" bands at each end of the series. The
+%   neighbors found do not depend on the cascade.
+%
 %   Disclaimer: the UCR Suite is copyrighted by its authors. The usage
 %   terms for the UCR Suite are transcribed into the MODELS.NN1DTW source
 %   code. Please review those terms before using this function.
@@ -55,7 +128,7 @@ function [neighbor, distance, label, hit] = nn1dtw(stack, needle, windowlength_o
 %%%%%%%%%%%%%%%%
 
 %   This file is part of TimeBox. Copyright 2015-16 Rafael Giusti
-%   Revision 1.0.1
+%   Revision 1.10.1
 
 serieslen = size(stack, 2) - 1;
 tb.assert(serieslen >= 5, ['Series of length 5 or longer are required for MODELS.NN1DTW. For short series, please' ...
@@ -77,13 +150,16 @@ else
 end
 if isempty(window)
     window = round(0.10 * serieslen);
-else
-    tb.assert(window < serieslen, ['MODELS.NN1DTW requires the Sakoe-Chiba window to be shorter than the time ' ...
-        'series by at least one observation. For full-window DTW, please use MODELS.NN with DISTS.DTW_Cpp and ' ...
-        'set "dists::arg" to the length of the series']);
 end
 
 epsilon = opts.get(options, 'epsilon', 1e-10);
+precision = opts.get(options, 'nn::precision', 'double');
+tb.assert(any(strcmp(precision, {'double', 'single'})), 'Option "nn::precision" must be either ''double'' or ''single''');
+mexoptions = struct('threads', opts.get(options, 'nn::threads', 1), ...
+    'schedule', opts.get(options, 'nn::schedule', 'storage'), ...
+    'simd', opts.get(options, 'nn::simd', 'auto'), ...
+    'bands', opts.get(options, 'nn::enhanced bands', 5));
+mexoptions.cascade = opts.get(options, 'nn::cascade', {'kim', 'keogh', 'keogh2'});
 
 if numel(needle) == 1
     skipindex = needle;
@@ -91,8 +167,18 @@ if numel(needle) == 1
 else
     skipindex = -1;
 end
+mexoptions.k = min(opts.get(options, 'nn::k', 1), size(stack, 1) - (skipindex ~= -1));
 
-[neighbor, distance] = models.nn1dtw_mex(stack(:, 2:end)', needle(2:end), skipindex, window);
-label = stack(neighbor, 1);
-hit = abs(label - needle(1)) < epsilon;
+% The MEX reads the data sets as they are, with the labels in the first
+% column, so they are neither transposed nor copied here
+mexoptions.native = true;
+if nargout >= 5
+    [neighbor, distance, ~, stats] = models.nn1dtw_mex(cast(stack, precision), ...
+        cast(needle, precision), skipindex, window, mexoptions);
+else
+    [neighbor, distance] = models.nn1dtw_mex(cast(stack, precision), cast(needle, precision), ...
+        skipindex, window, mexoptions);
+end
+label = reshape(stack(neighbor, 1), size(neighbor));
+hit = abs(bsxfun(@minus, label, needle(:, 1))) < epsilon;
 end
@@ -8,7 +8,7 @@
  */
 
 /* This file is part of TimeBox.
- * Revision 1.0.0
+ * Revision 1.12.3
  */
 
 
@@ -39,7 +39,18 @@
 #include "mex.h"
 
 #include <cstdlib>
+#include <cstdio>
+#include <cstring>
 #include <cmath>
+#include <vector>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <algorithm>
+#include <chrono>
+#include <climits>
 
 #define min(x,y) ((x)<(y)?(x):(y))
 #define max(x,y) ((x)>(y)?(x):(y))
@@ -91,6 +102,12 @@ typedef struct Index {
 	int    index;
 } Index;
 
+/// Data structure for the nearest neighbors found in the search
+typedef struct Neighbor {
+	double dist;
+	int    index;
+} Neighbor;
+
 /// Data structure (circular array) for finding minimum and maximum for LB_Keogh envolop
 struct deque {
 	int *dq;
@@ -117,6 +134,14 @@ void init(deque *d, int capacity)
 	d->r = d->capacity-1;
 }
 
+/// Empty the queue so it can be reused
+void reset(deque *d)
+{
+	d->size = 0;
+	d->f = 0;
+	d->r = d->capacity-1;
+}
+
 /// Destroy the queue
 void destroy(deque *d)
 {
@@ -175,12 +200,18 @@ int empty(struct deque *d)
 /// Finding the envelop of min and max value for LB_Keogh
 /// Implementation idea is intoruduced by Danial Lemire in his paper
 /// "Faster Retrieval with a Two-Pass Dynamic-Time-Warping Lower Bound", Pattern Recognition 42(9), 2009.
-void lower_upper_lemire(double *t, int len, int r, double *l, double *u)
+/// du, dl: queues with capacity for 2*r+2 elements
+template <typename T>
+void lower_upper_lemire(T *t, int len, int r, T *l, T *u, deque *pdu,
+		deque *pdl)
 {
-	struct deque du, dl;
+	struct deque &du = *pdu, &dl = *pdl;
 
-	init(&du, 2*r+2);
-	init(&dl, 2*r+2);
+	/// Windows beyond len-1 cover the whole series all the same
+	r = min(r, len - 1);
+
+	reset(&du);
+	reset(&dl);
 
 	push_back(&du, 0);
 	push_back(&dl, 0);
@@ -215,6 +246,16 @@ void lower_upper_lemire(double *t, int len, int r, double *l, double *u)
 		if (i-front(&dl) >= 2 * r + 1)
 			pop_front(&dl);
 	}
+}
+
+template <typename T>
+void lower_upper_lemire(T *t, int len, int r, T *l, T *u)
+{
+	struct deque du, dl;
+
+	init(&du, 2*r+2);
+	init(&dl, 2*r+2);
+	lower_upper_lemire(t, len, r, l, u, &du, &dl);
 	destroy(&du);
 	destroy(&dl);
 }
@@ -224,19 +265,22 @@ void lower_upper_lemire(double *t, int len, int r, double *l, double *u)
 /// However, because of z-normalization the top and bottom cannot give siginifant benefits.
 /// And using the first and last points can be computed in constant time.
 /// The prunning power of LB_Kim is non-trivial, especially when the query is not long, say in length 128.
-double lb_kim_hierarchy(double *t, double *q, int len, double bsf = INF)
+/// The observations of the data are "step" elements apart.
+template <typename T>
+double lb_kim_hierarchy(T *t, double *q, int len, double bsf = INF,
+		long long step = 1)
 {
 	double d, lb;
 
 	/// 1 point at front and back
 	double x0 = t[0];
-	double y0 = t[len - 1];
+	double y0 = t[(len - 1) * step];
 	lb = dist(x0,q[0]) + dist(y0,q[len-1]);
 	if (lb >= bsf)
 		return lb;
 
 	/// 2 points at front
-	double x1 = t[1];
+	double x1 = t[step];
 	d = min(dist(x1,q[0]), dist(x0,q[1]));
 	d = min(d, dist(x1,q[1]));
 	lb += d;
@@ -244,7 +288,7 @@ double lb_kim_hierarchy(double *t, double *q, int len, double bsf = INF)
 		return lb;
 
 	/// 2 points at back
-	double y1 = t[len -2];
+	double y1 = t[(len - 2) * step];
 	d = min(dist(y1,q[len-1]), dist(y0, q[len-2]) );
 	d = min(d, dist(y1,q[len-2]));
 	lb += d;
@@ -252,7 +296,7 @@ double lb_kim_hierarchy(double *t, double *q, int len, double bsf = INF)
 		return lb;
 
 	/// 3 points at front
-	double x2 = t[2];
+	double x2 = t[2 * step];
 	d = min(dist(x0,q[2]), dist(x1, q[2]));
 	d = min(d, dist(x2,q[2]));
 	d = min(d, dist(x2,q[1]));
@@ -262,7 +306,7 @@ double lb_kim_hierarchy(double *t, double *q, int len, double bsf = INF)
 		return lb;
 
 	/// 3 points at back
-	double y2 = t[len - 3];
+	double y2 = t[(len - 3) * step];
 	d = min(dist(y0,q[len-3]), dist(y1, q[len-3]));
 	d = min(d, dist(y2,q[len-3]));
 	d = min(d, dist(y2,q[len-2]));
@@ -280,7 +324,8 @@ double lb_kim_hierarchy(double *t, double *q, int len, double bsf = INF)
 /// uo, lo: upper and lower envelops for the query, which already sorted.
 /// t     : a circular array keeping the current data.
 /// cb    : (output) current bound at each position. It will be used later for early abandoning in DTW.
-double lb_keogh_cumulative(int* order, double *t, double *uo, double *lo, double *cb, int len, double best_so_far = INF)
+template <typename T>
+double lb_keogh_cumulative(int* order, T *t, double *uo, double *lo, double *cb, int len, double best_so_far = INF)
 {
 	double lb = 0;
 	double x, d;
@@ -306,7 +351,8 @@ double lb_keogh_cumulative(int* order, double *t, double *uo, double *lo, double
 /// qo: sorted query
 /// cb: (output) current bound at each position. Used later for early abandoning in DTW.
 /// l,u: lower and upper envelop of the current data
-double lb_keogh_data_cumulative(int* order, double *tz, double *qo, double *cb, double *l, double *u, int len, double best_so_far = INF)
+template <typename T>
+double lb_keogh_data_cumulative(int* order, T *tz, double *qo, double *cb, T *l, T *u, int len, double best_so_far = INF)
 {
 	double lb = 0;
 	double uu,ll,d;
@@ -327,28 +373,250 @@ double lb_keogh_data_cumulative(int* order, double *tz, double *qo, double *cb,
 	return lb;
 }
 
+/// LB_Improved: LB_Keogh of the data against the envelope of the query plus
+/// LB_Keogh of the query against the envelope of the projection of the data
+/// onto the envelope of the query. Also introduced by Daniel Lemire in
+/// "Faster Retrieval with a Two-Pass Dynamic-Time-Warping Lower Bound".
+///
+/// Variable Explanation,
+/// t     : the data
+/// qo    : sorted query
+/// l, u  : lower and upper envelops of the query (not sorted)
+/// proj  : (output) the projection of the data
+/// hl, hu: (output) lower and upper envelops of the projection
+/// lb_k  : LB_Keogh of the data against the envelope of the query
+template <typename T>
+double lb_improved(int* order, T *t, double *qo, double *l, double *u,
+		double *proj, double *hl, double *hu, deque *du, deque *dl,
+		int len, int r, double lb_k, double best_so_far = INF)
+{
+	double lb = lb_k;
+	double d;
+
+	for (int i = 0; i < len; i++)
+		proj[i] = min(max((double)t[i], l[i]), u[i]);
+	lower_upper_lemire(proj, len, r, hl, hu, du, dl);
+
+	for (int i = 0; i < len && lb < best_so_far; i++) {
+		d = 0;
+		if (qo[i] > hu[order[i]])
+			d = dist(qo[i], hu[order[i]]);
+		else if (qo[i] < hl[order[i]])
+			d = dist(qo[i], hl[order[i]]);
+		lb += d;
+	}
+	return lb;
+}
+
+/// LB_Enhanced by Tan, Petitjean and Webb, "Elastic bands across the path:
+/// A new framework and method to lower bound DTW", SDM 2019. Every warping
+/// path crosses the L-shaped bands at the corners of the cost matrix, so
+/// the cheapest cell of each of the first and last "bands" bands is added
+/// to the LB_Keogh terms of the columns in the middle.
+///
+/// Variable Explanation,
+/// t : the data
+/// q : the query (not sorted)
+/// cb: the LB_Keogh terms of the data against the envelope of the query
+template <typename T>
+double lb_enhanced(T *t, double *q, double *cb, int len, int r, int bands,
+		double best_so_far = INF)
+{
+	double lb = 0;
+	double lmin, rmin;
+	int i, j, ri;
+
+	bands = min(bands, len / 2);
+	for (i = 0; i < bands; i++) {
+		lmin = dist(t[i], q[i]);
+		for (j = max(0, i - r); j < i; j++) {
+			lmin = min(lmin, dist(t[j], q[i]));
+			lmin = min(lmin, dist(t[i], q[j]));
+		}
+		ri = len - 1 - i;
+		rmin = dist(t[ri], q[ri]);
+		for (j = ri + 1; j <= min(len - 1, ri + r); j++) {
+			rmin = min(rmin, dist(t[j], q[ri]));
+			rmin = min(rmin, dist(t[ri], q[j]));
+		}
+		lb += lmin + rmin;
+		if (lb >= best_so_far)
+			return lb;
+	}
+	for (i = bands; i < len - bands; i++)
+		lb += cb[i];
+	return lb;
+}
+
+/// LB_Webb, after Webb and Petitjean, "Tight lower bounds for Dynamic Time
+/// Warping", Pattern Recognition 115, 2021. Adds to LB_Keogh of the data
+/// against the envelope of the query the terms of the query points that
+/// lie outside the envelope of the data, whenever they cannot share a cell
+/// of the cost matrix with a term already in LB_Keogh.
+///
+/// Variable Explanation,
+/// qo    : sorted query
+/// l, u  : lower and upper envelops of the data
+/// lu    : lower envelop of the upper envelop of the query (not sorted)
+/// ul    : upper envelop of the lower envelop of the query (not sorted)
+/// lb_k  : LB_Keogh of the data against the envelope of the query
+template <typename T>
+double lb_webb(int* order, double *qo, T *l, T *u, double *lu, double *ul,
+		int len, double lb_k, double best_so_far = INF)
+{
+	double lb = lb_k;
+	double uu, ll, d;
+
+	for (int i = 0; i < len && lb < best_so_far; i++) {
+		uu = u[order[i]];
+		ll = l[order[i]];
+		d = 0;
+		if (qo[i] > uu && uu >= ul[order[i]])
+			d = dist(qo[i], uu);
+		else if (qo[i] < ll && ll <= lu[order[i]])
+			d = dist(qo[i], ll);
+		lb += d;
+	}
+	return lb;
+}
+
 /// Calculate Dynamic Time Wrapping distance
 /// A,B: data and query, respectively
 /// cb : cummulative bound used for early abandoning
 /// r  : size of Sakoe-Chiba warpping band
-double dtw(double* A, double* B, double *cb, int m, int r, double bsf = INF)
+/// cost, cost_prev: scratch arrays of 2*r+1 cells, with an INF sentinel
+///                  before and after them, reused across calls
+/// cells: (output, optional) number of cells of the cost matrix evaluated,
+///        pruned cells included but not those skipped by pruning
+///
+/// Cells are pruned as in PrunedDTW and EAPruned DTW (Herrmann and Webb,
+/// "Early abandoning and pruning for elastic distances including Dynamic
+/// Time Warping", DMKD 35, 2021): a cell whose cost plus cb[i+r+1] reaches
+/// bsf cannot be on a path cheaper than bsf, so it is set to INF. Only the
+/// columns from the first to the last live cell of a row can feed the
+/// next row, and past the last live cell of the previous row only the
+/// left neighbor is left, so each row stops at its first dead cell there.
+/// DTW is abandoned when a row has no live cell. A distance smaller than
+/// bsf is exact, with the same cells on its path as without pruning;
+/// otherwise, the smallest cost plus bound of a pruned cell is returned,
+/// which is a lower bound no smaller than bsf, since every path leaves the
+/// live cells through a pruned one.
+template <typename T>
+double dtw(T* A, double* B, double *cb, int m, int r, double *cost,
+		double *cost_prev, double bsf = INF, double *cells = NULL)
 {
+	double *cost_tmp;
+	int i,j,k,jend;
+	double x,y,z,c,rest;
+	double bound = INF;       /// smallest cost plus bound of a pruned cell
+	int start = 0, end = -1;  /// live columns of the previous row
+	int live_start, live_end;
+	int first;
+	double evaluated = 0;
+
+	/// Instead of using matrix of size O(m^2) or O(mr), we will reuse two array of size O(r).
+	for(k=-1; k<=2*r+1; k++)
+		cost[k]=INF;
+
+	for(k=-1; k<=2*r+1; k++)
+		cost_prev[k]=INF;
+
+	for (i=0; i<m; i++)
+	{
+		rest = i+r < m-1 ? cb[i+r+1] : 0;
+		jend = min(m-1, i+r);
+		live_start = -1;
+		live_end = -1;
+		y = INF;
+
+		/// Columns below the live cells of the previous row, whose
+		/// neighbors just outside them are INF
+		first = max(start, i-r);
+		for (j=first; j<=min(jend, end+1); j++) {
+			k = j-i+r;
+			if ((i==0)&&(j==0))
+				c = dist(A[0],B[0]);
+			else {
+				x = cost_prev[k+1];
+				z = cost_prev[k];
+				/// Classic DTW calculation
+				c = min( min( x, y) , z) + dist(A[i],B[j]);
+			}
+			if (c + rest < bsf) {
+				if (live_start < 0)
+					live_start = j;
+				live_end = j;
+			}
+			else {
+				bound = min(bound, c + rest);
+				c = INF;
+			}
+			cost[k] = c;
+			y = c;
+		}
+
+		/// Past them, a cell can only be reached from the left
+		for (; j<=jend && y<INF; j++) {
+			c = y + dist(A[i],B[j]);
+			if (c + rest < bsf)
+				live_end = j;
+			else {
+				bound = min(bound, c + rest);
+				c = INF;
+			}
+			cost[j-i+r] = c;
+			y = c;
+		}
+		evaluated += max(j - first, 0);
+
+		/// We can abandon early if no cell can lead to a path cheaper than bsf
+		if (live_start < 0) {
+			if (cells)
+				*cells = evaluated;
+			return bound;
+		}
+		cost[live_start-1-i+r] = INF;
+		cost[live_end+1-i+r] = INF;
+		start = live_start;
+		end = live_end;
+
+		/// Move current array to previous array.
+		cost_tmp = cost;
+		cost = cost_prev;
+		cost_prev = cost_tmp;
+	}
+	if (cells)
+		*cells = evaluated;
 
+	/// the DTW distance is in the last cell in the matrix of size O(m^2) or at the middle of our array.
+	return end == m-1 ? cost_prev[r] : bound;
+}
 
-	double *cost;
-	double *cost_prev;
+/// DTW with early abandoning, as above, that also finds the smallest window
+/// admitting an optimal warping path. Among equally costly predecessors of
+/// a cell, the one whose path strays the least from the diagonal is taken,
+/// so the cost of every cell is the same calculated by dtw().
+///
+/// Variable Explanation,
+/// dev, dev_prev: scratch arrays of size 2*r+1 with the largest |i-j|
+///                along the path to each cell
+/// minwindow    : (output) the largest |i-j| along the warping path, or -1
+///                if DTW was abandoned
+template <typename T>
+double dtw_minwindow(T* A, double* B, double *cb, int m, int r, double *cost,
+		double *cost_prev, int *dev, int *dev_prev, double bsf,
+		int *minwindow)
+{
 	double *cost_tmp;
+	int *dev_tmp;
 	int i,j,k;
-	double x,y,z,min_cost;
+	double x,y,z,c,min_cost;
+	int dx,dy,dz,dc;
 
-	/// Instead of using matrix of size O(m^2) or O(mr), we will reuse two array of size O(r).
-	mkarray(cost, 2 * r + 1, double);
-	for(k=0; k<2*r+1; k++)
+	for(k=0; k<2*r+1; k++) {
 		cost[k]=INF;
-
-	mkarray(cost_prev, 2 * r + 1, double);
-	for(k=0; k<2*r+1; k++)
 		cost_prev[k]=INF;
+	}
 
 	for (i=0; i<m; i++)
 	{
@@ -359,21 +627,41 @@ double dtw(double* A, double* B, double *cb, int m, int r, double bsf = INF)
 			/// Initialize all row and column
 			if ((i==0)&&(j==0)) {
 				cost[k]=dist(A[0],B[0]);
+				dev[k]=0;
 				min_cost = cost[k];
 				continue;
 			}
 
-			if ((j-1<0)||(k-1<0))     y = INF;
-			else                      y = cost[k-1];
-			if ((i-1<0)||(k+1>2*r))   x = INF;
-			else                      x = cost_prev[k+1];
-			if ((i-1<0)||(j-1<0))     z = INF;
-			else                      z = cost_prev[k];
+			y = INF; dy = m;
+			x = INF; dx = m;
+			z = INF; dz = m;
+			if (j-1>=0 && k-1>=0) {
+				y = cost[k-1];
+				dy = dev[k-1];
+			}
+			if (i-1>=0 && k+1<=2*r) {
+				x = cost_prev[k+1];
+				dx = dev_prev[k+1];
+			}
+			if (i-1>=0 && j-1>=0) {
+				z = cost_prev[k];
+				dz = dev_prev[k];
+			}
 
-			/// Classic DTW calculation
-			cost[k] = min( min( x, y) , z) + dist(A[i],B[j]);
+			/// Cheapest predecessor, closest to the diagonal on ties
+			c = x;
+			dc = dx;
+			if (y < c || (y == c && dy < dc)) {
+				c = y;
+				dc = dy;
+			}
+			if (z < c || (z == c && dz < dc)) {
+				c = z;
+				dc = dz;
+			}
+			cost[k] = c + dist(A[i],B[j]);
+			dev[k] = max(dc, abs(i - j));
 
-			/// Find minimum cost in row for early abandoning (possibly to use column instead of row).
 			if (cost[k] < min_cost) {
 				min_cost = cost[k];
 			}
@@ -381,147 +669,1464 @@ double dtw(double* A, double* B, double *cb, int m, int r, double bsf = INF)
 
 		/// We can abandon early if the current cummulative distace with lower bound together are larger than bsf
 		if (i+r < m-1 && min_cost + cb[i+r+1] >= bsf) {
-			mxFree(cost);
-			mxFree(cost_prev);
+			*minwindow = -1;
 			return min_cost + cb[i+r+1];
 		}
 
-		/// Move current array to previous array.
 		cost_tmp = cost;
 		cost = cost_prev;
 		cost_prev = cost_tmp;
+		dev_tmp = dev;
+		dev = dev_prev;
+		dev_prev = dev_tmp;
 	}
 	k--;
 
-	/// the DTW distance is in the last cell in the matrix of size O(m^2) or at the middle of our array.
-	double final_dtw = cost_prev[k];
-	mxFree(cost);
-	mxFree(cost_prev);
-	return final_dtw;
+	*minwindow = dev_prev[k];
+	return cost_prev[k];
 }
 
-/// Main Function
-void ucrsuite_main(int &neighbor, double &dist, int &pruned, double *stack,
-		double *q, int numseries, int skipindex, int len, int r)
+/// Per-thread scratch buffers: the cumulative bounds, the DTW cost rows, and
+/// the neighbors found
+struct scratch {
+	double *cb, *cb1, *cb2;
+	double *cost, *cost_prev;  /// 2*r+1 cells plus an INF sentinel at each end
+	double *diag, *d;    /// partial costs of a row for the vectorized DTW
+	double *proj, *hl, *hu;  /// projection of the data for LB_Improved
+	deque du, dl;        /// queues for the envelopes of the projection
+	Neighbor *heap;      /// the k nearest neighbors found by the thread
+	double cells;        /// cells evaluated by the last DTW
+};
+
+/// DTW on the scratch buffers of a thread, with the same arguments as the
+/// vectorized kernels
+template <typename T>
+double dtw_scalar(T *A, double *B, double *cb, int m, int r, scratch *s,
+		double bsf)
 {
-	double bsf;          /// best-so-far
-	int *order;          ///new order of the query
-	double *u, *l, *qo, *uo, *lo,*cb, *cb1, *cb2;
+	return dtw(A, B, cb, m, r, s->cost, s->cost_prev, bsf, &s->cells);
+}
 
-	long long i;
-	double lb_kim=0, lb_k=0, lb_k2=0;
-	double *series, *upper_lemire, *lower_lemire;
+/// Vectorized kernels, compiled for each instruction set and chosen at
+/// runtime according to the processor (see nn1dtw_simd.cpp)
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_SIMD 1
+
+/// Fused multiply-add would round the squared differences added to the
+/// lower bounds differently from the scalar code
+#pragma GCC push_options
+#pragma GCC optimize ("fp-contract=off")
+
+#pragma GCC target ("sse4.1")
+#define SIMD_SUFFIX sse4
+#define SIMD_WIDTH 2
+#include "nn1dtw_simd.cpp"
+#undef SIMD_SUFFIX
+#undef SIMD_WIDTH
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC optimize ("fp-contract=off")
+#pragma GCC target ("avx2")
+#define SIMD_SUFFIX avx2
+#define SIMD_WIDTH 4
+#include "nn1dtw_simd.cpp"
+#undef SIMD_SUFFIX
+#undef SIMD_WIDTH
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC optimize ("fp-contract=off")
+#pragma GCC target ("avx512f")
+#define SIMD_SUFFIX avx512
+#define SIMD_WIDTH 8
+#include "nn1dtw_simd.cpp"
+#undef SIMD_SUFFIX
+#undef SIMD_WIDTH
+#pragma GCC pop_options
+#else
+#define HAVE_SIMD 0
+#endif
+
+/// Instruction sets for the LB_Keogh and DTW kernels
+enum simd {
+	SIMD_AUTO,
+	SIMD_SCALAR,
+	SIMD_SSE4,
+	SIMD_AVX2,
+	SIMD_AVX512
+};
+
+/// The LB_Keogh and DTW kernels for one instruction set, for training
+/// series with observations of type T
+template <typename T>
+struct kernels {
+	double (*lb_keogh)(int *order, T *t, double *uo, double *lo,
+			double *cb, int len, double best_so_far);
+	double (*lb_keogh_data)(int *order, T *tz, double *qo,
+			double *cb, T *l, T *u, int len,
+			double best_so_far);
+	double (*dtw)(T *A, double *B, double *cb, int m, int r,
+			scratch *s, double bsf);
+};
+
+/// Whether the processor supports an instruction set
+bool simd_supported(int simd)
+{
+#if HAVE_SIMD
+	__builtin_cpu_init();
+	switch (simd) {
+	case SIMD_SSE4:
+		return __builtin_cpu_supports("sse4.1");
+	case SIMD_AVX2:
+		return __builtin_cpu_supports("avx2");
+	case SIMD_AVX512:
+		return __builtin_cpu_supports("avx512f");
+	}
+#endif
+	return simd == SIMD_SCALAR;
+}
+
+/// Return the kernels for an instruction set. SIMD_AUTO picks the widest
+/// instruction set supported by the processor
+template <typename T>
+kernels<T> select_kernels(int simd)
+{
+	kernels<T> kern;
+
+	if (simd == SIMD_AUTO) {
+		if (simd_supported(SIMD_AVX512))
+			simd = SIMD_AVX512;
+		else if (simd_supported(SIMD_AVX2))
+			simd = SIMD_AVX2;
+		else if (simd_supported(SIMD_SSE4))
+			simd = SIMD_SSE4;
+		else
+			simd = SIMD_SCALAR;
+	}
+
+	kern.lb_keogh = lb_keogh_cumulative<T>;
+	kern.lb_keogh_data = lb_keogh_data_cumulative<T>;
+	kern.dtw = dtw_scalar<T>;
+#if HAVE_SIMD
+	switch (simd) {
+	case SIMD_SSE4:
+		kern.lb_keogh = lb_keogh_cumulative_sse4<T>;
+		kern.lb_keogh_data = lb_keogh_data_cumulative_sse4<T>;
+		kern.dtw = dtw_sse4<T>;
+		break;
+	case SIMD_AVX2:
+		kern.lb_keogh = lb_keogh_cumulative_avx2<T>;
+		kern.lb_keogh_data = lb_keogh_data_cumulative_avx2<T>;
+		kern.dtw = dtw_avx2<T>;
+		break;
+	case SIMD_AVX512:
+		kern.lb_keogh = lb_keogh_cumulative_avx512<T>;
+		kern.lb_keogh_data = lb_keogh_data_cumulative_avx512<T>;
+		kern.dtw = dtw_avx512<T>;
+		break;
+	}
+#endif
+	return kern;
+}
+
+/// A minimal fork-join thread pool. The calling thread works as thread 0,
+/// so a pool for "n" threads keeps only n-1 workers waiting for jobs. The
+/// workers persist across queries, so batch mode does not pay the cost of
+/// creating threads for every test instance.
+class threadpool {
+public:
+	threadpool(int numthreads) : generation(0), pending(0), stop(false)
+	{
+		for (int t = 1; t < numthreads; t++)
+			workers.push_back(std::thread(&threadpool::work, this, t));
+	}
+
+	~threadpool()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stop = true;
+		}
+		wakeup.notify_all();
+		for (size_t t = 0; t < workers.size(); t++)
+			workers[t].join();
+	}
+
+	/// Run job(t) for every thread t and wait for all of them
+	void run(const std::function<void(int)> &job)
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			current = job;
+			pending = workers.size();
+			generation++;
+		}
+		wakeup.notify_all();
+		job(0);
+		std::unique_lock<std::mutex> lock(mutex);
+		finished.wait(lock, [this] { return pending == 0; });
+	}
+
+private:
+	void work(int t)
+	{
+		unsigned long seen = 0;
+		for (;;) {
+			std::function<void(int)> job;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				wakeup.wait(lock, [&] { return stop || generation != seen; });
+				if (stop)
+					return;
+				seen = generation;
+				job = current;
+			}
+			job(t);
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				pending--;
+			}
+			finished.notify_one();
+		}
+	}
+
+	std::vector<std::thread> workers;
+	std::function<void(int)> current;
+	std::mutex mutex;
+	std::condition_variable wakeup, finished;
+	unsigned long generation;
+	size_t pending;
+	bool stop;
+};
+
+/// Order in which the candidates are visited: in the order they are stored
+/// in the data set, or sorted by LB_Kim or by LB_Keogh
+enum schedule {
+	SCHEDULE_STORAGE,
+	SCHEDULE_KIM,
+	SCHEDULE_KEOGH
+};
+
+/// Lower bounds that may be used in the cascade before DTW
+enum bound {
+	BOUND_KIM,           /// LB_Kim
+	BOUND_KEOGH,         /// LB_Keogh with the envelope of the query
+	BOUND_KEOGH2,        /// LB_Keogh with the envelope of the data
+	BOUND_IMPROVED,      /// LB_Improved
+	BOUND_ENHANCED,      /// LB_Enhanced
+	BOUND_WEBB,          /// LB_Webb
+	NUM_BOUNDS
+};
+
+/// Maximum number of stages in the cascade
+#define MAX_CASCADE 16
+
+/// Search settings taken from the OPTIONS struct
+struct searchoptions {
+	int numthreads;
+	int schedule;
+	int k;               /// number of nearest neighbors
+	int simd;
+	int cascade[MAX_CASCADE];  /// lower bounds in the order they are tried
+	int numstages;
+	int bands;           /// number of bands at each end for LB_Enhanced
+};
+
+/// Scratch buffers for the search. These are allocated once per MEX call
+/// and reused by every query, so that batch classification does not pay
+/// the allocation cost for each test instance. T is the type of the
+/// observations of the training series.
+template <typename T>
+struct workspace {
+	int len, r;
+	int numthreads;
+	int schedule;
+	int k;               /// number of nearest neighbors
+	int *cascade;        /// lower bounds in the order they are tried
+	int numstages;
+	int bands;
+	kernels<T> kern;     /// LB_Keogh and DTW for the chosen instruction set
+	int *order;          ///new order of the query
+	double *q;           /// the query in double precision
+	double *u, *l, *qo, *uo, *lo;
+	double *lu, *ul;     /// envelopes of the envelopes of the query (LB_Webb)
 	Index *Q_tmp;
+	Index *candidates;   /// candidates sorted by their lower bounds
+	scratch *threads;    /// one set of scratch buffers per thread
+	T *gathered;         /// one candidate per thread, if the stack is not
+	                     /// stored by columns
+	threadpool *pool;    /// NULL if running on a single thread
+};
 
-	debug("ucrsuite_main() called with arguments (&int, &int, &int, "
-			"double*, double*, %d, %d, %d, %d)\n", numseries,
-			skipindex, len, r);
+/// Allocate the scratch buffers for series of length "len" and a window "r"
+/// for a stack of "numseries" series
+template <typename T>
+void init_workspace(workspace<T> *w, int len, int r, int numseries,
+		searchoptions *opt)
+{
+	int numthreads = opt->numthreads;
+	int k = opt->k;
+
+	w->len = len;
+	w->kern = select_kernels<T>(opt->simd);
+	w->r = r;
+	w->k = k;
+	w->numthreads = numthreads;
+	w->schedule = opt->schedule;
+	w->cascade = opt->cascade;
+	w->numstages = opt->numstages;
+	w->bands = opt->bands;
+	w->candidates = NULL;
+	if (w->schedule != SCHEDULE_STORAGE)
+		mkarray(w->candidates, numseries, Index);
+	mkarray(w->q, len, double);
+	mkarray(w->qo, len, double);
+	mkarray(w->uo, len, double);
+	mkarray(w->lo, len, double);
+	mkarray(w->order, len, int);
+	mkarray(w->Q_tmp, len, Index);
+	mkarray(w->u, len, double);
+	mkarray(w->l, len, double);
+	mkarray(w->lu, len, double);
+	mkarray(w->ul, len, double);
+	mkarray(w->threads, numthreads, scratch);
+	mkarray(w->gathered, (long long)numthreads * len, T);
+	for (int t = 0; t < numthreads; t++) {
+		mkarray(w->threads[t].cb, len, double);
+		mkarray(w->threads[t].cb1, len, double);
+		mkarray(w->threads[t].cb2, len, double);
+		mkarray(w->threads[t].cost, 2 * r + 3, double);
+		mkarray(w->threads[t].cost_prev, 2 * r + 3, double);
+		w->threads[t].cost++;
+		w->threads[t].cost_prev++;
+		mkarray(w->threads[t].diag, 2 * r + 1, double);
+		mkarray(w->threads[t].d, 2 * r + 1, double);
+		mkarray(w->threads[t].proj, len, double);
+		mkarray(w->threads[t].hl, len, double);
+		mkarray(w->threads[t].hu, len, double);
+		init(&w->threads[t].du, 2 * r + 2);
+		init(&w->threads[t].dl, 2 * r + 2);
+		mkarray(w->threads[t].heap, k, Neighbor);
+	}
+	w->pool = numthreads > 1 ? new threadpool(numthreads) : NULL;
+}
 
-	debug("ucrsuite_main(): allocating stuff\n");
-	mkarray(qo, len, double);
-	mkarray(uo, len, double);
-	mkarray(lo, len, double);
-	mkarray(order, len, int);
-	mkarray(Q_tmp, len, Index);
-	mkarray(u, len, double);
-	mkarray(l, len, double);
-	mkarray(cb, len, double);
-	mkarray(cb1, len, double);
-	mkarray(cb2, len, double);
-	mkarray(upper_lemire, len, double);
-	mkarray(lower_lemire, len, double);
-	debug("ucrsuite_main(): stuff allocated\n");
-
-	bsf = INF;
+/// Release the scratch buffers
+template <typename T>
+void destroy_workspace(workspace<T> *w)
+{
+	delete w->pool;
+	mxFree(w->gathered);
+	mxFree(w->q);
+	mxFree(w->qo);
+	mxFree(w->uo);
+	mxFree(w->lo);
+	mxFree(w->order);
+	mxFree(w->Q_tmp);
+	if (w->candidates)
+		mxFree(w->candidates);
+	mxFree(w->u);
+	mxFree(w->l);
+	mxFree(w->lu);
+	mxFree(w->ul);
+	for (int t = 0; t < w->numthreads; t++) {
+		mxFree(w->threads[t].cb);
+		mxFree(w->threads[t].cb1);
+		mxFree(w->threads[t].cb2);
+		mxFree(w->threads[t].cost - 1);
+		mxFree(w->threads[t].cost_prev - 1);
+		mxFree(w->threads[t].diag);
+		mxFree(w->threads[t].d);
+		mxFree(w->threads[t].proj);
+		mxFree(w->threads[t].hl);
+		mxFree(w->threads[t].hu);
+		destroy(&w->threads[t].du);
+		destroy(&w->threads[t].dl);
+		mxFree(w->threads[t].heap);
+	}
+	mxFree(w->threads);
+}
+
+/// A data set given to the MEX. Observation i of series n (both 0-based)
+/// is data[n * stride + i * step]. With the series in the columns of the
+/// matrix, as this MEX used to require, stride is the length of the series
+/// and step is 1; with the TimeBox layout, one series per row and the
+/// classes in the first column, stride is 1, step is the number of rows,
+/// and "data" points past the classes.
+template <typename T>
+struct dataset {
+	T *data;
+	long long stride, step;
+};
+
+/// Point a dataset at a MATLAB matrix of series of "len" observations,
+/// given in the TimeBox layout if "native" is true
+template <typename T>
+dataset<T> makedataset(const mxArray *matrix, int len, bool native)
+{
+	dataset<T> ds;
+
+	ds.data = (T*)mxGetData(matrix);
+	if (native) {
+		ds.stride = 1;
+		ds.step = mxGetM(matrix);
+		ds.data += ds.step;
+	}
+	else {
+		ds.stride = len;
+		ds.step = 1;
+	}
+	return ds;
+}
+
+/// Return the n-th series (0-based) as a contiguous array: a pointer into
+/// the data set if it is stored by columns, or else a copy in "buffer"
+template <typename T>
+inline T *getseries(const dataset<T> &ds, long long n, int len, T *buffer)
+{
+	T *series = ds.data + n * ds.stride;
+
+	if (ds.step == 1)
+		return series;
+	for (int i = 0; i < len; i++)
+		buffer[i] = series[i * ds.step];
+	return buffer;
+}
+
+/// Compute the envelopes of every training series. The envelopes depend
+/// only on the series and on the window, so they are computed once for all
+/// queries. "buffer" has room for one series.
+template <typename T>
+void training_envelopes(const dataset<T> &stack, int numseries, int len,
+		int r, T *lower, T *upper, T *buffer)
+{
+	for (int n = 0; n < numseries; n++) {
+		lower_upper_lemire(getseries(stack, n, len, buffer), len, r,
+				lower + (long long)n * len,
+				upper + (long long)n * len);
+	}
+}
+
+/// Create the query envelope and sort the query one time by abs(z-norm(q[i]))
+/// The query is kept in w->q in double precision.
+template <typename T>
+void prepare_query(workspace<T> *w, T *query, long long step)
+{
+	int len = w->len;
+	double *q = w->q;
+	long long i;
+
+	for (i = 0; i < len; i++)
+		q[i] = query[i * step];
 
 	/// Create envelop of the query: lower envelop, l, and upper envelop, u
-	debug("ucrsuite_main(): creating enevelope for query\n");
-	lower_upper_lemire(q, len, r, l, u);
-	debug("ucrsuite_main(): envelope created\n");
+	lower_upper_lemire(q, len, w->r, w->l, w->u);
+
+	/// LB_Webb also needs the lower envelop of u and the upper envelop of l
+	for (int st = 0; st < w->numstages; st++) {
+		if (w->cascade[st] == BOUND_WEBB) {
+			lower_upper_lemire(w->u, len, w->r, w->lu, w->threads[0].hu);
+			lower_upper_lemire(w->l, len, w->r, w->threads[0].hl, w->ul);
+			break;
+		}
+	}
 
-	/// Sort the query one time by abs(z-norm(q[i]))
 	for( i = 0; i<len; i++) {
-		Q_tmp[i].value = q[i];
-		Q_tmp[i].index = i;
+		w->Q_tmp[i].value = q[i];
+		w->Q_tmp[i].index = i;
 	}
-	qsort(Q_tmp, len, sizeof(Index),comp);
+	qsort(w->Q_tmp, len, sizeof(Index),comp);
 
 	/// also create another arrays for keeping sorted envelop
 	for( i=0; i<len; i++) {
-		int o = Q_tmp[i].index;
-		order[i] = o;
-		qo[i] = q[o];
-		uo[i] = u[o];
-		lo[i] = l[o];
+		int o = w->Q_tmp[i].index;
+		w->order[i] = o;
+		w->qo[i] = q[o];
+		w->uo[i] = w->u[o];
+		w->lo[i] = w->l[o];
 	}
-	mxFree(Q_tmp);
 
 	/// Initial the cummulative lower bound
-	for( i=0; i<len; i++) {
-		cb[i]=0;
-		cb1[i]=0;
-		cb2[i]=0;
+	for (int t = 0; t < w->numthreads; t++) {
+		for( i=0; i<len; i++) {
+			w->threads[t].cb[i]=0;
+			w->threads[t].cb1[i]=0;
+			w->threads[t].cb2[i]=0;
+		}
 	}
+}
+
+/// Order neighbors by distance, then by index
+inline bool closer(const Neighbor &a, const Neighbor &b)
+{
+	return a.dist < b.dist || (a.dist == b.dist && a.index < b.index);
+}
+
+/// Detailed counters of a search, filled only if requested. Times are in
+/// nanoseconds; the time of a lower bound includes LB_Keogh when that
+/// stage is the first to need it.
+struct searchstats {
+	double pruned[NUM_BOUNDS];   /// candidates rejected by each bound
+	double scheduled;    /// candidates never visited (sorted schedules)
+	double abandoned;    /// DTW calls that reached the best-so-far
+	double completed;    /// DTW calls that returned a smaller distance
+	double cells;        /// cells of the cost matrix calculated
+	double time[NUM_BOUNDS];     /// time spent in each bound
+	double schedtime;    /// time spent sorting the candidates
+	double dtwtime;      /// time spent in DTW
+};
+
+/// The k nearest neighbors found by a search over (part of) the stack. They
+/// are kept in a max-heap, so the k-th nearest neighbor is at the top.
+struct searchresult {
+	Neighbor *heap;
+	int size, k;
+	int pruned;
+	searchstats stats;
+};
+
+/// Clock for the timings of the search statistics
+typedef std::chrono::steady_clock::time_point timestamp;
 
+inline timestamp now()
+{
+	return std::chrono::steady_clock::now();
+}
+
+/// Nanoseconds elapsed since "start"
+inline double elapsed(timestamp start)
+{
+	return std::chrono::duration<double, std::nano>(now() - start).count();
+}
+
+/// Distance to the k-th nearest neighbor found so far
+inline double kth(searchresult &res)
+{
+	return res.size < res.k ? INF : res.heap[0].dist;
+}
+
+/// Insert a neighbor, replacing the k-th nearest one if the heap is full
+void insert(searchresult &res, double dist, int n)
+{
+	Neighbor x = { dist, n };
+
+	if (res.size < res.k) {
+		res.heap[res.size++] = x;
+		push_heap(res.heap, res.heap + res.size, closer);
+	}
+	else if (closer(x, res.heap[0])) {
+		pop_heap(res.heap, res.heap + res.k, closer);
+		res.heap[res.k - 1] = x;
+		push_heap(res.heap, res.heap + res.k, closer);
+	}
+}
+
+/// Pruning threshold for the next candidate, which is the distance to the
+/// k-th nearest neighbor found so far. A single thread visiting the stack
+/// in storage order uses its own best-so-far. Otherwise, a candidate tying
+/// with the best-so-far may have a smaller index than the current neighbor,
+/// so it must not be pruned. Because the cascade prunes when "lb >= bsf",
+/// the best-so-far is then nudged up to the next double. Parallel threads
+/// use the best-so-far shared by all threads.
+inline double threshold(searchresult &res, std::atomic<double> *shared,
+		bool strict)
+{
+	double bsf = shared ? shared->load(std::memory_order_relaxed) : kth(res);
+	return strict ? nextafter(bsf, HUGE_VAL) : bsf;
+}
+
+/// Run the cascade of lower bounds and DTW for the n-th training series
+/// (1-based) with the pruning threshold "bsf". Among equally distant
+/// candidates, the ones with the smallest indices are kept. If STATS is
+/// true, the counters and timings in res.stats are updated; otherwise,
+/// that code is not compiled at all.
+template <bool STATS, typename T>
+void evaluate(searchresult &res, workspace<T> *w, scratch *s,
+		const dataset<T> &stack, T *lower_env, T *upper_env, double *q,
+		int n, double bsf, std::atomic<double> *shared)
+{
+	int len = w->len;
+	int r = w->r;
+	double lb = 0, lb_k = 0, lb_k2 = 0;
+	bool have_k = false, have_k2 = false;
+	double dist;
+	T *series, *upper_lemire, *lower_lemire;
+	double *cb = s->cb, *cb1 = s->cb1, *cb2 = s->cb2;
 	int k=0;
+	timestamp start;
+
+	/// LB_Kim reads the candidate where it is; the other bounds and DTW
+	/// need it contiguous, so a candidate stored by rows is copied only
+	/// once it gets past LB_Kim
+	series = NULL;
+	auto candidate = [&]() {
+		if (!series) {
+			series = getseries(stack, n - 1, len, w->gathered +
+					(long long)(s - w->threads) * len);
+		}
+		return series;
+	};
+	lower_lemire = lower_env + (long long)(n - 1) * len;
+	upper_lemire = upper_env + (long long)(n - 1) * len;
+
+	/// LB_Keogh with the envelope of the query. LB_Improved, LB_Enhanced and
+	/// LB_Webb are built on top of it, so it is calculated at most once
+	auto keogh = [&]() {
+		if (!have_k) {
+			/// uo, lo are envelop of the query.
+			lb_k = w->kern.lb_keogh(w->order, candidate(), w->uo, w->lo, cb1, len, bsf);
+			have_k = true;
+		}
+		return lb_k;
+	};
+
+	/// Try the lower bounds in the order of the cascade; the candidate is
+	/// pruned by the first one that reaches the best-so-far
+	for (int st = 0; st < w->numstages; st++) {
+		if (STATS)
+			start = now();
+		switch (w->cascade[st]) {
+		case BOUND_KIM:
+			/// Use a constant lower bound to prune the obvious subsequence
+			lb = lb_kim_hierarchy(stack.data + (n - 1) * stack.stride,
+					q, len, bsf, stack.step);
+			break;
+		case BOUND_KEOGH:
+			/// Use a linear time lower bound to prune
+			lb = keogh();
+			break;
+		case BOUND_KEOGH2:
+			/// Use another lb_keogh to prune
+			/// qo is the sorted query. tz is unsorted z_normalized data.
+			if (!have_k2) {
+				lb_k2 = w->kern.lb_keogh_data(w->order, candidate(), w->qo, cb2, lower_lemire, upper_lemire, len, bsf);
+				have_k2 = true;
+			}
+			lb = lb_k2;
+			break;
+		case BOUND_IMPROVED:
+			lb = keogh();
+			if (lb < bsf)
+				lb = lb_improved(w->order, candidate(), w->qo, w->l, w->u, s->proj, s->hl, s->hu, &s->du, &s->dl, len, r, lb, bsf);
+			break;
+		case BOUND_ENHANCED:
+			lb = keogh();
+			if (lb < bsf)
+				lb = lb_enhanced(candidate(), q, cb1, len, r, w->bands, bsf);
+			break;
+		case BOUND_WEBB:
+			lb = keogh();
+			if (lb < bsf)
+				lb = lb_webb(w->order, w->qo, lower_lemire, upper_lemire, w->lu, w->ul, len, lb, bsf);
+			break;
+		}
+		if (STATS)
+			res.stats.time[w->cascade[st]] += elapsed(start);
+		if (lb >= bsf) {
+			res.pruned++;
+			if (STATS)
+				res.stats.pruned[w->cascade[st]]++;
+			return;
+		}
+	}
+
+	/// Choose better lower bound between lb_keogh and lb_keogh2 to be used in early abandoning DTW
+	/// Note that cb and cb2 will be cumulative summed here.
+	if (have_k && (!have_k2 || lb_k > lb_k2)) {
+		cb[len-1]=cb1[len-1];
+		for(k=len-2; k>=0; k--)
+			cb[k] = cb[k+1]+cb1[k];
+	}
+	else if (have_k2) {
+		cb[len-1]=cb2[len-1];
+		for(k=len-2; k>=0; k--)
+			cb[k] = cb[k+1]+cb2[k];
+	}
+	else {
+		/// Without LB_Keogh there is no bound to abandon DTW early
+		for(k=0; k<len; k++)
+			cb[k] = 0;
+	}
+
+	/// Compute DTW and early abandoning if possible
+	if (STATS)
+		start = now();
+	dist = w->kern.dtw(candidate(), q, cb, len, r, s, bsf);
+	if (STATS) {
+		res.stats.dtwtime += elapsed(start);
+		res.stats.cells += s->cells;
+		if (dist >= bsf)
+			res.stats.abandoned++;
+		else
+			res.stats.completed++;
+	}
+
+	/// An abandoned DTW returns a value no smaller than
+	/// the threshold, so "dist < bsf" means dist is exact
+	if (dist < bsf) {
+		insert(res, dist, n);
+
+		/// Every thread's k-th nearest neighbor is at least
+		/// as close as the global k-th nearest neighbor
+		if (shared && res.size == res.k) {
+			double current = shared->load();
+			double mine = kth(res);
+			while (mine < current && !shared->compare_exchange_weak(current, mine))
+				;
+		}
+	}
+}
 
-	//start with the first series
-	series = stack;
+/// Sorting function for the candidates, sort by lower bound from low to
+/// high, then by index
+int comp_candidates(const void *a, const void* b)
+{
+	Index* x = (Index*)a;
+	Index* y = (Index*)b;
+	if (x->value != y->value)
+		return x->value < y->value ? -1 : 1;
+	return x->index - y->index;
+}
+
+/// Compute the scheduling lower bound of every candidate and sort them.
+/// Returns the number of candidates.
+template <typename T>
+int schedule_candidates(workspace<T> *w, const dataset<T> &stack, double *q,
+		int numseries, int skipindex)
+{
+	int len = w->len;
+	int numcandidates = 0;
 
 	for (int n = 1; n <= numseries; n++) {
-		if (n == skipindex) {
-			// This is the test sample in-loco and should be skipped
-			// point to the next series in the data set
-			series += len;
-			continue;
+		if (n != skipindex)
+			w->candidates[numcandidates++].index = n;
+	}
+
+	auto bound = [&](int t) {
+		for (int c = t; c < numcandidates; c += w->numthreads) {
+			long long n = w->candidates[c].index - 1;
+			if (w->schedule == SCHEDULE_KIM) {
+				w->candidates[c].value = lb_kim_hierarchy(
+						stack.data + n * stack.stride,
+						q, len, INF, stack.step);
+			}
+			else {
+				T *series = getseries(stack, n, len,
+						w->gathered + (long long)t * len);
+				w->candidates[c].value = w->kern.lb_keogh(w->order,
+						series, w->uo, w->lo,
+						w->threads[t].cb1, len, INF);
+			}
 		}
+	};
+	if (w->pool)
+		w->pool->run(bound);
+	else
+		bound(0);
+
+	qsort(w->candidates, numcandidates, sizeof(Index), comp_candidates);
+	return numcandidates;
+}
 
-		lower_upper_lemire(series, len, r, lower_lemire, upper_lemire);
+/// Number of candidates taken at once by each thread in a parallel search
+#define PARALLEL_BLOCK 16
 
-		/// Use a constant lower bound to prune the obvious subsequence
-		lb_kim = lb_kim_hierarchy(series, q, len, bsf);
+/// Main Function
+/// The query must have been prepared with prepare_query(); lower_env and
+/// upper_env are the training envelopes from training_envelopes().
+///
+/// With more than one thread, the stack is split into blocks of candidates
+/// that threads take as they become idle. All threads share the best-so-far
+/// so that every thread prunes with the closest neighbor found by any of
+/// them.
+///
+/// Unless the schedule is SCHEDULE_STORAGE, a lower bound is calculated for
+/// every candidate before the search, and candidates are visited from the
+/// smallest to the largest bound. The search stops at the first candidate
+/// whose bound reaches the best-so-far, since all remaining candidates
+/// would be pruned as well.
+///
+/// The k nearest neighbors are kept and the pruning threshold is the
+/// distance to the k-th nearest neighbor found so far. They are returned in
+/// "nearest" from the closest to the farthest, with their actual (not
+/// squared) distances. If there are fewer than k candidates, the remaining
+/// neighbors have index 0 and distance INF.
+///
+/// Either way, the neighbors are the same returned by a single thread in
+/// storage order: among the equally distant candidates, the ones with the
+/// smallest indices are chosen. The number of pruned candidates, however,
+/// depends on the order the neighbors are found.
+///
+/// If STATS is true, the detailed counters of the search are added to
+/// "stats".
+template <bool STATS, typename T>
+void ucrsuite_main(Neighbor *nearest, int &pruned, searchstats *stats,
+		workspace<T> *w, const dataset<T> &stack, T *lower_env,
+		T *upper_env, double *q, int numseries, int skipindex)
+{
+	debug("ucrsuite_main() called with arguments (&int, &int, &int, "
+			"workspace*, double*, double*, double*, double*, "
+			"%d, %d)\n", numseries, skipindex);
+
+	int k = w->k;
+	bool sorted = w->schedule != SCHEDULE_STORAGE;
+	timestamp start;
+	if (STATS)
+		start = now();
+	int numcandidates = sorted ?
+		schedule_candidates(w, stack, q, numseries, skipindex) :
+		numseries;
+	if (STATS)
+		stats->schedtime += elapsed(start);
+	std::atomic<double> shared(INF);
+	std::atomic<int> next(0);
+	std::atomic<int> visited(0);
+	std::atomic<bool> done(false);
+	std::vector<searchresult> results(w->numthreads);
+
+	for (int t = 0; t < w->numthreads; t++) {
+		results[t].heap = w->threads[t].heap;
+		results[t].size = 0;
+		results[t].k = k;
+		results[t].pruned = 0;
+		if (STATS)
+			memset(&results[t].stats, 0, sizeof (searchstats));
+	}
 
-		if (lb_kim < bsf) {
-			/// Use a linear time lower bound to prune
-			/// uo, lo are envelop of the query.
-			lb_k = lb_keogh_cumulative(order, series, uo, lo, cb1, len, bsf);
-			if (lb_k < bsf) {
-				/// Use another lb_keogh to prune
-				/// qo is the sorted query. tz is unsorted z_normalized data.
-				lb_k2 = lb_keogh_data_cumulative(order, series, qo, cb2, lower_lemire, upper_lemire, len, bsf);
-				if (lb_k2 < bsf) {
-					/// Choose better lower bound between lb_keogh and lb_keogh2 to be used in early abandoning DTW
-					/// Note that cb and cb2 will be cumulative summed here.
-					if (lb_k > lb_k2) {
-						cb[len-1]=cb1[len-1];
-						for(k=len-2; k>=0; k--)
-							cb[k] = cb[k+1]+cb1[k];
-					}
-					else {
-						cb[len-1]=cb2[len-1];
-						for(k=len-2; k>=0; k--)
-							cb[k] = cb[k+1]+cb2[k];
-					}
-
-					/// Compute DTW and early abandoning if possible
-					dist = dtw(series, q, cb, len, r, bsf);
-
-					if( dist < bsf ) {
-						bsf = dist;
-						neighbor = n;
-					}
-				} else
-					pruned++;
-			} else
-				pruned++;
-		} else
-			pruned++;
-
-		// point to the next series in the data set
-		series += len;
-	}
-
-	dist = sqrt(bsf);
+	/// Visit the candidates from the "first"-th up to the "last"-th in the
+	/// search order (0-based). Returns false once the remaining candidates
+	/// are known to be pruned
+	auto search = [&](int t, int first, int last, std::atomic<double> *sh) {
+		for (int c = first; c <= last; c++) {
+			int n = sorted ? w->candidates[c].index : c + 1;
+			double bsf = threshold(results[t], sh, sorted || sh);
+
+			if (sorted && w->candidates[c].value >= bsf) {
+				visited += c - first;
+				return false;
+			}
+			if (n == skipindex) {
+				// This is the test sample in-loco and should be skipped
+				continue;
+			}
+			evaluate<STATS>(results[t], w, &w->threads[t], stack,
+					lower_env, upper_env, q, n, bsf, sh);
+		}
+		visited += last - first + 1;
+		return true;
+	};
+
+	if (!w->pool) {
+		search(0, 0, numcandidates - 1, NULL);
+	}
+	else {
+		w->pool->run([&](int t) {
+			int first;
+			while (!done && (first = next.fetch_add(PARALLEL_BLOCK)) < numcandidates) {
+				int last = min(first + PARALLEL_BLOCK - 1, numcandidates - 1);
+				if (!search(t, first, last, &shared))
+					done = true;
+			}
+		});
+	}
+
+	/// Deterministic tie rule: smallest distance, then smallest index
+	std::vector<Neighbor> merged;
+	for (int t = 0; t < w->numthreads; t++) {
+		merged.insert(merged.end(), results[t].heap,
+				results[t].heap + results[t].size);
+		pruned += results[t].pruned;
+		if (STATS) {
+			searchstats &ts = results[t].stats;
+			for (int b = 0; b < NUM_BOUNDS; b++) {
+				stats->pruned[b] += ts.pruned[b];
+				stats->time[b] += ts.time[b];
+			}
+			stats->abandoned += ts.abandoned;
+			stats->completed += ts.completed;
+			stats->cells += ts.cells;
+			stats->dtwtime += ts.dtwtime;
+		}
+	}
+	sort(merged.begin(), merged.end(), closer);
+
+	for (int j = 0; j < k; j++) {
+		if (j < (int)merged.size()) {
+			nearest[j].index = merged[j].index;
+			nearest[j].dist = sqrt(merged[j].dist);
+		}
+		else {
+			nearest[j].index = 0;
+			nearest[j].dist = INF;
+		}
+	}
+
+	/// Candidates never visited were pruned by the scheduling bound
+	if (sorted) {
+		pruned += numcandidates - visited;
+		if (STATS)
+			stats->scheduled += numcandidates - visited;
+	}
+}
+
+/// Read a non-negative integer field from the OPTIONS struct. Flags such as
+/// "native" may also be LOGICAL. Missing fields take the default value
+int getoption(const mxArray *options, const char *name, int defvalue)
+{
+	mxArray *field;
+
+	if (!options || !(field = mxGetField(options, 0, name)))
+		return defvalue;
+	if (!(mxIsDouble(field) || mxIsLogical(field)) || mxIsComplex(field) ||
+			mxGetNumberOfElements(field) != 1 ||
+			mxGetScalar(field) < 0) {
+		char buf[1024];
+		sprintf(buf, "Field \"%s\" of OPTIONS must be a non-complex, "
+				"non-negative DOUBLE or LOGICAL scalar", name);
+		mexErrMsgTxt(buf);
+	}
+	return mxGetScalar(field);
+}
+
+/// Read the search schedule from the OPTIONS struct
+int getschedule(const mxArray *options)
+{
+	mxArray *field;
+	char buf[16];
+
+	if (!options || !(field = mxGetField(options, 0, "schedule")))
+		return SCHEDULE_STORAGE;
+	if (!mxIsChar(field) || mxGetString(field, buf, sizeof buf)) {
+		mexErrMsgTxt("Field \"schedule\" of OPTIONS must be a string");
+	}
+	if (!strcmp(buf, "storage"))
+		return SCHEDULE_STORAGE;
+	if (!strcmp(buf, "kim"))
+		return SCHEDULE_KIM;
+	if (!strcmp(buf, "keogh"))
+		return SCHEDULE_KEOGH;
+	mexErrMsgTxt("Field \"schedule\" of OPTIONS must be one of "
+			"\"storage\", \"kim\", or \"keogh\"");
+	return SCHEDULE_STORAGE;
+}
+
+/// Read the instruction set from the OPTIONS struct
+int getsimd(const mxArray *options)
+{
+	mxArray *field;
+	char buf[16];
+	int simd;
+
+	if (!options || !(field = mxGetField(options, 0, "simd")))
+		return SIMD_AUTO;
+	if (!mxIsChar(field) || mxGetString(field, buf, sizeof buf)) {
+		mexErrMsgTxt("Field \"simd\" of OPTIONS must be a string");
+	}
+	if (!strcmp(buf, "auto"))
+		return SIMD_AUTO;
+	if (!strcmp(buf, "scalar"))
+		simd = SIMD_SCALAR;
+	else if (!strcmp(buf, "sse4"))
+		simd = SIMD_SSE4;
+	else if (!strcmp(buf, "avx2"))
+		simd = SIMD_AVX2;
+	else if (!strcmp(buf, "avx512"))
+		simd = SIMD_AVX512;
+	else {
+		mexErrMsgTxt("Field \"simd\" of OPTIONS must be one of "
+				"\"auto\", \"scalar\", \"sse4\", \"avx2\", "
+				"or \"avx512\"");
+		return SIMD_AUTO;
+	}
+	if (!simd_supported(simd)) {
+		char msg[1024];
+		sprintf(msg, "This processor does not support the instruction "
+				"set \"%s\"", buf);
+		mexErrMsgTxt(msg);
+	}
+	return simd;
+}
+
+/// Read the cascade of lower bounds from the OPTIONS struct. The cascade is
+/// either a string or a cell array of strings
+void getcascade(const mxArray *options, searchoptions *opt)
+{
+	static const char *names[] = {
+		"kim", "keogh", "keogh2", "improved", "enhanced", "webb"
+	};
+	static const int bounds[] = {
+		BOUND_KIM, BOUND_KEOGH, BOUND_KEOGH2, BOUND_IMPROVED,
+		BOUND_ENHANCED, BOUND_WEBB
+	};
+	mxArray *field;
+	char buf[16];
+	int numstages;
+
+	if (!options || !(field = mxGetField(options, 0, "cascade"))) {
+		opt->cascade[0] = BOUND_KIM;
+		opt->cascade[1] = BOUND_KEOGH;
+		opt->cascade[2] = BOUND_KEOGH2;
+		opt->numstages = 3;
+		return;
+	}
+	numstages = mxIsCell(field) ? mxGetNumberOfElements(field) : 1;
+	if (!(mxIsChar(field) || mxIsCell(field)) || numstages > MAX_CASCADE) {
+		char msg[1024];
+		sprintf(msg, "Field \"cascade\" of OPTIONS must be a string or "
+				"a cell array of at most %d strings",
+				MAX_CASCADE);
+		mexErrMsgTxt(msg);
+	}
+	for (int st = 0; st < numstages; st++) {
+		const mxArray *name = mxIsCell(field) ? mxGetCell(field, st) : field;
+		int b;
+
+		if (!name || !mxIsChar(name) || mxGetString(name, buf, sizeof buf))
+			b = -1;
+		else {
+			for (b = 5; b >= 0 && strcmp(buf, names[b]); b--)
+				;
+		}
+		if (b < 0) {
+			mexErrMsgTxt("Stages in field \"cascade\" of OPTIONS must "
+					"be \"kim\", \"keogh\", \"keogh2\", "
+					"\"improved\", \"enhanced\", or \"webb\"");
+		}
+		opt->cascade[st] = bounds[b];
+	}
+	opt->numstages = numstages;
+}
+
+/// Read a Sakoe-Chiba window. A window of len-1 observations already admits
+/// every warping path, so larger windows (including Inf, for unconstrained
+/// DTW) are reduced to len-1, which keeps the cost rows and the envelopes
+/// within the length of the series. Returns -1 if the window is invalid.
+int getwindow(const mxArray *arg, int len)
+{
+	double window;
+
+	if (!mxIsDouble(arg) || mxIsComplex(arg) ||
+			mxGetNumberOfElements(arg) != 1 ||
+			!((window = mxGetScalar(arg)) >= 0))
+		return -1;
+	return window >= len - 1 ? len - 1 : (int)window;
+}
+
+/// Search the stack for the nearest neighbors of every test instance. T is
+/// the type of the observations in both the stack and the needle; the
+/// distances are always calculated in double precision. If "stats_out" is
+/// not NULL, it receives the detailed counters of each test instance.
+template <typename T>
+void nn1dtw(const dataset<T> &stack, const dataset<T> &needle,
+		double *skipindices, int numskip,
+		int numseries, int len, int numqueries, int r,
+		searchoptions *opt, double *neighbor_out,
+		double *distance_out, double *pruned_out,
+		searchstats *stats_out)
+{
+	int k = opt->k;
+	T *lower_env, *upper_env;
+	Neighbor *nearest;
+	workspace<T> w;
+
+	/* Envelopes of the training series and scratch buffers are shared by
+	 * all test instances
+	 */
+	debug("Creating envelopes for the training series\n");
+	mkarray(lower_env, (long long)numseries * len, T);
+	mkarray(upper_env, (long long)numseries * len, T);
+	init_workspace(&w, len, r, numseries, opt);
+	training_envelopes(stack, numseries, len, r, lower_env, upper_env,
+			w.gathered);
+	mkarray(nearest, k, Neighbor);
+
+	for (int query = 0; query < numqueries; query++) {
+		int pruned = 0;
+		int skipindex = skipindices[numskip == 1 ? 0 : query];
+
+		debug("Calling ucrsuite_main() for test instance %d\n", query);
+		prepare_query(&w, needle.data + query * needle.stride,
+				needle.step);
+		if (stats_out) {
+			ucrsuite_main<true>(nearest, pruned, stats_out + query,
+					&w, stack, lower_env, upper_env, w.q,
+					numseries, skipindex);
+		}
+		else {
+			ucrsuite_main<false>(nearest, pruned, NULL, &w, stack,
+					lower_env, upper_env, w.q, numseries,
+					skipindex);
+		}
+		debug("Returned from ucrsuite_main()\n");
+
+		for (int j = 0; j < k; j++) {
+			neighbor_out[query + (long long)j * numqueries] = nearest[j].index;
+			if (distance_out) {
+				distance_out[query + (long long)j * numqueries] = nearest[j].dist;
+			}
+		}
+		if (pruned_out) {
+			pruned_out[query] = pruned;
+		}
+	}
+
+	destroy_workspace(&w);
+	mxFree(nearest);
+	mxFree(lower_env);
+	mxFree(upper_env);
+}
+
+/// Best distance known between a series and a candidate in the window sweep.
+/// If "window" is not -1, "dist" is the DTW distance of a warping path that
+/// fits any window of at least "window" observations; otherwise, "dist" is
+/// only a lower bound (LB_Keogh or an abandoned DTW).
+struct pairdist {
+	double dist;
+	int window;
+};
+
+/// Per-thread scratch buffers for the window sweep
+struct sweepscratch {
+	double *q;           /// the series being classified, in double precision
+	double *l, *u;       /// its envelopes for the current window
+	double *cb1;
+	scratch dtw;         /// cumulative bound and cost rows for DTW
+	int *dev, *dev_prev;
+	Index *candidates;   /// candidates sorted by their best known distance
+	deque du, dl;        /// queues for the envelopes of the series
+};
+
+/// Leave-one-out 1-NN search of every series of the stack for every window
+/// from "maxr" down to 0, after Tan, Herrmann, Forestier, Webb and
+/// Petitjean, "Efficient search of the best warping window for Dynamic Time
+/// Warping", SDM 2018 (FastWWSearch).
+///
+/// Shrinking the window never decreases DTW, so a distance found with a
+/// window is a lower bound for all smaller windows. Moreover, it stays
+/// exact as long as the window admits its warping path. Thus, if the path
+/// to the nearest neighbor of a series fits the next window, the neighbor
+/// is the same and nothing is calculated. Otherwise, the stack is searched
+/// again, pruning each candidate with the best distance known for it
+/// before resorting to LB_Keogh and DTW. The best distances are kept for
+/// every pair of series, which takes 16*N^2 bytes for N series.
+///
+/// The neighbor of the n-th series for window r goes into row n, column
+/// r+1 of "neighbor_out" (1-based index) and "distance_out". Ties go to the
+/// smallest index, so the neighbors are the same found by the search with
+/// each window alone.
+template <typename T>
+void windowsweep(const dataset<T> &data, int numseries, int len, int maxr,
+		searchoptions *opt, double *neighbor_out, double *distance_out)
+{
+	int numthreads = opt->numthreads;
+	kernels<T> kern = select_kernels<T>(opt->simd);
+	pairdist *pairs;
+	sweepscratch *threads;
+	int *nearest, *order;
+	double *bestdist;
+	threadpool *pool = numthreads > 1 ? new threadpool(numthreads) : NULL;
+	std::atomic<int> next;
+	T *stack = data.data;
+
+	/// Every series is read many times, and the sweep keeps N^2 pairs
+	/// anyway, so a stack given by rows is copied by columns once
+	if (data.step != 1) {
+		mkarray(stack, (long long)numseries * len, T);
+		for (int i = 0; i < len; i++) {
+			for (long long n = 0; n < numseries; n++)
+				stack[n * len + i] = data.data[n + i * data.step];
+		}
+	}
+
+	mkarray(pairs, (long long)numseries * numseries, pairdist);
+	for (long long p = 0; p < (long long)numseries * numseries; p++)
+		pairs[p].window = -1;
+	mkarray(nearest, numseries, int);
+	mkarray(bestdist, numseries, double);
+	for (int n = 0; n < numseries; n++)
+		nearest[n] = -1;
+	mkarray(order, len, int);
+	for (int i = 0; i < len; i++)
+		order[i] = i;
+	mkarray(threads, numthreads, sweepscratch);
+	for (int t = 0; t < numthreads; t++) {
+		mkarray(threads[t].q, len, double);
+		mkarray(threads[t].l, len, double);
+		mkarray(threads[t].u, len, double);
+		mkarray(threads[t].cb1, len, double);
+		mkarray(threads[t].dtw.cb, len, double);
+		mkarray(threads[t].dtw.cost, 2 * maxr + 3, double);
+		mkarray(threads[t].dtw.cost_prev, 2 * maxr + 3, double);
+		threads[t].dtw.cost++;
+		threads[t].dtw.cost_prev++;
+		mkarray(threads[t].dtw.diag, 2 * maxr + 1, double);
+		mkarray(threads[t].dtw.d, 2 * maxr + 1, double);
+		mkarray(threads[t].dev, 2 * maxr + 1, int);
+		mkarray(threads[t].dev_prev, 2 * maxr + 1, int);
+		mkarray(threads[t].candidates, numseries, Index);
+		init(&threads[t].du, 2 * maxr + 2);
+		init(&threads[t].dl, 2 * maxr + 2);
+	}
+
+	/// Search the nearest neighbor of the n-th series (0-based) with the
+	/// window r, starting from its neighbor with the window r+1
+	auto search = [&](sweepscratch *s, int n, int r) {
+		pairdist *row = pairs + (long long)n * numseries;
+		int best = nearest[n];
+		double bsf = INF;
+
+		if (best >= 0 && row[best].window >= 0 && row[best].window <= r)
+			return;
+
+		for (int i = 0; i < len; i++)
+			s->q[i] = stack[(long long)n * len + i];
+		lower_upper_lemire(s->q, len, r, s->l, s->u, &s->du, &s->dl);
+
+		/// LB_Keogh and DTW with early abandoning. Whatever the outcome,
+		/// the result is a lower bound for the smaller windows
+		auto evaluate = [&](int c, double cutoff) {
+			T *series = stack + (long long)c * len;
+			double *cb = s->dtw.cb;
+			double d = kern.lb_keogh(order, series, s->u, s->l,
+					s->cb1, len, cutoff);
+
+			if (d < cutoff) {
+				cb[len-1] = s->cb1[len-1];
+				for (int k = len - 2; k >= 0; k--)
+					cb[k] = cb[k+1] + s->cb1[k];
+				d = kern.dtw(series, s->q, cb, len, r, &s->dtw,
+						cutoff);
+			}
+			row[c].dist = max(row[c].dist, d);
+			row[c].window = -1;
+			return d;
+		};
+
+		/// Exact DTW and the smallest window that admits its path. This
+		/// is only needed for the nearest neighbor
+		auto exact = [&](int c) {
+			for (int k = 0; k < len; k++)
+				s->dtw.cb[k] = 0;
+			row[c].dist = dtw_minwindow(stack + (long long)c * len,
+					s->q, s->dtw.cb, len, r, s->dtw.cost,
+					s->dtw.cost_prev, s->dev, s->dev_prev,
+					INF, &row[c].window);
+			return row[c].dist;
+		};
+
+		/// Start from the distance to the previous neighbor
+		if (best >= 0)
+			bsf = exact(best);
+
+		/// Visit the candidates from the smallest to the largest bound, so
+		/// that the closest ones come first and prune the others
+		int numcandidates = 0;
+		for (int c = 0; c < numseries; c++) {
+			if (c != n && c != best) {
+				s->candidates[numcandidates].value = row[c].dist;
+				s->candidates[numcandidates++].index = c;
+			}
+		}
+		qsort(s->candidates, numcandidates, sizeof(Index), comp_candidates);
+
+		for (int i = 0; i < numcandidates; i++) {
+			int c = s->candidates[i].index;
+
+			/// A candidate tying with the best-so-far wins if it has a
+			/// smaller index
+			double cutoff = c < best ? nextafter(bsf, HUGE_VAL) : bsf;
+			double d;
+
+			if (s->candidates[i].value >= nextafter(bsf, HUGE_VAL))
+				break;
+			if (row[c].window >= 0 && row[c].window <= r)
+				d = row[c].dist;
+			else if (row[c].dist >= cutoff)
+				continue;
+			else
+				d = evaluate(c, cutoff);
+
+			/// An abandoned DTW is no smaller than the cutoff
+			if (d < cutoff) {
+				best = c;
+				bsf = d;
+			}
+		}
+		if (row[best].window < 0 || row[best].window > r)
+			exact(best);
+		nearest[n] = best;
+		bestdist[n] = bsf;
+	};
+
+	for (int r = maxr; r >= 0; r--) {
+		next = 0;
+		auto job = [&](int t) {
+			int first;
+			while ((first = next.fetch_add(PARALLEL_BLOCK)) < numseries) {
+				int last = min(first + PARALLEL_BLOCK, numseries);
+				for (int n = first; n < last; n++)
+					search(&threads[t], n, r);
+			}
+		};
+		if (pool)
+			pool->run(job);
+		else
+			job(0);
+
+		for (int n = 0; n < numseries; n++) {
+			neighbor_out[n + (long long)r * numseries] = nearest[n] + 1;
+			distance_out[n + (long long)r * numseries] = sqrt(bestdist[n]);
+		}
+	}
+
+	delete pool;
+	for (int t = 0; t < numthreads; t++) {
+		mxFree(threads[t].q);
+		mxFree(threads[t].l);
+		mxFree(threads[t].u);
+		mxFree(threads[t].cb1);
+		mxFree(threads[t].dtw.cb);
+		mxFree(threads[t].dtw.cost - 1);
+		mxFree(threads[t].dtw.cost_prev - 1);
+		mxFree(threads[t].dtw.diag);
+		mxFree(threads[t].dtw.d);
+		mxFree(threads[t].dev);
+		mxFree(threads[t].dev_prev);
+		mxFree(threads[t].candidates);
+		destroy(&threads[t].du);
+		destroy(&threads[t].dl);
+	}
+	mxFree(threads);
+	mxFree(order);
+	mxFree(bestdist);
+	mxFree(nearest);
+	mxFree(pairs);
+	if (stack != data.data)
+		mxFree(stack);
+}
+
+/// The window sweep mode of the MEX:
+///
+///     [neighbors, distances] = mexFunction('windows', stack, maxr)
+///     [neighbors, distances] = mexFunction('windows', stack, maxr, options)
+///
+/// Every series of the stack is classified by leave-one-out with every
+/// Sakoe-Chiba window from 0 to "maxr" (see windowsweep). Both outputs have
+/// one row per series of the stack and one column per window, starting
+/// from window 0. OPTIONS accepts the fields "threads", "simd" and
+/// "native".
+void windowsmode(int nleft, mxArray *left[], int nright, const mxArray *right[])
+{
+	int numseries, len, maxr, numwindows;
+	bool single, native;
+	searchoptions opt;
+	double *neighbors, *distances;
+	mxArray *distances_out;
+	const mxArray *options;
+
+	if (nright != 3 && nright != 4) {
+		mexErrMsgTxt("Window sweep expects two or three inputs after "
+				"'windows'");
+	}
+
+	options = nright >= 4 ? right[3] : NULL;
+	if (options && (!mxIsStruct(options) ||
+				mxGetNumberOfElements(options) != 1)) {
+		mexErrMsgTxt("OPTIONS must be a scalar struct");
+	}
+	native = getoption(options, "native", 0) != 0;
+
+	len = native ? (int)mxGetN(right[1]) - 1 : (int)mxGetM(right[1]);
+	numseries = native ? mxGetM(right[1]) : mxGetN(right[1]);
+	single = mxIsSingle(right[1]);
+	if (!(mxIsDouble(right[1]) || single) || mxIsComplex(right[1]) ||
+			len < 1 || numseries < 2) {
+		mexErrMsgTxt("STACK must be a non-complex matrix of DOUBLE or "
+				"SINGLE with at least two series");
+	}
+	if ((maxr = getwindow(right[2], len)) < 0 ||
+			!(mxGetScalar(right[2]) < INT_MAX)) {
+		mexErrMsgTxt("Maximum window (r) must be a non-complex, "
+				"non-negative and finite DOUBLE scalar");
+	}
+	numwindows = (int)mxGetScalar(right[2]) + 1;
+
+	opt.numthreads = getoption(options, "threads", 1);
+	if (opt.numthreads == 0) {
+		opt.numthreads = std::thread::hardware_concurrency();
+	}
+	opt.numthreads = max(1, min(opt.numthreads, numseries));
+	opt.simd = getsimd(options);
+
+	left[0] = mxCreateDoubleMatrix(numseries, numwindows, mxREAL);
+	distances_out = mxCreateDoubleMatrix(numseries, numwindows, mxREAL);
+	neighbors = mxGetPr(left[0]);
+	distances = mxGetPr(distances_out);
+	if (single) {
+		windowsweep(makedataset<float>(right[1], len, native),
+				numseries, len, maxr, &opt, neighbors,
+				distances);
+	}
+	else {
+		windowsweep(makedataset<double>(right[1], len, native),
+				numseries, len, maxr, &opt, neighbors,
+				distances);
+	}
+
+	/// Windows from len-1 onwards are unconstrained DTW
+	for (long long p = (long long)(maxr + 1) * numseries;
+			p < (long long)numwindows * numseries; p++) {
+		neighbors[p] = neighbors[p - numseries];
+		distances[p] = distances[p - numseries];
+	}
+	if (nleft >= 2)
+		left[1] = distances_out;
+	else
+		mxDestroyArray(distances_out);
+}
+
+/// Create the STATS output: a scalar struct whose fields have one row per
+/// test instance
+mxArray *statsstruct(searchstats *stats, int numqueries)
+{
+	static const char *fields[] = {
+		"kim", "keogh", "keogh2", "improved", "enhanced", "webb",
+		"schedule", "abandoned", "completed", "cells", "time"
+	};
+	static const char *timefields[] = {
+		"kim", "keogh", "keogh2", "improved", "enhanced", "webb",
+		"schedule", "dtw"
+	};
+	mxArray *out = mxCreateStructMatrix(1, 1, 11, fields);
+	mxArray *time = mxCreateStructMatrix(1, 1, 8, timefields);
+	double *counters[10], *times[8];
+
+	for (int f = 0; f < 10; f++) {
+		mxArray *column = mxCreateDoubleMatrix(numqueries, 1, mxREAL);
+		counters[f] = mxGetPr(column);
+		mxSetField(out, 0, fields[f], column);
+	}
+	for (int f = 0; f < 8; f++) {
+		mxArray *column = mxCreateDoubleMatrix(numqueries, 1, mxREAL);
+		times[f] = mxGetPr(column);
+		mxSetField(time, 0, timefields[f], column);
+	}
+	mxSetField(out, 0, "time", time);
+
+	for (int query = 0; query < numqueries; query++) {
+		for (int b = 0; b < NUM_BOUNDS; b++) {
+			counters[b][query] = stats[query].pruned[b];
+			times[b][query] = stats[query].time[b];
+		}
+		counters[6][query] = stats[query].scheduled;
+		counters[7][query] = stats[query].abandoned;
+		counters[8][query] = stats[query].completed;
+		counters[9][query] = stats[query].cells;
+		times[6][query] = stats[query].schedtime;
+		times[7][query] = stats[query].dtwtime;
+	}
+	return out;
 }
 
 void mexFunction(int nleft, mxArray *left[], int nright, const mxArray *right[])
@@ -530,36 +2135,136 @@ void mexFunction(int nleft, mxArray *left[], int nright, const mxArray *right[])
 	 *  Usage:
 	 *  
 	 *  	[bestidx, distance, pruned] = mexFunction(stack, needle, ...
-	 *  						r, skipindex)
+	 *  						skipindex, r)
+	 *  	[bestidx, distance, pruned] = mexFunction(stack, needle, ...
+	 *  						skipindex, r, options)
+	 *  	[bestidx, distance, pruned, stats] = mexFunction(...)
+	 *  	[neighbors, distances] = mexFunction('windows', stack, ...
+	 *  						maxr, options)
 	 *
 	 *  Where the input arguments are:
          *
          *     stack     - the data set (observations ONLY; column-wise matrix*)
-         *     needle    - the test instance (observations ONLY)
-	 *     r         - the width of the Sakoe-Chiba window in number of
-	 *                 observations. If a floating point value is supplied,
-	 *                 it will be rounded to the next integer
+	 *                 of DOUBLE or SINGLE
+         *     needle    - the test instance (observations ONLY), or a
+	 *                 matrix of test instances in the same column-wise
+	 *                 layout as the stack (batch mode)
          *     skipindex - if the test instance is contained in the data set,
          *                 skipindex must be the instance of the test instance;
-         *                 otherwise it should be -1
+         *                 otherwise it should be -1. In batch mode, this may
+	 *                 be either a scalar that applies to all test
+	 *                 instances or a vector with one index per instance
+	 *     r         - the width of the Sakoe-Chiba window in number of
+	 *                 observations. If a floating point value is supplied,
+	 *                 it will be rounded to the next integer. Windows
+	 *                 as large as the series or larger, including Inf,
+	 *                 give unconstrained DTW
+	 *     options   - optional scalar struct with the fields below
+	 *
+	 *  The fields accepted in OPTIONS are:
+	 *
+	 *     threads   - number of threads that search the stack for each
+	 *                 test instance (default: 1). If 0, use as many
+	 *                 threads as there are processors
+	 *     schedule  - order in which the training series are visited:
+	 *                 'storage' visits them in the order of the stack
+	 *                 (default); 'kim' and 'keogh' first calculate
+	 *                 LB_Kim or LB_Keogh for all training series and visit
+	 *                 them from the smallest to the largest lower bound,
+	 *                 stopping as soon as the lower bound reaches the
+	 *                 distance to the nearest neighbor found so far
+	 *     k         - number of nearest neighbors (default: 1). The
+	 *                 distance to the k-th nearest neighbor found so far
+	 *                 is used to prune candidates, so k-NN costs about
+	 *                 the same as 1-NN
+	 *     simd      - instruction set used by LB_Keogh and DTW: 'auto'
+	 *                 picks the widest one supported by the processor
+	 *                 (default); 'scalar', 'sse4', 'avx2', and 'avx512'
+	 *                 force one of them. All of them return exactly the
+	 *                 same distances
+	 *     cascade   - lower bounds tried before DTW, in order, as a cell
+	 *                 array of strings (default: {'kim', 'keogh',
+	 *                 'keogh2'}). The bounds are 'kim' (LB_Kim), 'keogh'
+	 *                 (LB_Keogh with the envelope of the test instance),
+	 *                 'keogh2' (LB_Keogh with the envelope of the
+	 *                 training series), 'improved' (LB_Improved),
+	 *                 'enhanced' (LB_Enhanced), and 'webb' (LB_Webb).
+	 *                 The last three are tighter but cost more than
+	 *                 LB_Keogh, so they pay off with wide windows
+	 *     bands     - number of bands at each end of the series used by
+	 *                 LB_Enhanced (default: 5)
+	 *     native    - if true, STACK and NEEDLE are in the layout of
+	 *                 TimeBox, with one series per row and the classes in
+	 *                 the first column, which are skipped (default:
+	 *                 false)
          *
          *  And the output arguments are:
          *
          *     bestidx   - the index of the nearest neighbor within the data set
          *     distance  - the distance from the test instance to the neighbors
-	 *     pruned    - the number of DTW calculations pruned by LB_Kim,
-	 *                 LB_Keogh, and LB_Keogh2
+	 *     pruned    - the number of DTW calculations pruned by the lower
+	 *                 bounds
+	 *     stats     - a struct with detailed counters of the search, with
+	 *                 one row per test instance in each field:
+	 *                   kim, keogh, keogh2, improved, enhanced, webb -
+	 *                     candidates pruned by each stage of the cascade
+	 *                   schedule - candidates never visited because
+	 *                     their scheduling bound reached the best-so-far
+	 *                   abandoned, completed - DTW calls that reached the
+	 *                     best-so-far, abandoned early or not, and DTW
+	 *                     calls that returned a smaller distance
+	 *                   cells - cells of the cost matrix calculated; the
+	 *                     cells skipped by pruning are not counted
+	 *                   time - struct with the nanoseconds spent in each
+	 *                     lower bound, in the 'schedule' step, and in
+	 *                     'dtw'. With several threads, these are the sum
+	 *                     of the times of all threads
+	 *                 The counters are compiled out of the search unless
+	 *                 this output is requested
+	 *
+	 *  With k > 1, BESTIDX and DISTANCE are rows of k elements, from the
+	 *  nearest to the k-th nearest neighbor. If there are fewer than k
+	 *  training series to search, the remaining indices are 0 and the
+	 *  remaining distances are 1e20.
+	 *
+	 *  If the stack and the needle are SINGLE, the series and the envelopes
+	 *  of the training series are kept in single precision, which halves
+	 *  the memory read for every candidate. The lower bounds and DTW are
+	 *  calculated in double precision all the same, so the results are
+	 *  exactly those of the double precision search on the same data.
+	 *
+	 *  With 'windows' as first argument, the MEX runs a leave-one-out
+	 *  1-NN search of every series of the stack for every window from 0 to
+	 *  MAXR in a single pass. NEIGHBORS and DISTANCES have one row per
+	 *  series and one column per window, starting from window 0, and are
+	 *  the same obtained by searching with each window apart. MAXR may be
+	 *  larger than the series; the columns from window len-1 onwards are
+	 *  all unconstrained DTW. Only the "threads", "simd" and "native"
+	 *  options are used.
+	 *
+	 *  In batch mode, each output has one row per test instance. The
+	 *  envelopes of the training series and the scratch buffers are
+	 *  computed only once for all test instances, so this is much faster
+	 *  than calling the MEX once per instance.
          *
          *  *Notice: TimeBox data sets contains instances in rows and
 	 *  observations in columns. However, this MEX requires the instances
 	 *  in the columns and the observations in the rows. Furthermore, this
-	 *  MEX requires ONLY the observations.
+	 *  MEX requires ONLY the observations. With the "native" option, the
+	 *  data sets are read as TimeBox stores them instead, so they need not
+	 *  be transposed nor sliced: the training series are read in place,
+	 *  and each candidate that passes LB_Kim is gathered into a buffer of
+	 *  its thread.
          *  
          *  Usage example:
          *
          *     [train, test] = ts.load('Sample dataset');
-         *     [bestidx, distance, pruned] = mexFunction(stack(:, 2:end)', ...
-	 *     					test(1,:), 10, -1)
+         *     [bestidx, distance, pruned] = mexFunction(train(:, 2:end)', ...
+	 *     					test(1, 2:end), -1, 10)
+	 *     [bestidx, distance, pruned] = mexFunction(train(:, 2:end)', ...
+	 *     					test(:, 2:end)', -1, 10)
+	 *     [bestidx, distance, pruned] = mexFunction(train, test, -1, ...
+	 *     					10, struct('native', true))
 	 *
 	 *  *Notice: contrary to MODELS.NN and MODELS.NN1EUCLIDEAN, this MEX
 	 *  returns ONLY one instance as best index, even if there are multiple
@@ -567,52 +2272,91 @@ void mexFunction(int nleft, mxArray *left[], int nright, const mxArray *right[])
 	 *  will not calculate the distance to all instances, therefore it is
 	 *  not able to detect all equally distant neighbors.
 	 */
-	int neighbor;
-	double distance;
-	int pruned = 0;
-
-	double *stack;
-	double *needle;
+	bool single, native;
+	double *skipindices;
+	double *neighbor_out, *distance_out, *pruned_out;
+	searchstats *stats_out;
 	int numseries, len;
-	int skipindex;
+	int numqueries;
+	int numskip;
 	int r;
+	searchoptions opt;
+	const mxArray *options;
 
 	start_debugger();
 
-	if (nright != 4) {
-		mexErrMsgTxt("Four inputs expected\n");
+	if (nright >= 1 && mxIsChar(right[0])) {
+		char mode[16];
+		if (mxGetString(right[0], mode, sizeof mode) ||
+				strcmp(mode, "windows")) {
+			mexErrMsgTxt("The only mode supported is 'windows'");
+		}
+		windowsmode(nleft, left, nright, right);
+		end_debugger();
+		return;
+	}
+
+	if (nright != 4 && nright != 5) {
+		mexErrMsgTxt("Four or five inputs expected\n");
 	}
 
+	/* Fifth argument is an optional struct of options. It is read first
+	 * because it tells the layout of the data sets
+	 */
+	options = nright >= 5 ? right[4] : NULL;
+	if (options && (!mxIsStruct(options) ||
+				mxGetNumberOfElements(options) != 1)) {
+		mexErrMsgTxt("Fifth input argument (OPTIONS) must be a scalar "
+				"struct");
+	}
+	native = getoption(options, "native", 0) != 0;
+
 	/* First argument is the training data set: it must be a non-complex
-	 * matrix of double
+	 * matrix of double or single
 	 */
-	len = mxGetM(right[0]);
-	numseries = mxGetN(right[0]);
+	len = native ? (int)mxGetN(right[0]) - 1 : (int)mxGetM(right[0]);
+	numseries = native ? mxGetM(right[0]) : mxGetN(right[0]);
 	debug("STACK: mxIsDouble(): %d, mxIsComplex(): %d, mxGetM(): %d, "
 			"mxGetN(): %d\n", mxIsDouble(right[0]),
 			mxIsComplex(right[0]), mxGetM(right[0]),
 			mxGetN(right[0]));
-	if (!mxIsDouble(right[0]) || mxIsComplex(right[0]) || len < 1) {
+	single = mxIsSingle(right[0]);
+	if (!(mxIsDouble(right[0]) || single) || mxIsComplex(right[0]) ||
+			len < 1) {
 		mexErrMsgTxt("First input argument (STACK) must be a "
-				"non-complex matrix of DOUBLE");
+				"non-complex matrix of DOUBLE or SINGLE");
 	}
-	stack = mxGetPr(right[0]);
 
-	/* Second argument is the needle: it must be a non-complex row vector
-	 * with appropriate number of elements
+	/* Second argument is the needle: it must be a non-complex vector with
+	 * appropriate number of elements, or a matrix with one test instance
+	 * per column, of the same class as the stack
 	 */
 	debug("NEEDLE: mxIsDouble(): %d, mxIsComplex(): %d, mxGetM(): %d, "
 			"mxGetN(): %d\n", mxIsDouble(right[1]),
 			mxIsComplex(right[1]), mxGetM(right[1]),
 			mxGetN(right[1]));
-	if (!mxIsDouble(right[1]) || mxIsComplex(right[1]) ||
-			(int)mxGetNumberOfElements(right[1]) != len) {
+	if (native) {
+		numqueries = (int)mxGetN(right[1]) == len + 1 ?
+			mxGetM(right[1]) : 0;
+	}
+	else if ((int)mxGetNumberOfElements(right[1]) == len) {
+		numqueries = 1;
+	}
+	else if ((int)mxGetM(right[1]) == len) {
+		numqueries = mxGetN(right[1]);
+	}
+	else {
+		numqueries = 0;
+	}
+	if (mxGetClassID(right[1]) != mxGetClassID(right[0]) ||
+			mxIsComplex(right[1]) || numqueries < 1) {
 		mexErrMsgTxt("Second input argument (NEEDLE) must be a "
-				"non-complex vector of DOUBLE with as many "
-				"elements as the number of observations in "
-				"the STACK");
+				"non-complex vector of the same class as the "
+				"STACK with as many elements as the number of "
+				"observations in the STACK, or a matrix with as "
+				"many rows as the STACK (as many columns, with "
+				"\"native\")");
 	}
-	needle = mxGetPr(right[1]);
 
 	/* Third argument is the skipindex controller
 	*/
@@ -620,13 +2364,15 @@ void mexFunction(int nleft, mxArray *left[], int nright, const mxArray *right[])
 			"mxGetN(): %d\n", mxIsDouble(right[2]),
 			mxIsComplex(right[2]), mxGetM(right[2]),
 			mxGetN(right[2]));
+	numskip = mxGetNumberOfElements(right[2]);
 	if (!mxIsDouble(right[2]) || mxIsComplex(right[2]) ||
-			mxGetNumberOfElements(right[2]) != 1) {
+			(numskip != 1 && numskip != numqueries)) {
 		mexErrMsgTxt("Third input argument (SKIPINDEX) must be a "
 				"non-complex DOUBLE scalar (integer value "
-				"expected)");
+				"expected) or a vector with one element per "
+				"test instance");
 	}
-	skipindex = mxGetScalar(right[2]);
+	skipindices = mxGetPr(right[2]);
 
 	/* Fourth argument is the Sakoe-Chiba window size
 	*/
@@ -634,41 +2380,72 @@ void mexFunction(int nleft, mxArray *left[], int nright, const mxArray *right[])
 			"mxGetN(): %d\n", mxIsDouble(right[3]),
 			mxIsComplex(right[3]), mxGetM(right[3]),
 			mxGetN(right[3]));
-	if (!mxIsDouble(right[3]) || mxIsComplex(right[3]) ||
-			mxGetNumberOfElements(right[3]) != 1 ||
-			(r = mxGetScalar(right[3])) < 0) {
+	if ((r = getwindow(right[3], len)) < 0) {
 		mexErrMsgTxt("Fourth input argument (r) must be a non-complex, "
 				"non-negative DOUBLE scalar (integer value "
 				"expected)");
 	}
 
+	opt.numthreads = getoption(options, "threads", 1);
+	if (opt.numthreads == 0) {
+		opt.numthreads = std::thread::hardware_concurrency();
+	}
+	opt.numthreads = max(1, min(opt.numthreads, numseries));
+	opt.schedule = getschedule(options);
+	opt.k = getoption(options, "k", 1);
+	opt.simd = getsimd(options);
+	if (opt.k < 1 || opt.k > numseries) {
+		mexErrMsgTxt("Field \"k\" of OPTIONS must be a positive integer "
+				"no larger than the number of series in the STACK");
+	}
+	getcascade(options, &opt);
+	opt.bands = getoption(options, "bands", 5);
+
 	debug("Got dataset with %d series of length %d\n", numseries, len);
+	debug("Got %d test instance(s)\n", numqueries);
 	debug("Running 1-NNDTW with Sakoe-Chiba window of width %d\n", r);
-	debug("Calling ucrsuite_main()\n");
-	ucrsuite_main(neighbor, distance, pruned, stack, needle, numseries,
-			skipindex, len, r);
-	debug("Returned from ucrsuite_main()\n");
+	debug("Running on %d thread(s)\n", opt.numthreads);
+	debug("Searching for %d nearest neighbor(s)\n", opt.k);
 
-	/* First output is the index of the nearest neighbor
-	*/
-	if (nleft >= 1) {
-		debug("Creating first output\n");
-		left[0] = mxCreateDoubleScalar(neighbor);
+	/* Outputs have one row per test instance and one column per neighbor
+	 */
+	left[0] = mxCreateDoubleMatrix(numqueries, opt.k, mxREAL);
+	neighbor_out = mxGetPr(left[0]);
+	distance_out = NULL;
+	pruned_out = NULL;
+	if (nleft >= 2) {
+		left[1] = mxCreateDoubleMatrix(numqueries, opt.k, mxREAL);
+		distance_out = mxGetPr(left[1]);
+	}
+	if (nleft >= 3) {
+		left[2] = mxCreateDoubleMatrix(numqueries, 1, mxREAL);
+		pruned_out = mxGetPr(left[2]);
+	}
+	stats_out = NULL;
+	if (nleft >= 4) {
+		mkarray(stats_out, numqueries, searchstats);
 	}
 
-	/* Second output is the distance to the nearest neighbor
-	*/
-	if (nleft >= 2) {
-		debug("Creating second output\n");
-		left[1] = mxCreateDoubleScalar(distance);
+	if (single) {
+		nn1dtw(makedataset<float>(right[0], len, native),
+				makedataset<float>(right[1], len, native),
+				skipindices, numskip,
+				numseries, len, numqueries, r, &opt,
+				neighbor_out, distance_out, pruned_out,
+				stats_out);
+	}
+	else {
+		nn1dtw(makedataset<double>(right[0], len, native),
+				makedataset<double>(right[1], len, native),
+				skipindices, numskip,
+				numseries, len, numqueries, r, &opt,
+				neighbor_out, distance_out, pruned_out,
+				stats_out);
 	}
 
-	/* Third output is the number of instances pruned by lower-bounding and
-	 * early abandoning strategies
-	 */
-	if (nleft >= 3) {
-		debug("Creating third output\n");
-		left[2] = mxCreateDoubleScalar(pruned);
+	if (stats_out) {
+		left[3] = statsstruct(stats_out, numqueries);
+		mxFree(stats_out);
 	}
 
 	debug("Ending the debugger\n");
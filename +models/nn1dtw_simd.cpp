@@ -0,0 +1,249 @@
+/* This file contains the vectorized LB_Keogh and DTW kernels used by
+ * nn1dtw_mex.cpp. This is intended to be #included by that file once per
+ * instruction set, with the following macros defined:
+ *
+ *     SIMD_SUFFIX   suffix of the kernel names (e.g., avx2)
+ *     SIMD_WIDTH    number of doubles in a vector register
+ *
+ * The including file is responsible for enabling the instruction set, for
+ * instance with "#pragma GCC target".
+ *
+ * The kernels use GCC vector extensions, so the same source compiles to
+ * SSE, AVX2 or AVX-512 instructions. They return exactly the same values as
+ * the scalar kernels in nn1dtw_mex.cpp:
+ *
+ *   - LB_Keogh computes each term as max(x-u,0)^2 + max(l-x,0)^2, which is
+ *     bit for bit the scalar term because one of the two squares is always
+ *     zero. The terms are computed one vector at a time but summed in the
+ *     same order as the scalar code, so the lower bound is identical. The
+ *     bound is compared to the best-so-far once per vector, which may write
+ *     a few more terms into "cb" before abandoning; those candidates are
+ *     pruned anyway.
+ *
+ *   - DTW splits each cell into min(min(up, diag), left) + d. The first
+ *     term and "d" of the cells below the live cells of the previous row
+ *     are computed with vectors; only the dependency on the left neighbor,
+ *     and the pruning, remain serial. Since "min" is exact, every cell has
+ *     the same value as in the scalar code. Boundaries are handled by INF
+ *     sentinels instead of branches.
+ *
+ * The kernels are templates on the type of the observations of the
+ * training series. Observations are converted to double as they are read,
+ * so single precision series only reduce the memory traffic.
+ *
+ * The cumulative sums of the lower bound (cb) are computed by the scalar
+ * code: vectorizing a prefix sum changes the order of the additions, hence
+ * the rounding, and the early abandoning of DTW would no longer match.
+ */
+
+/* This file is part of TimeBox. Copyright 2016 Rafael Giusti
+ * Revision 0.4.1
+ */
+
+#define SIMD_CAT2(_a, _b) _a ## _b
+#define SIMD_CAT(_a, _b) SIMD_CAT2(_a, _b)
+#define SIMD_NAME(_name) SIMD_CAT(_name, SIMD_SUFFIX)
+
+typedef double SIMD_NAME(vec_) __attribute__ ((vector_size (SIMD_WIDTH * sizeof (double))));
+#define vec SIMD_NAME(vec_)
+
+/// LB_Keogh of the data against the envelope of the query (see
+/// lb_keogh_cumulative)
+template <typename T>
+double SIMD_NAME(lb_keogh_cumulative_)(int* order, T *t, double *uo,
+		double *lo, double *cb, int len, double best_so_far)
+{
+	double lb = 0;
+	int i = 0;
+	vec x = { 0 }, u, l, du, dl, d;
+	vec zero = { 0 };
+
+	for (; i + SIMD_WIDTH <= len && lb < best_so_far; i += SIMD_WIDTH) {
+		for (int v = 0; v < SIMD_WIDTH; v++)
+			x[v] = t[order[i + v]];
+		memcpy(&u, uo + i, sizeof u);
+		memcpy(&l, lo + i, sizeof l);
+		du = x - u;
+		dl = l - x;
+		du = du > zero ? du : zero;
+		dl = dl > zero ? dl : zero;
+		d = du * du + dl * dl;
+		for (int v = 0; v < SIMD_WIDTH; v++) {
+			lb += d[v];
+			cb[order[i + v]] = d[v];
+		}
+	}
+	for (; i < len && lb < best_so_far; i++) {
+		double xx = t[order[i]];
+		double dd = 0;
+		if (xx > uo[i])
+			dd = dist(xx, uo[i]);
+		else if (xx < lo[i])
+			dd = dist(xx, lo[i]);
+		lb += dd;
+		cb[order[i]] = dd;
+	}
+	return lb;
+}
+
+/// LB_Keogh of the query against the envelope of the data (see
+/// lb_keogh_data_cumulative)
+template <typename T>
+double SIMD_NAME(lb_keogh_data_cumulative_)(int* order, T *tz,
+		double *qo, double *cb, T *l, T *u, int len,
+		double best_so_far)
+{
+	double lb = 0;
+	int i = 0;
+	vec x, uu = { 0 }, ll = { 0 }, du, dl, d;
+	vec zero = { 0 };
+
+	for (; i + SIMD_WIDTH <= len && lb < best_so_far; i += SIMD_WIDTH) {
+		for (int v = 0; v < SIMD_WIDTH; v++) {
+			uu[v] = u[order[i + v]];
+			ll[v] = l[order[i + v]];
+		}
+		memcpy(&x, qo + i, sizeof x);
+		du = x - uu;
+		dl = ll - x;
+		du = du > zero ? du : zero;
+		dl = dl > zero ? dl : zero;
+		d = du * du + dl * dl;
+		for (int v = 0; v < SIMD_WIDTH; v++) {
+			lb += d[v];
+			cb[order[i + v]] = d[v];
+		}
+	}
+	for (; i < len && lb < best_so_far; i++) {
+		double dd = 0;
+		if (qo[i] > u[order[i]])
+			dd = dist(qo[i], u[order[i]]);
+		else if (qo[i] < l[order[i]])
+			dd = dist(qo[i], l[order[i]]);
+		lb += dd;
+		cb[order[i]] = dd;
+	}
+	return lb;
+}
+
+/// Dynamic Time Warping with early abandoning and pruning (see dtw). The
+/// cost rows in "s" have one INF sentinel before and after the 2*r+1 cells
+/// of the band. The number of cells evaluated is left in s->cells.
+template <typename T>
+double SIMD_NAME(dtw_)(T *A, double *B, double *cb, int m, int r,
+		scratch *s, double bsf)
+{
+	double *cost = s->cost;
+	double *cost_prev = s->cost_prev;
+	double *cost_tmp;
+	double *diag = s->diag, *d = s->d;
+	double y, rest;
+	double bound = INF;       /// smallest cost plus bound of a pruned cell
+	int i, k, kstart, kend, klast;
+	int start = 0, end = -1;  /// live columns of the previous row
+	int live_start, live_end;
+	double evaluated = 0;
+	vec a, b, up, left, cells;
+	vec zero = { 0 };
+
+	for (k = -1; k <= 2 * r + 1; k++) {
+		cost[k] = INF;
+		cost_prev[k] = INF;
+	}
+
+	for (i = 0; i < m; i++) {
+		/// The band of row i covers columns j = i-r+k, for k in
+		/// kstart..kend, but only kstart..klast are below the live cells
+		/// of the previous row
+		kstart = max(start - i + r, r - i);
+		kstart = max(kstart, 0);
+		kend = r + min(m - 1 - i, r);
+		klast = min(kend, end + 1 - i + r);
+		double *Bk = B + i - r;
+		rest = i + r < m - 1 ? cb[i + r + 1] : 0;
+
+		/// Vertical and diagonal predecessors, and the distance of each cell
+		a = zero + (double)A[i];
+		for (k = kstart; k + SIMD_WIDTH <= klast + 1; k += SIMD_WIDTH) {
+			memcpy(&up, cost_prev + k + 1, sizeof up);
+			memcpy(&left, cost_prev + k, sizeof left);
+			memcpy(&b, Bk + k, sizeof b);
+			cells = up < left ? up : left;
+			memcpy(diag + k, &cells, sizeof cells);
+			b = a - b;
+			b = b * b;
+			memcpy(d + k, &b, sizeof b);
+		}
+		for (; k <= klast; k++) {
+			diag[k] = min(cost_prev[k + 1], cost_prev[k]);
+			d[k] = dist(A[i], Bk[k]);
+		}
+
+		/// Horizontal dependency: the first cell has no left neighbor,
+		/// except for the very first cell of the matrix. Cells that
+		/// cannot lead to a path cheaper than bsf are pruned to INF
+		live_start = -1;
+		live_end = -1;
+		k = kstart;
+		y = INF;
+		if (i == 0) {
+			cost[k] = dist(A[0], B[0]);
+			y = cost[k];
+			if (y + rest < bsf)
+				live_start = live_end = k++;
+			else {
+				bound = y + rest;
+				cost[k++] = y = INF;
+			}
+		}
+		for (; k <= klast; k++) {
+			y = min(diag[k], y) + d[k];
+			if (y + rest < bsf) {
+				if (live_start < 0)
+					live_start = k;
+				live_end = k;
+			}
+			else {
+				bound = min(bound, y + rest);
+				y = INF;
+			}
+			cost[k] = y;
+		}
+
+		/// Past them, a cell can only be reached from the left
+		for (; k <= kend && y < INF; k++) {
+			y += dist(A[i], Bk[k]);
+			if (y + rest < bsf)
+				live_end = k;
+			else {
+				bound = min(bound, y + rest);
+				y = INF;
+			}
+			cost[k] = y;
+		}
+
+		evaluated += k - kstart;
+
+		/// Abandon when no cell is live
+		if (live_start < 0) {
+			s->cells = evaluated;
+			return bound;
+		}
+		cost[live_start - 1] = INF;
+		cost[live_end + 1] = INF;
+		start = live_start + i - r;
+		end = live_end + i - r;
+
+		cost_tmp = cost;
+		cost = cost_prev;
+		cost_prev = cost_tmp;
+	}
+
+	s->cells = evaluated;
+	return end == m - 1 ? cost_prev[r] : bound;
+}
+
+#undef vec
+#undef SIMD_NAME
+#undef SIMD_CAT
+#undef SIMD_CAT2
@@ -25,9 +25,15 @@ function [neighbor, distance, label, hit] = nn1euclidean(stack, needle, options)
 %   Options:
 %       nn::tie break       (default: 'first')
 %       epsilon             (default: 1e-10)
+%       nn::precision       (default: 'double')
+%
+%   Setting "nn::precision" to 'single' runs the search on a single
+%   precision copy of the data. Squared differences are accumulated in
+%   double, so the nearest neighbor is usually the same, but the distance
+%   may differ slightly from the one found in double precision.
 
 %   This file is part of TimeBox. Copyright 2015-16 Rafael Giusti
-%   Revision 1.0
+%   Revision 1.2.0
 if exist('options', 'var')
     tb.assert(opts.isa(options), 'Third argument must be non-existent or an OPTS object');
 else
@@ -36,6 +42,8 @@ end
 
 tiebreak = opts.get(options, 'nn::tie break', 'first');
 epsilon = opts.get(options, 'epsilon', 1e-10);
+precision = opts.get(options, 'nn::precision', 'double');
+tb.assert(any(strcmp(precision, {'double', 'single'})), 'Option "nn::precision" must be either ''double'' or ''single''');
 
 if numel(needle) == 1
     skipindex = needle;
@@ -44,7 +52,7 @@ else
     skipindex = -1;
 end
 
-[bestidx, distance] = models.nn1euclidean_mex(stack', needle, skipindex, epsilon);
+[bestidx, distance] = models.nn1euclidean_mex(cast(stack, precision), cast(needle, precision), skipindex, epsilon, true);
 
 % If we got more than one nearest neighbor, we need to decide on one of
 % them, depending on the tie break strategy. Unless we are set to not
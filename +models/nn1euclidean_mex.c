@@ -2,19 +2,19 @@
  */
 
 /* This file is part of TimeBox. Copyright 2015-16 Rafael Giusti
- * Revision 1.0
+ * Revision 1.3.1
  */
 
 #include "mex.h"
 
 #include <math.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #define DEBUG 0
 
 #if DEBUG
-#include <stdio.h>
 #define DEBUG_PATH "/tmp/timebox-nn1_mex-debug.txt"
 FILE *__debug_file = NULL;
 #define debug(...) do { \
@@ -54,77 +54,21 @@ FILE *__debug_file = NULL;
 #define FLT_GT(_flt1, _flt2, _eps) \
 	(fabs((_flt1) - (_flt2)) > (_eps) && (_flt1) > (_flt2))
 
-double euclidean2(double *s1, double *s2, int len, double bsf, double epsilon)
-{
-	/* Return the squared Euclidean distance between two series
-	 */
-	double dist = 0;
-	while (--len) {
-		dist += (*s1 - *s2) * (*s1 - *s2);
-		s1++;
-		s2++;
-		/* Early abandon
-		 */
-		if (FLT_GT(dist, bsf, epsilon)) {
-			return dist;
-		}
-	}
-	return dist;
-}
-
-int nn1euclidean(double *stack, double *needle, int nseries, int len,
-		int skipindex, double epsilon, double *bestidx,
-		double *distance)
-{
-	double *test;
-	double bsf = INFINITY;
-	double dist;
-	int current;
-	int neighbors = 0;
-
- 	debug("Called nn1euclidean(PTR, PTR, %d, %d, %d, %e, PTR, PTR)\n", 
-			nseries, len, skipindex, epsilon); 
-
-	/* Skip the needle class and point the test pointer to the first
-	 * instance
-	 */
-	needle++;
-	test = stack + 1;
-
-	/* Calculate the squared distance from the needle to all series
-	 */
-	current = 1;
-	while (current <= nseries) {
-		/* Allow in-loco classification
-		 */
-		if (current == skipindex) {
-			current++;
-			seekstack(test, stack, current, len);
-			continue;
-		}
-		
-		dist = euclidean2(test, needle, len, bsf, epsilon);
-		if (FLT_GT(bsf, dist, epsilon)) {
-			/* Distance to nearest neighbor got smaller
-			*/
-			bsf = dist;
-			bestidx[0] = current;
-			neighbors = 1;
-		}
-		else if (!FLT_GT(dist, bsf, epsilon)) {
-			/* Another instance just as far from the previous
-			 * neighbors
-			 */
-			bestidx[neighbors++] = current;
-		}
-		
-		current++;
-		seekstack(test, stack, current, len);
-	}
+/* The squared Euclidean distance and the search are shared with
+ * nn1fast_mex.c. They are compiled once for series of double and once for
+ * series of single
+ */
+#define real double
+#define PRECISION(_name) _name
+#include "nn1fast_distances.c"
+#undef real
+#undef PRECISION
 
-	*distance = sqrt(bsf);
-	return neighbors;
-}
+#define real float
+#define PRECISION(_name) _name ## _single
+#include "nn1fast_distances.c"
+#undef real
+#undef PRECISION
 
 void mexFunction(int nleft, mxArray *left[], int nright, const mxArray *right[])
 {
@@ -132,16 +76,18 @@ void mexFunction(int nleft, mxArray *left[], int nright, const mxArray *right[])
 	 *  Usage:
 	 *
 	 *     [bestidx, distance] = mexFunction(stack, needle, ...
-	 *                                       skipindex, epsilon);
+	 *                                       skipindex, epsilon[, native]);
 	 *
 	 *  Where the input arguments are:
 	 *
-	 *     stack     - the data set*
-	 *     needle    - the test instance
+	 *     stack     - the data set* (DOUBLE or SINGLE)
+	 *     needle    - the test instance, of the same class as the stack
 	 *     skipindex - if the test instance is contained in the data set,
 	 *                 skipindex must be the instance of the test instance;
 	 *                 otherwise it should be -1
 	 *     epsilon   - tolerance threshold for float operations
+	 *     native    - optional logical scalar: if true, the stack is in the
+	 *                 layout of TimeBox (default: false)
 	 *
 	 *  And the output arguments are:
 	 *
@@ -160,10 +106,23 @@ void mexFunction(int nleft, mxArray *left[], int nright, const mxArray *right[])
 	 *
 	 *  The data set is transformed into the expected notation with stack'.
 	 *  The test instance should be kept a row vector.
+	 *
+	 *  With NATIVE, the transposition is not needed: the stack is read with
+	 *  the instances in the rows, as TimeBox stores it, and its series are
+	 *  copied into a small buffer a block at a time during the search:
+	 *
+	 *     [bestidx, distance] = mexFunction(stack, test(1,:), -1, ...
+	 *                                       1e-10, true)
+	 *
+	 *  If the stack and the needle are SINGLE, the observations are read
+	 *  in single precision, which halves the memory read for every
+	 *  candidate, but distances are still summed in double precision.
 	 */
 
 	int nseries, len;
-	double *stack, *needle;
+	void *stack, *needle;
+	int single;
+	int native;
 	int skipindex;
 	double epsilon;
 	double *bestidx_large, *bestidx, distance;
@@ -173,42 +132,60 @@ void mexFunction(int nleft, mxArray *left[], int nright, const mxArray *right[])
 	debug("Started mexFunction\n\n");
 	debug("Verifying input/output arguments\n");
 
-	if (nright != 4) {
-		debug("Got %d inputs (expected 4)\n", nright);
-		mexErrMsgTxt("Four inputs required.");
+	if (nright != 4 && nright != 5) {
+		debug("Got %d inputs (expected 4 or 5)\n", nright);
+		mexErrMsgTxt("Four or five inputs required.");
+	}
+
+	/* Fifth argument, if present, tells the layout of the stack
+	 */
+	native = 0;
+	if (nright == 5) {
+		if (!(mxIsDouble(right[4]) || mxIsLogical(right[4])) ||
+				mxGetNumberOfElements(right[4]) != 1) {
+			mexErrMsgTxt("Fifth input (NATIVE) must be a logical "
+					"scalar");
+		}
+		native = mxGetScalar(right[4]) != 0;
 	}
 	if (nleft != 2) {
 		debug("Got %d outputs (expected 2)\n", nleft);
 		mexErrMsgTxt("Two outputs required.");
 	}
 
-	/* First argument must be a non-complex matrix of double
+	/* First argument must be a non-complex matrix of double or single
 	*/
-	nseries = mxGetN(right[0]);
-	len = mxGetM(right[0]);
-	if (!mxIsDouble(right[0]) || mxIsComplex(right[0]) || len <= 1) {
-		debug("First input error\nmxIsDouble: %d, mxIsComplex: %d, "
-				"len: %d\n", mxIsDouble(right[0]),
+	nseries = native ? mxGetM(right[0]) : mxGetN(right[0]);
+	len = native ? mxGetN(right[0]) : mxGetM(right[0]);
+	single = mxIsSingle(right[0]);
+	if (!(mxIsDouble(right[0]) || single) || mxIsComplex(right[0]) ||
+			len <= 1) {
+		debug("First input error\nmxIsDouble: %d, mxIsSingle: %d, "
+				"mxIsComplex: %d, len: %d\n",
+				mxIsDouble(right[0]), single,
 				mxIsComplex(right[0]), len);
 		mexErrMsgTxt("First input (STACK) must be a non-complex "
-				"matrix of double");
+				"matrix of double or single");
 	}
-	stack = mxGetPr(right[0]);
+	stack = mxGetData(right[0]);
 	debug("Stack: %d series of lenght %d\n", nseries, len);
 
-	/* Second argument must be a non-complex row array of double
+	/* Second argument must be a non-complex row array of the same class
+	 * as the first
 	*/
 	if (mxGetM(right[1]) != 1 || mxGetN(right[1]) != len ||
-			!mxIsDouble(right[1]) || mxIsComplex(right[1])) {
-		debug("Second input error\nmxIsDouble: %d, mxIsComplex: %d, "
-				"mxGetM: %zu, mxGetN: %zu\n",
-				mxIsDouble(right[1]), mxIsComplex(right[1]),
-				mxGetM(right[1]), mxGetN(right[1]));
+			mxGetClassID(right[1]) != mxGetClassID(right[0]) ||
+			mxIsComplex(right[1])) {
+		debug("Second input error\nmxIsDouble: %d, mxIsSingle: %d, "
+				"mxIsComplex: %d, mxGetM: %zu, mxGetN: %zu\n",
+				mxIsDouble(right[1]), mxIsSingle(right[1]),
+				mxIsComplex(right[1]), mxGetM(right[1]),
+				mxGetN(right[1]));
 		mexErrMsgTxt("Second input (NEEDLE) must be a non-complex "
-				"row array of double with same number of "
-				"elements as the first input");
+				"row array of the same class as the first input "
+				"and with same number of elements");
 	}
-	needle = mxGetPr(right[1]);
+	needle = mxGetData(right[1]);
 	debug("Needle: ok\n"); 
 
 	/* Third argument must be a scalar
@@ -250,8 +227,21 @@ void mexFunction(int nleft, mxArray *left[], int nright, const mxArray *right[])
 	debug("Input ok\n\n");	
 	debug("Running 1-NN with euclidean distance\n");
 
-	numneighbors = nn1euclidean(stack, needle, nseries, len, skipindex,
-			epsilon, bestidx_large, &distance);
+	if (single) {
+		numneighbors = nn1fast_euclidean2_single(stack, needle,
+				nseries, len, native, skipindex, epsilon,
+				bestidx_large, &distance);
+	}
+	else {
+		numneighbors = nn1fast_euclidean2(stack, needle, nseries, len,
+				native, skipindex, epsilon, bestidx_large,
+				&distance);
+	}
+	if (numneighbors < 0) {
+		free(bestidx_large);
+		mexErrMsgTxt("Error allocating memory\n");
+	}
+	distance = sqrt(distance);
 
 	/* Make the first argument the distances from the needle to all series
 	*/
@@ -36,12 +36,75 @@ function [neighbor, distance, label, hit] = nn1fast(stack, needle, options_or_di
 %       nn::tie break       (default: 'first')
 %       epsilon             (default: 1e-10)
 %       nn::distance        (default: 'euclidean')
+%       nn::precision       (default: 'double')
+%       nn::simd            (default: 'auto')
+%       nn::stats           (default: [])
 %
-%   The currently accepted distance names are: Euclidean, Manhattan, and
-%   Chebyshev.
+%   The accepted distance names are those of the functions of DISTS that
+%   compare two series observation by observation: 'euclidean',
+%   'manhattan', 'chebyshev', 'minkowski', 'squared_euclidean',
+%   'avg_l1_linf', 'canberra', 'lorentzian', 'sorensen', 'soergel',
+%   'kulczynski', 'cosine', 'jaccard', 'dice', 'pearson', 'squared_chi',
+%   'neyman', 'prob_symmetric_chi', 'divergence', 'clark',
+%   'additive_symm_chi', 'max_symmetric_chi', 'min_symmetric_chi',
+%   'kullback', 'jeffrey', 'k_divergence', 'topsoe', 'jensen_shannon',
+%   'jansen_shannon', 'jensen_difference', 'taneja', 'kumar_johnson',
+%   'bhattacharyya', 'hellinger', 'matusita', 'square_chord',
+%   'intersection', 'wavehedges', 'czekanowski', 'motyka', 'tanimoto',
+%   'vicis_wave_hedges', 'emanon2', and 'emanon3'. Each returns what its
+%   function in DISTS returns, up to rounding. 'kulczynski',
+%   'max_symmetric_chi', 'min_symmetric_chi', and 'tanimoto' return the
+%   distances of Cha's survey, which sum both the numerator and the
+%   denominator, where DISTS returns one value per observation.
+%
+%   The exponent of 'minkowski' is taken from "dists::minkowski p", or
+%   else from "dists::arg", as for MODELS.NN (default: 2).
+%
+%   The distances that are sums of non-negative terms are abandoned as
+%   soon as they are farther than the nearest neighbor so far: Euclidean,
+%   Manhattan, Chebyshev, Minkowski, Canberra, Lorentzian, Divergence,
+%   Jensen difference, Taneja, Kumar-Johnson, squared chord,
+%   Intersection, and Emanon 2. The others are always calculated in full,
+%   since they may have negative terms.
+%
+%   The elastic distances 'dtw', 'ddtw' (derivative DTW), 'wdtw' (weighted
+%   DTW), 'erp', 'lcss', 'msm', and 'twe' are also accepted. Their window
+%   and parameters are taken from the options of DISTS.ELASTICPARAMS. They
+%   keep two rows of the window of the cost matrix, abandon a candidate as
+%   soon as a whole row is farther than the nearest neighbor so far, and
+%   try LB_Keogh (DTW, WDTW), the envelope count of Vlachos et al. (LCSS),
+%   or the difference of sums (ERP) first. The DTW is the same as
+%   DISTS.DTW_Cpp, but with no window by default, and LCSS is returned as
+%   1 - LCSS/n, so smaller is nearer.
+%
+%   If "nn::precision" is 'single', the observations are passed to the MEX
+%   in single precision, which halves the memory read to search the data
+%   set. Distances are still summed in double precision, but they may
+%   differ slightly from those found in double precision.
+%
+%   The option "nn::simd" sets the instruction set used to calculate the
+%   distances that are not elastic. With 'auto', the widest of 'avx2' and
+%   'avx512' supported by the processor is used; 'scalar' forces the code
+%   without vector instructions. The vectorized distances sum their terms
+%   in a different order and use an approximation of the logarithm within
+%   1 ulp, so they may differ from the scalar ones in the last few digits,
+%   and distances within epsilon of each other may tie differently. Only
+%   'scalar' reproduces earlier results exactly; see +models/nn1fast_simd.c
+%   for the details. The distances that are not vectorized there are
+%   always calculated by the scalar code.
+%
+%   The option "nn::stats" takes the statistics of DS returned by
+%   MODELS.NN1FASTSTATS for the same distance and precision. Sorensen,
+%   cosine, Jaccard, Dice, Kullback-Leibler, Jeffrey's, Bhattacharyya, and
+%   Hellinger then use the norms, logarithms, or square roots of the
+%   training series computed once, instead of for every test instance, and
+%   the first four are abandoned early as the Euclidean distance. These
+%   searches use no vector instructions, and the distances are computed
+%   from the norms in a different order, so they may differ from those
+%   found without statistics in the last few digits.
 
 %   This file is part of TimeBox. Copyright 2015-17 Rafael Giusti
-%   Revision 0.2.0
+%   Revision 0.8.0
 distname = 'euclidean';
 if exist('options_or_distname', 'var')
     if opts.isa(options_or_distname)
@@ -57,12 +120,16 @@ distname = lower(opts.get(options, 'nn::distance', distname));
 
 switch distname
     % L-norm family
-    case 'euclidean'
+    case {'euclidean', 'abs_euclidean'}
         distcode = 1;
     case 'manhattan'
         distcode = 2;
     case 'chebyshev'
         distcode = 3;
+    case 'minkowski'
+        distcode = 4;
+    case 'squared_euclidean'
+        distcode = 5;
     case 'avg_l1_linf'
         distcode = 9;
         
@@ -73,6 +140,10 @@ switch distname
         distcode = 11;
     case 'sorensen'
         distcode = 12;
+    case 'soergel'
+        distcode = 13;
+    case 'kulczynski'
+        distcode = 14;
         
     % Dot product family
     case 'cosine'
@@ -87,18 +158,86 @@ switch distname
         distcode = 30;
     case 'squared_chi'
         distcode = 31;
+    case 'neyman'
+        distcode = 32;
+    case 'prob_symmetric_chi'
+        distcode = 33;
+    case 'divergence'
+        distcode = 34;
+    case 'clark'
+        distcode = 35;
+    case 'additive_symm_chi'
+        distcode = 36;
+    case 'max_symmetric_chi'
+        distcode = 37;
+    case 'min_symmetric_chi'
+        distcode = 38;
         
     % Kullback-Leibler family
     case 'kullback'
         distcode = 40;
     case 'jeffrey'
         distcode = 41;
+    case 'k_divergence'
+        distcode = 42;
+    case 'topsoe'
+        distcode = 43;
+    case 'jensen_shannon'
+        distcode = 44;
+    case 'jansen_shannon'
+        distcode = 45;
+    case 'jensen_difference'
+        distcode = 46;
+    case 'taneja'
+        distcode = 47;
+    case 'kumar_johnson'
+        distcode = 48;
     
 	% Bhattacharyya coefficient family
     case 'bhattacharyya'
         distcode = 50;
     case 'hellinger'
         distcode = 51;
+    case 'matusita'
+        distcode = 52;
+    case {'square_chord', 'squared_chord'}
+        distcode = 53;
+
+    % Elastic family
+    case 'dtw'
+        distcode = 60;
+    case 'ddtw'
+        distcode = 61;
+    case 'wdtw'
+        distcode = 62;
+    case 'erp'
+        distcode = 63;
+    case 'lcss'
+        distcode = 64;
+    case 'msm'
+        distcode = 65;
+    case 'twe'
+        distcode = 66;
+
+    % Intersection family
+    case 'intersection'
+        distcode = 70;
+    case 'wavehedges'
+        distcode = 71;
+    case 'czekanowski'
+        distcode = 72;
+    case 'motyka'
+        distcode = 73;
+    case 'tanimoto'
+        distcode = 74;
+
+    % Vicis family
+    case 'vicis_wave_hedges'
+        distcode = 80;
+    case 'emanon2'
+        distcode = 81;
+    case 'emanon3'
+        distcode = 82;
     otherwise
         if ~isempty(stack)
             error(['Unsupported distance: ' distname]);
@@ -113,6 +252,8 @@ end
 
 tiebreak = opts.get(options, 'nn::tie break', 'first');
 epsilon = opts.get(options, 'epsilon', 1e-10);
+precision = opts.get(options, 'nn::precision', 'double');
+tb.assert(any(strcmp(precision, {'double', 'single'})), 'Option "nn::precision" must be either ''double'' or ''single''');
 
 if numel(needle) == 1
     skipindex = needle;
@@ -121,7 +262,13 @@ else
     skipindex = -1;
 end
 
-[bestidx, distance] = models.nn1fast_mex(stack', needle, distcode, skipindex, epsilon);
+params = dists.elasticparams(options);
+params.simd = opts.get(options, 'nn::simd', 'auto');
+if distcode == 4 && opts.has(options, 'dists::arg') && ~opts.has(options, 'dists::minkowski p')
+    params.minkowski_p = opts.get(options, 'dists::arg');
+end
+[bestidx, distance] = models.nn1fast_mex(cast(stack, precision), cast(needle, precision), distcode, skipindex, ...
+    epsilon, params, true, opts.get(options, 'nn::stats', []));
 
 % If we got more than one nearest neighbor, we need to decide on one of
 % them, depending on the tie break strategy. Unless we are set to not
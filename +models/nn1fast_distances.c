@@ -1,22 +1,195 @@
 /* This file contains the bodies of the functions that will be used by
  * nn1fast_mex.c. This is intended to be #included by that file. 
+ *
+ * The file is included once for each precision of the input series, with
+ * the following macros defined:
+ *
+ *     real             the type of the observations (double or float)
+ *     PRECISION(name)  the name of a function for that type
+ *
+ * Observations are read as "real", but the distances are always summed in
+ * double precision.
+ *
+ * The elastic distances are in nn1fast_elastic.c, which is included here.
+ * They take the rows of their cost matrix from the caller, so they are
+ * chosen by selectelastic() instead of selectdistance().
+ *
+ * Each distance function is also compiled into its own copy of the search,
+ * nn1fast_<name>(), in which it is called directly rather than through a
+ * pointer; the distances of this file are inlined into the loop over the
+ * stack. selectsearch() returns the copy for a distance code.
+ *
+ * On x86 processors with GCC, the distances of this file are also compiled
+ * for AVX2 and AVX-512 from nn1fast_simd.c, which describes how their
+ * results differ from those of the scalar code. selectsearch() then picks
+ * the widest instruction set of the processor, unless told otherwise. A
+ * file that includes this one only for the distances, and never calls
+ * selectsearch() with an instruction set, may define NN1_NOSIMD to leave
+ * these copies out.
+ *
+ * The distances that need the norm, or the logarithm or the square root
+ * of every observation, of both series have a second version that reads
+ * them from statistics computed once per series by seriesstats(); see
+ * "Distances with statistics" below.
  */
 
 /* This file is part of TimeBox. Copyright 2015-17 Rafael Giusti
- * Revision 0.1.0
+ * Revision 0.9.2
  */
 
-typedef double (*distancefunction)(double *, double *, int, double, double);
+#ifndef NN1_BLOCK
+/* Number of series that nn1fast() copies at a time from a stack in the
+ * layout of TimeBox
+ */
+#define NN1_BLOCK 64
+#endif
+
+#ifndef NN1_ABANDON
+/* Number of observations that the early abandoning distances sum between
+ * two comparisons with the best so far
+ */
+#define NN1_ABANDON 16
+#endif
+
+#ifndef NN1_INLINE
+#if defined(__GNUC__)
+#define NN1_INLINE __inline__ __attribute__ ((always_inline))
+#elif defined(_MSC_VER)
+#define NN1_INLINE __forceinline
+#else
+#define NN1_INLINE
+#endif
+#endif
+
+#ifndef NN1FAST_SIMD
+#define NN1FAST_SIMD
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && \
+	!defined(NN1_NOSIMD)
+#define NN1_HAVE_SIMD 1
+#include <immintrin.h>
+#else
+#define NN1_HAVE_SIMD 0
+#endif
+
+/* Instruction sets of the search
+ */
+enum nn1simd {
+	NN1_AUTO,
+	NN1_SCALAR,
+	NN1_AVX2,
+	NN1_AVX512
+};
+
+/* Whether the processor supports an instruction set
+ */
+static NN1_INLINE int nn1simdsupported(int simd)
+{
+#if NN1_HAVE_SIMD
+	__builtin_cpu_init();
+	switch (simd) {
+	case NN1_AVX2:
+		return __builtin_cpu_supports("avx2");
+	case NN1_AVX512:
+		return __builtin_cpu_supports("avx512f");
+	}
+#endif
+	return simd == NN1_SCALAR;
+}
+
+/* The widest instruction set supported by the processor. It is found on
+ * the first call and kept while the MEX file is loaded
+ */
+static NN1_INLINE int nn1simdauto(void)
+{
+	static int simd = NN1_AUTO;
+
+	if (simd == NN1_AUTO) {
+		if (nn1simdsupported(NN1_AVX512))
+			simd = NN1_AVX512;
+		else if (nn1simdsupported(NN1_AVX2))
+			simd = NN1_AVX2;
+		else
+			simd = NN1_SCALAR;
+	}
+	return simd;
+}
+
+#endif
+
+#ifndef NN1FAST_STATS
+#define NN1FAST_STATS
 
-double euclidean2(double *s, double *z, int len, double bsf, double epsilon)
+/* Statistics of a series used by the distances with statistics
+ */
+enum nn1stats {
+	NN1_NOSTATS,
+	NN1_NORM1,              /* sum of |s| */
+	NN1_NORM2,              /* sum of s^2 */
+	NN1_LOG,                /* log(|s|) of every observation */
+	NN1_SQRT                /* sqrt(|s|) of every observation */
+};
+
+/* The statistics used by a distance code, or NN1_NOSTATS
+ */
+static NN1_INLINE int nn1statskind(int distcode)
 {
-	/* Return the squared Euclidean distance between two series
-	*/
+	switch (distcode) {
+	case 12:
+		return NN1_NORM1;
+	case 20:
+	case 21:
+	case 22:
+		return NN1_NORM2;
+	case 40:
+	case 41:
+		return NN1_LOG;
+	case 50:
+	case 51:
+		return NN1_SQRT;
+	}
+	return NN1_NOSTATS;
+}
+
+/* Number of statistics of a series of "len" elements, the class included
+ */
+static NN1_INLINE int nn1statsrows(int kind, int len)
+{
+	return kind == NN1_LOG || kind == NN1_SQRT ? len - 1 : 1;
+}
+
+#endif
+
+typedef double (*PRECISION(distancefunction))(real *, real *, int, double,
+		double);
+typedef double (*PRECISION(elasticfunction))(real *, real *, int, double,
+		double, double *);
+typedef double (*PRECISION(statsfunction))(real *, real *, const double *,
+		const double *, int, double, double);
+typedef int (*PRECISION(searchfunction))(real *, real *, int, int, int, int,
+		double, double *, double *);
+typedef int (*PRECISION(statssearchfunction))(real *, real *, int, int, int,
+		int, double, const double *, const double *, double *,
+		double *);
+
+#include "nn1fast_elastic.c"
+
+static NN1_INLINE double PRECISION(euclidean2)(real *s, real *z, int len,
+		double bsf, double epsilon)
+{
+	/* Return the squared Euclidean distance between two series.
+	 *
+	 * The sum never decreases, so once it is larger than the best so far
+	 * it stays larger: checking only at the end of every NN1_ABANDON
+	 * observations abandons the same series as checking after each one,
+	 * and the inner loop is left without a branch
+	 */
 	double dist = 0;
-	while (--len) {
-		dist += (*s - *z) * (*s - *z);
-		s++;
-		z++;
+	int i, end, n = len - 1;
+	for (i = 0; i < n; ) {
+		end = n - i > NN1_ABANDON ? i + NN1_ABANDON : n;
+		for (; i < end; i++)
+			dist += (s[i] - z[i]) * (s[i] - z[i]);
 		/* Early abandon
 		*/
 		if (FLT_GT(dist, bsf, epsilon)) {
@@ -28,13 +201,15 @@ double euclidean2(double *s, double *z, int len, double bsf, double epsilon)
 	return dist;
 }
 
-double manhattan(double *s, double *z, int len, double bsf, double epsilon)
+static NN1_INLINE double PRECISION(manhattan)(real *s, real *z, int len,
+		double bsf, double epsilon)
 {
 	double dist = 0;
-	while (--len) {
-		dist += (*s > *z ? *s - *z : *z - *s);
-		s++;
-		z++;
+	int i, end, n = len - 1;
+	for (i = 0; i < n; ) {
+		end = n - i > NN1_ABANDON ? i + NN1_ABANDON : n;
+		for (; i < end; i++)
+			dist += fabs(s[i] - z[i]);
 		if (FLT_GT(dist, bsf, epsilon)) {
 			debug(" %.6f (early abandoned)\n", dist);
 			return dist;
@@ -44,16 +219,22 @@ double manhattan(double *s, double *z, int len, double bsf, double epsilon)
 	return dist;
 }
 
-double chebyshev(double *s, double *z, int len, double bsf, double epsilon)
+static NN1_INLINE double PRECISION(chebyshev)(real *s, real *z, int len,
+		double bsf, double epsilon)
 {
+	/* The maximum is only raised by a difference larger than it by more
+	 * than epsilon, as it always has been, so it never decreases either
+	 */
 	double dist = 0;
 	double d;
-	while (--len) {
-		d = (*s > *z ? *s - *z : *z - *s);
-		s++;
-		z++;
-		if (FLT_GT(d, dist, epsilon)) {
-			dist = d;
+	int i, end, n = len - 1;
+	for (i = 0; i < n; ) {
+		end = n - i > NN1_ABANDON ? i + NN1_ABANDON : n;
+		for (; i < end; i++) {
+			d = fabs(s[i] - z[i]);
+			if (FLT_GT(d, dist, epsilon)) {
+				dist = d;
+			}
 		}
 		if (FLT_GT(dist, bsf, epsilon)) {
 			debug(" %.6f (early abandoned)\n", dist);
@@ -64,33 +245,37 @@ double chebyshev(double *s, double *z, int len, double bsf, double epsilon)
 	return dist;
 }
 
-double avg_l1_linf(double *s, double *z, int len, double bsf, double epsilon)
+static NN1_INLINE double PRECISION(avg_l1_linf)(real *s, real *z, int len,
+		double bsf, double epsilon)
 {
 	double m, c;
 	debug("(");
-	m = manhattan(s, z, len, INFINITY, epsilon);
+	m = PRECISION(manhattan)(s, z, len, INFINITY, epsilon);
 	debug (" + ");
-	c = chebyshev(s, z, len, INFINITY, epsilon);
+	c = PRECISION(chebyshev)(s, z, len, INFINITY, epsilon);
 	debug (") / 2 --> %.6f\n", (m + c) / 2);
 	return (m + c) / 2;
 }
 
 
-double canberra(double *s, double *z, int len, double bsf, double epsilon)
+static NN1_INLINE double PRECISION(canberra)(real *s, real *z, int len,
+		double bsf, double epsilon)
 {
 	double dist = 0;
 	double u, b;
-	while (--len) {
-		u = fabs(*s - *z);
-		b = fabs(*s) + fabs(*z);
-		if (b < epsilon) {
-			dist += u;
-		}
-		else {
-			dist += u / b;
+	int i, end, n = len - 1;
+	for (i = 0; i < n; ) {
+		end = n - i > NN1_ABANDON ? i + NN1_ABANDON : n;
+		for (; i < end; i++) {
+			u = fabs(s[i] - z[i]);
+			b = fabs(s[i]) + fabs(z[i]);
+			if (b < epsilon) {
+				dist += u;
+			}
+			else {
+				dist += u / b;
+			}
 		}
-		s++;
-		z++;
 		if (FLT_GT(dist, bsf, epsilon)) {
 			debug(" %.6f (early abandoned)\n", dist);
 			return dist;
@@ -100,13 +285,15 @@ double canberra(double *s, double *z, int len, double bsf, double epsilon)
 	return dist;
 }
 
-double lorentzian(double *s, double *z, int len, double bsf, double epsilon)
+static NN1_INLINE double PRECISION(lorentzian)(real *s, real *z, int len,
+		double bsf, double epsilon)
 {
 	double dist = 0;
-	while (--len) {
-		dist += log(1 + fabs(*s - *z));
-		s++;
-		z++;
+	int i, end, n = len - 1;
+	for (i = 0; i < n; ) {
+		end = n - i > NN1_ABANDON ? i + NN1_ABANDON : n;
+		for (; i < end; i++)
+			dist += log(1 + fabs(s[i] - z[i]));
 		if (FLT_GT(dist, bsf, epsilon)) {
 			debug(" %.6f (early abandoned)\n", dist);
 			return dist;
@@ -116,7 +303,8 @@ double lorentzian(double *s, double *z, int len, double bsf, double epsilon)
 	return dist;
 }
 
-double sorensen(double *s, double *z, int len, double bsf, double epsilon)
+static NN1_INLINE double PRECISION(sorensen)(real *s, real *z, int len,
+		double bsf, double epsilon)
 {
 	double num = 0, den = 0;
 	while (--len) {
@@ -129,7 +317,8 @@ double sorensen(double *s, double *z, int len, double bsf, double epsilon)
 	return num / den;
 }
 
-double cosine(double *s, double *z, int len, double bsf, double epsilon)
+static NN1_INLINE double PRECISION(cosine)(real *s, real *z, int len,
+		double bsf, double epsilon)
 {
 	double dist = 0;
 	double norm1 = 0, norm2 = 0;
@@ -145,7 +334,8 @@ double cosine(double *s, double *z, int len, double bsf, double epsilon)
 	return dist;
 }
 
-double jaccard(double *s, double *z, int len, double bsf, double epsilon)
+static NN1_INLINE double PRECISION(jaccard)(real *s, real *z, int len,
+		double bsf, double epsilon)
 {
 	double dist;
 	double diff = 0;
@@ -161,7 +351,8 @@ double jaccard(double *s, double *z, int len, double bsf, double epsilon)
 	return dist;
 }
 
-double dice(double *s, double *z, int len, double bsf, double epsilon)
+static NN1_INLINE double PRECISION(dice)(real *s, real *z, int len,
+		double bsf, double epsilon)
 {
 	double dist;
 	double num = 0, den = 0;;
@@ -177,7 +368,8 @@ double dice(double *s, double *z, int len, double bsf, double epsilon)
 }
 
 
-double pearson(double *s, double *z, int len, double bsf, double epsilon)
+static NN1_INLINE double PRECISION(pearson)(real *s, real *z, int len,
+		double bsf, double epsilon)
 {
 	/* Notice this is the Pearson Chi-Square distance, not the Pearson
 	 * correlation coefficient.
@@ -197,7 +389,8 @@ double pearson(double *s, double *z, int len, double bsf, double epsilon)
 	return dist;
 }
 
-double squared_chi(double *s, double *z, int len, double bsf, double epsilon)
+static NN1_INLINE double PRECISION(squared_chi)(real *s, real *z, int len,
+		double bsf, double epsilon)
 {
 	double dist = 0;
 	double num, den;
@@ -217,7 +410,8 @@ double squared_chi(double *s, double *z, int len, double bsf, double epsilon)
 	return dist;
 }
 
-double kullback(double *s, double *z, int len, double bsf, double epsilon)
+static NN1_INLINE double PRECISION(kullback)(real *s, real *z, int len,
+		double bsf, double epsilon)
 {
 	double dist = 0;
 	double sz;
@@ -236,7 +430,8 @@ double kullback(double *s, double *z, int len, double bsf, double epsilon)
 	return dist;
 }
 
-double jeffrey(double *s, double *z, int len, double bsf, double epsilon)
+static NN1_INLINE double PRECISION(jeffrey)(real *s, real *z, int len,
+		double bsf, double epsilon)
 {
 	double dist = 0;
 	double sz;
@@ -252,7 +447,8 @@ double jeffrey(double *s, double *z, int len, double bsf, double epsilon)
 	return dist;
 }
 
-double bhattacharyya(double *s, double *z, int len, double bsf, double epsilon)
+static NN1_INLINE double PRECISION(bhattacharyya)(real *s, real *z, int len,
+		double bsf, double epsilon)
 {
 	double dist = 0;
 	double sz;
@@ -271,7 +467,8 @@ double bhattacharyya(double *s, double *z, int len, double bsf, double epsilon)
 	return dist;
 }
 
-double hellinger(double *s, double *z, int len, double bsf, double epsilon)
+static NN1_INLINE double PRECISION(hellinger)(real *s, real *z, int len,
+		double bsf, double epsilon)
 {
 	double dist = 0;
 	double sz;
@@ -294,74 +491,831 @@ double hellinger(double *s, double *z, int len, double bsf, double epsilon)
 }
 
 
-distancefunction selectdistance(int distcode)
+/* Lp norm family, continued
+ */
+
+static NN1_INLINE double PRECISION(minkowski)(real *s, real *z, int len,
+		double bsf, double epsilon)
+{
+	/* The exponent is read from the parameters of nn1fast_elastic.c. The
+	 * sum of each block is compared with the best so far raised to the
+	 * p-th power, and the root is taken only when returning. Rounding may
+	 * leave the root of a sum just over "cutoff" within epsilon of bsf, so
+	 * the root is checked before abandoning
+	 */
+	double dist = 0, p = elastic.minkowski_p, root;
+	double cutoff = pow(bsf + epsilon, p);
+	int i, end, n = len - 1;
+	for (i = 0; i < n; ) {
+		end = n - i > NN1_ABANDON ? i + NN1_ABANDON : n;
+		for (; i < end; i++)
+			dist += pow(fabs(s[i] - z[i]), p);
+		if (dist > cutoff) {
+			root = pow(dist, 1 / p);
+			if (FLT_GT(root, bsf, epsilon)) {
+				debug(" %.6f (early abandoned)\n", root);
+				return root;
+			}
+		}
+	}
+	dist = pow(dist, 1 / p);
+	debug(" %.6f\n", dist);
+	return dist;
+}
+
+/* Manhattan-derived family, continued
+ */
+
+static NN1_INLINE double PRECISION(soergel)(real *s, real *z, int len,
+		double bsf, double epsilon)
+{
+	double num = 0, den = 0;
+	int i, n = len - 1;
+	for (i = 0; i < n; i++) {
+		num += fabs(s[i] - z[i]);
+		den += s[i] > z[i] ? s[i] : z[i];
+	}
+	debug(" %.6f\n", num / den);
+	return num / den;
+}
+
+static NN1_INLINE double PRECISION(kulczynski)(real *s, real *z, int len,
+		double bsf, double epsilon)
+{
+	double num = 0, den = 0;
+	int i, n = len - 1;
+	for (i = 0; i < n; i++) {
+		num += fabs(s[i] - z[i]);
+		den += s[i] < z[i] ? s[i] : z[i];
+	}
+	debug(" %.6f\n", num / den);
+	return num / den;
+}
+
+/* Pearson Chi-Square coefficient family, continued. Only Divergence has
+ * no negative terms, so the others are never abandoned
+ */
+
+static NN1_INLINE double PRECISION(neyman)(real *s, real *z, int len,
+		double bsf, double epsilon)
+{
+	double dist = 0;
+	int i, n = len - 1;
+	for (i = 0; i < n; i++)
+		dist += (s[i] - z[i]) * (s[i] - z[i]) / s[i];
+	debug(" %.6f\n", dist);
+	return dist;
+}
+
+static NN1_INLINE double PRECISION(prob_symmetric_chi)(real *s, real *z,
+		int len, double bsf, double epsilon)
+{
+	double dist = 0;
+	int i, n = len - 1;
+	for (i = 0; i < n; i++)
+		dist += (s[i] - z[i]) * (s[i] - z[i]) / (s[i] + z[i]);
+	debug(" %.6f\n", 2 * dist);
+	return 2 * dist;
+}
+
+static NN1_INLINE double PRECISION(divergence)(real *s, real *z, int len,
+		double bsf, double epsilon)
+{
+	double dist = 0;
+	double num, den;
+	int i, end, n = len - 1;
+	for (i = 0; i < n; ) {
+		end = n - i > NN1_ABANDON ? i + NN1_ABANDON : n;
+		for (; i < end; i++) {
+			num = (s[i] - z[i]) * (s[i] - z[i]);
+			den = s[i] + z[i];
+			if (fabs(den) < epsilon) {
+				dist += num;
+			}
+			else {
+				dist += num / (den * den);
+			}
+		}
+		if (FLT_GT(2 * dist, bsf, epsilon)) {
+			debug(" %.6f (early abandoned)\n", 2 * dist);
+			return 2 * dist;
+		}
+	}
+	debug(" %.6f\n", 2 * dist);
+	return 2 * dist;
+}
+
+static NN1_INLINE double PRECISION(clark)(real *s, real *z, int len,
+		double bsf, double epsilon)
+{
+	double dist = 0;
+	int i, n = len - 1;
+	for (i = 0; i < n; i++)
+		dist += (s[i] - z[i]) * (s[i] - z[i]) / (s[i] + z[i]);
+	dist = sqrt(dist);
+	debug(" %.6f\n", dist);
+	return dist;
+}
+
+static NN1_INLINE double PRECISION(additive_symm_chi)(real *s, real *z,
+		int len, double bsf, double epsilon)
+{
+	double dist = 0;
+	int i, n = len - 1;
+	for (i = 0; i < n; i++) {
+		dist += (s[i] - z[i]) * (s[i] - z[i]) * (s[i] + z[i]) /
+			((double)s[i] * z[i]);
+	}
+	debug(" %.6f\n", dist);
+	return dist;
+}
+
+static NN1_INLINE double PRECISION(max_symmetric_chi)(real *s, real *z,
+		int len, double bsf, double epsilon)
+{
+	double bys = 0, byz = 0;
+	double d;
+	int i, n = len - 1;
+	for (i = 0; i < n; i++) {
+		d = (s[i] - z[i]) * (s[i] - z[i]);
+		bys += d / s[i];
+		byz += d / z[i];
+	}
+	debug(" %.6f\n", bys > byz ? bys : byz);
+	return bys > byz ? bys : byz;
+}
+
+static NN1_INLINE double PRECISION(min_symmetric_chi)(real *s, real *z,
+		int len, double bsf, double epsilon)
+{
+	double bys = 0, byz = 0;
+	double d;
+	int i, n = len - 1;
+	for (i = 0; i < n; i++) {
+		d = (s[i] - z[i]) * (s[i] - z[i]);
+		bys += d / s[i];
+		byz += d / z[i];
+	}
+	debug(" %.6f\n", bys < byz ? bys : byz);
+	return bys < byz ? bys : byz;
+}
+
+/* Kullback-Leibler family, continued. Jensen difference, Taneja and
+ * Kumar-Johnson have no negative terms (or NaN, which is never abandoned),
+ * so they are abandoned early
+ */
+
+static NN1_INLINE double PRECISION(k_divergence)(real *s, real *z, int len,
+		double bsf, double epsilon)
+{
+	double dist = 0;
+	int i, n = len - 1;
+	for (i = 0; i < n; i++)
+		dist += s[i] * log(2 * s[i] / ((double)s[i] + z[i]));
+	debug(" %.6f\n", dist);
+	return dist;
+}
+
+static NN1_INLINE double PRECISION(topsoe)(real *s, real *z, int len,
+		double bsf, double epsilon)
+{
+	double dist = 0;
+	double m;
+	int i, n = len - 1;
+	for (i = 0; i < n; i++) {
+		m = (double)s[i] + z[i];
+		dist += s[i] * log(2 * s[i] / m) + z[i] * log(2 * z[i] / m);
+	}
+	debug(" %.6f\n", dist);
+	return dist;
+}
+
+static NN1_INLINE double PRECISION(jansen_shannon)(real *s, real *z,
+		int len, double bsf, double epsilon)
+{
+	/* Half of Topsoe, as in DISTS.JANSEN_SHANNON
+	 */
+	return PRECISION(topsoe)(s, z, len, INFINITY, epsilon) / 2;
+}
+
+static NN1_INLINE double PRECISION(jensen_shannon)(real *s, real *z,
+		int len, double bsf, double epsilon)
+{
+	/* Half of the Kullback-Leibler distances from either series to their
+	 * mean, as in DISTS.JENSEN_SHANNON; each term that is not finite is
+	 * replaced with the observation, as in DISTS.KULLBACK
+	 */
+	double dist = 0;
+	double m, x;
+	int i, n = len - 1;
+	for (i = 0; i < n; i++) {
+		m = ((double)s[i] + z[i]) / 2;
+		x = s[i] * log(s[i] / m);
+		dist += isfinite(x) ? x : s[i];
+		x = z[i] * log(z[i] / m);
+		dist += isfinite(x) ? x : z[i];
+	}
+	debug(" %.6f\n", dist / 2);
+	return dist / 2;
+}
+
+static NN1_INLINE double PRECISION(jensen_difference)(real *s, real *z,
+		int len, double bsf, double epsilon)
+{
+	double dist = 0;
+	double m;
+	int i, end, n = len - 1;
+	for (i = 0; i < n; ) {
+		end = n - i > NN1_ABANDON ? i + NN1_ABANDON : n;
+		for (; i < end; i++) {
+			m = ((double)s[i] + z[i]) / 2;
+			dist += (s[i] * log((double)s[i]) +
+					z[i] * log((double)z[i])) / 2 -
+				m * log(m);
+		}
+		if (FLT_GT(dist, bsf, epsilon)) {
+			debug(" %.6f (early abandoned)\n", dist);
+			return dist;
+		}
+	}
+	debug(" %.6f\n", dist);
+	return dist;
+}
+
+static NN1_INLINE double PRECISION(taneja)(real *s, real *z, int len,
+		double bsf, double epsilon)
+{
+	double dist = 0;
+	double m;
+	int i, end, n = len - 1;
+	for (i = 0; i < n; ) {
+		end = n - i > NN1_ABANDON ? i + NN1_ABANDON : n;
+		for (; i < end; i++) {
+			m = ((double)s[i] + z[i]) / 2;
+			dist += m * log(m / sqrt((double)s[i] * z[i]));
+		}
+		if (FLT_GT(dist, bsf, epsilon)) {
+			debug(" %.6f (early abandoned)\n", dist);
+			return dist;
+		}
+	}
+	debug(" %.6f\n", dist);
+	return dist;
+}
+
+static NN1_INLINE double PRECISION(kumar_johnson)(real *s, real *z,
+		int len, double bsf, double epsilon)
+{
+	double dist = 0;
+	double sz, d;
+	int i, end, n = len - 1;
+	for (i = 0; i < n; ) {
+		end = n - i > NN1_ABANDON ? i + NN1_ABANDON : n;
+		for (; i < end; i++) {
+			sz = (double)s[i] * z[i];
+			d = (double)s[i] * s[i] - (double)z[i] * z[i];
+			dist += d * d / (2 * sz * sqrt(sz));
+		}
+		if (FLT_GT(dist, bsf, epsilon)) {
+			debug(" %.6f (early abandoned)\n", dist);
+			return dist;
+		}
+	}
+	debug(" %.6f\n", dist);
+	return dist;
+}
+
+/* Bhattacharyya coefficient family, continued
+ */
+
+static NN1_INLINE double PRECISION(matusita)(real *s, real *z, int len,
+		double bsf, double epsilon)
+{
+	double dist = 0;
+	int i, n = len - 1;
+	for (i = 0; i < n; i++)
+		dist += sqrt((double)s[i] * z[i]);
+	dist = sqrt(2 - 2 * dist);
+	debug(" %.6f\n", dist);
+	return dist;
+}
+
+static NN1_INLINE double PRECISION(square_chord)(real *s, real *z, int len,
+		double bsf, double epsilon)
+{
+	double dist = 0;
+	double d;
+	int i, end, n = len - 1;
+	for (i = 0; i < n; ) {
+		end = n - i > NN1_ABANDON ? i + NN1_ABANDON : n;
+		for (; i < end; i++) {
+			d = sqrt((double)s[i]) - sqrt((double)z[i]);
+			dist += d * d;
+		}
+		if (FLT_GT(dist, bsf, epsilon)) {
+			debug(" %.6f (early abandoned)\n", dist);
+			return dist;
+		}
+	}
+	debug(" %.6f\n", dist);
+	return dist;
+}
+
+/* Intersection family
+ */
+
+static NN1_INLINE double PRECISION(intersection)(real *s, real *z, int len,
+		double bsf, double epsilon)
+{
+	double dist = 0;
+	int i, end, n = len - 1;
+	for (i = 0; i < n; ) {
+		end = n - i > NN1_ABANDON ? i + NN1_ABANDON : n;
+		for (; i < end; i++)
+			dist += fabs(s[i] - z[i]);
+		if (FLT_GT(dist / 2, bsf, epsilon)) {
+			debug(" %.6f (early abandoned)\n", dist / 2);
+			return dist / 2;
+		}
+	}
+	debug(" %.6f\n", dist / 2);
+	return dist / 2;
+}
+
+static NN1_INLINE double PRECISION(wavehedges)(real *s, real *z, int len,
+		double bsf, double epsilon)
+{
+	double dist = 0;
+	int i, n = len - 1;
+	for (i = 0; i < n; i++) {
+		if (s[i] < z[i])
+			dist += (double)s[i] / z[i];
+		else
+			dist += (double)z[i] / s[i];
+	}
+	debug(" %.6f\n", n - dist);
+	return n - dist;
+}
+
+static NN1_INLINE double PRECISION(czekanowski)(real *s, real *z, int len,
+		double bsf, double epsilon)
+{
+	double num = 0, den = 0;
+	int i, n = len - 1;
+	for (i = 0; i < n; i++) {
+		num += fabs(s[i] - z[i]);
+		den += (double)s[i] + z[i];
+	}
+	debug(" %.6f\n", num / den);
+	return num / den;
+}
+
+static NN1_INLINE double PRECISION(motyka)(real *s, real *z, int len,
+		double bsf, double epsilon)
+{
+	double num = 0, den = 0;
+	int i, n = len - 1;
+	for (i = 0; i < n; i++) {
+		num += s[i] > z[i] ? s[i] : z[i];
+		den += (double)s[i] + z[i];
+	}
+	debug(" %.6f\n", num / den);
+	return num / den;
+}
+
+static NN1_INLINE double PRECISION(tanimoto)(real *s, real *z, int len,
+		double bsf, double epsilon)
+{
+	double sum = 0, min = 0;
+	int i, n = len - 1;
+	for (i = 0; i < n; i++) {
+		sum += (double)s[i] + z[i];
+		min += s[i] < z[i] ? s[i] : z[i];
+	}
+	debug(" %.6f\n", (sum - 2 * min) / (sum - min));
+	return (sum - 2 * min) / (sum - min);
+}
+
+/* Vicis family. Only Emanon 2 has no negative terms
+ */
+
+static NN1_INLINE double PRECISION(vicis_wave_hedges)(real *s, real *z,
+		int len, double bsf, double epsilon)
+{
+	double dist = 0;
+	int i, n = len - 1;
+	for (i = 0; i < n; i++)
+		dist += fabs(s[i] - z[i]) / (s[i] < z[i] ? s[i] : z[i]);
+	debug(" %.6f\n", dist);
+	return dist;
+}
+
+static NN1_INLINE double PRECISION(emanon2)(real *s, real *z, int len,
+		double bsf, double epsilon)
+{
+	double dist = 0;
+	double min;
+	int i, end, n = len - 1;
+	for (i = 0; i < n; ) {
+		end = n - i > NN1_ABANDON ? i + NN1_ABANDON : n;
+		for (; i < end; i++) {
+			min = s[i] < z[i] ? s[i] : z[i];
+			dist += (s[i] - z[i]) * (s[i] - z[i]) / (min * min);
+		}
+		if (FLT_GT(dist, bsf, epsilon)) {
+			debug(" %.6f (early abandoned)\n", dist);
+			return dist;
+		}
+	}
+	debug(" %.6f\n", dist);
+	return dist;
+}
+
+static NN1_INLINE double PRECISION(emanon3)(real *s, real *z, int len,
+		double bsf, double epsilon)
+{
+	double dist = 0;
+	int i, n = len - 1;
+	for (i = 0; i < n; i++) {
+		dist += (s[i] - z[i]) * (s[i] - z[i]) /
+			(s[i] < z[i] ? s[i] : z[i]);
+	}
+	debug(" %.6f\n", dist);
+	return dist;
+}
+
+/* Distances with statistics
+ *
+ * These take, besides the two series, their statistics from
+ * seriesstats(), "ss" for "s" and "zs" for "z", and return the same
+ * distances as the functions above up to rounding:
+ *
+ *   - Sorensen, cosine, Jaccard and Dice take the norms of the series
+ *     from the statistics and sum only sum(|s - z|) or sum((s - z)^2),
+ *     from which the other sums follow: sum(s * z) is
+ *     (|s|^2 + |z|^2 - sum((s - z)^2)) / 2. Each distance then grows
+ *     with that sum, so it is abandoned like the Euclidean distance.
+ *
+ *   - Kullback-Leibler and Jeffrey's use log(|s|) - log(|z|) for
+ *     log(s / z), which is the same where they take the logarithm, since
+ *     s and z have the same sign there, and Bhattacharyya and Hellinger sqrt(|s|) * sqrt(|z|) for
+ *     sqrt(s * z), so no pair calls log() or sqrt().
+ */
+
+/* Compute the statistics "kind" of the series "s", which has "len"
+ * elements, the class included, into "out"
+ */
+void PRECISION(seriesstats)(int kind, real *s, int len, double *out)
+{
+	double sum = 0;
+	int i, n = len - 1;
+
+	switch (kind) {
+	case NN1_NORM1:
+		for (i = 0; i < n; i++)
+			sum += fabs((double)s[i]);
+		out[0] = sum;
+		break;
+	case NN1_NORM2:
+		for (i = 0; i < n; i++)
+			sum += (double)s[i] * s[i];
+		out[0] = sum;
+		break;
+	case NN1_LOG:
+		for (i = 0; i < n; i++)
+			out[i] = log(fabs((double)s[i]));
+		break;
+	case NN1_SQRT:
+		for (i = 0; i < n; i++)
+			out[i] = sqrt(fabs((double)s[i]));
+		break;
+	}
+}
+
+static NN1_INLINE double PRECISION(sorensen_stats)(real *s, real *z,
+		const double *ss, const double *zs, int len, double bsf,
+		double epsilon)
+{
+	double num = 0, den = ss[0] + zs[0];
+	int i, end, n = len - 1;
+	for (i = 0; i < n; ) {
+		end = n - i > NN1_ABANDON ? i + NN1_ABANDON : n;
+		for (; i < end; i++)
+			num += fabs(s[i] - z[i]);
+		if (FLT_GT(num / den, bsf, epsilon)) {
+			debug(" %.6f (early abandoned)\n", num / den);
+			return num / den;
+		}
+	}
+	debug(" %.6f\n", num / den);
+	return num / den;
+}
+
+/* Sum of the squared differences, abandoned once "f" of the sum is larger
+ * than bsf. "f" must not decrease as the sum grows
+ */
+#define NN1_SQUARES(_f) do { \
+	for (i = 0; i < n; ) { \
+		end = n - i > NN1_ABANDON ? i + NN1_ABANDON : n; \
+		for (; i < end; i++) \
+			diff += (s[i] - z[i]) * (s[i] - z[i]); \
+		if (FLT_GT(_f, bsf, epsilon)) { \
+			debug(" %.6f (early abandoned)\n", _f); \
+			return _f; \
+		} \
+	} \
+} while (0)
+
+static NN1_INLINE double PRECISION(cosine_stats)(real *s, real *z,
+		const double *ss, const double *zs, int len, double bsf,
+		double epsilon)
+{
+	double diff = 0, norms = ss[0] + zs[0];
+	double den = 2 * (sqrt(ss[0]) * sqrt(zs[0]));
+	int i, end, n = len - 1;
+	NN1_SQUARES(1 - (norms - diff) / den);
+	debug(" %.6f\n", 1 - (norms - diff) / den);
+	return 1 - (norms - diff) / den;
+}
+
+static NN1_INLINE double PRECISION(jaccard_stats)(real *s, real *z,
+		const double *ss, const double *zs, int len, double bsf,
+		double epsilon)
+{
+	/* diff / (diff + mul) is 2 * diff / (diff + norms), written so that
+	 * it does not decrease with diff after rounding either
+	 */
+	double diff = 0, norms = ss[0] + zs[0];
+	int i, end, n = len - 1;
+	NN1_SQUARES(2 / (1 + norms / diff));
+	debug(" %.6f\n", 2 / (1 + norms / diff));
+	return 2 / (1 + norms / diff);
+}
+
+static NN1_INLINE double PRECISION(dice_stats)(real *s, real *z,
+		const double *ss, const double *zs, int len, double bsf,
+		double epsilon)
+{
+	double diff = 0, norms = ss[0] + zs[0];
+	int i, end, n = len - 1;
+	NN1_SQUARES(diff / norms);
+	debug(" %.6f\n", diff / norms);
+	return diff / norms;
+}
+
+#undef NN1_SQUARES
+
+static NN1_INLINE double PRECISION(kullback_stats)(real *s, real *z,
+		const double *ss, const double *zs, int len, double bsf,
+		double epsilon)
+{
+	double dist = 0;
+	double sz;
+	int i, n = len - 1;
+	for (i = 0; i < n; i++) {
+		sz = s[i] * z[i];
+		if (fabs(sz) > epsilon && sz > 0) {
+			dist += s[i] * (ss[i] - zs[i]);
+		}
+		else {
+			dist += s[i];
+		}
+	}
+	debug(" %.6f\n", dist);
+	return dist;
+}
+
+static NN1_INLINE double PRECISION(jeffrey_stats)(real *s, real *z,
+		const double *ss, const double *zs, int len, double bsf,
+		double epsilon)
+{
+	double dist = 0;
+	double sz;
+	int i, n = len - 1;
+	for (i = 0; i < n; i++) {
+		sz = s[i] * z[i];
+		if (fabs(sz) > epsilon && sz > 0) {
+			dist += (s[i] - z[i]) * (ss[i] - zs[i]);
+		}
+	}
+	debug(" %.6f\n", dist);
+	return dist;
+}
+
+/* Sum of sqrt(s * z) of Bhattacharyya and Hellinger, NaN for products in
+ * (-epsilon, 0) as in the functions without statistics
+ */
+static NN1_INLINE double PRECISION(sqrtsum_stats)(real *s, real *z,
+		const double *ss, const double *zs, int len, double epsilon)
+{
+	double dist = 0;
+	double sz;
+	int i, n = len - 1;
+	for (i = 0; i < n; i++) {
+		sz = s[i] * z[i];
+		if (fabs(sz) < epsilon || sz > 0) {
+			dist += sz < 0 ? 0.0 / 0.0 : ss[i] * zs[i];
+		}
+	}
+	return dist;
+}
+
+static NN1_INLINE double PRECISION(bhattacharyya_stats)(real *s, real *z,
+		const double *ss, const double *zs, int len, double bsf,
+		double epsilon)
+{
+	double dist = PRECISION(sqrtsum_stats)(s, z, ss, zs, len, epsilon);
+	if (fabs(dist) > epsilon && dist > 0) {
+		dist = -log(dist);
+	}
+	debug(" %.6f\n", dist);
+	return dist;
+}
+
+static NN1_INLINE double PRECISION(hellinger_stats)(real *s, real *z,
+		const double *ss, const double *zs, int len, double bsf,
+		double epsilon)
+{
+	double dist = PRECISION(sqrtsum_stats)(s, z, ss, zs, len, epsilon);
+	if (fabs(dist - 1) < epsilon || dist < 1) {
+		dist = 2 * sqrt(1 - dist);
+	}
+	else {
+		dist = 0.0 / 0.0;
+	}
+	debug(" %.6f\n", dist);
+	return dist;
+}
+
+PRECISION(distancefunction) PRECISION(selectdistance)(int distcode)
 {
 	switch (distcode) {
 	case 1:
 		/* Lp norm family
 		*/
 		debug("Distance: Euclidean\n");
-		return euclidean2;
+		return PRECISION(euclidean2);
 	case 2:
 		debug("Distance: Manhattan\n");
-		return manhattan;
+		return PRECISION(manhattan);
 	case 3:
 		debug("Distance: Chebyshev\n");
-		return chebyshev;
+		return PRECISION(chebyshev);
+	case 4:
+		debug("Distance: Minkowski\n");
+		return PRECISION(minkowski);
+	case 5:
+		debug("Distance: squared Euclidean\n");
+		return PRECISION(euclidean2);
 	case 9:
 		debug("Distance: average Manhattan and Chebyshev\n");
-		return avg_l1_linf;
+		return PRECISION(avg_l1_linf);
 
 	case 10:
 		/* Manhattan-derived family
 		*/
 		debug("Distance: Canberra\n");
-		return canberra;
+		return PRECISION(canberra);
 	case 11:
 		debug("Distance: Lorentzian\n");
-		return lorentzian;
+		return PRECISION(lorentzian);
 	case 12:
 		debug("Distance: Sorensen\n");
-		return sorensen;
+		return PRECISION(sorensen);
+	case 13:
+		debug("Distance: Soergel\n");
+		return PRECISION(soergel);
+	case 14:
+		debug("Distance: Kulczynski\n");
+		return PRECISION(kulczynski);
 
 	case 20:
 		/* Dot product family
 		 */
 		debug("Distance: Cosine\n");
-		return cosine;
+		return PRECISION(cosine);
 	case 21:
 		debug("Distance: Jaccard\n");
-		return jaccard;
+		return PRECISION(jaccard);
 	case 22:
 		debug("Distance: Dice\n");
-		return dice;
+		return PRECISION(dice);
 		
 	case 30:
 		/* Pearson Chi-Square coefficient family
 		 */
 		debug("Distance: Pearson Chi-Square\n");
-		return pearson;
+		return PRECISION(pearson);
 	case 31:
 		debug("Distance: Squared Chi-Square\n");
-		return squared_chi;
+		return PRECISION(squared_chi);
+	case 32:
+		debug("Distance: Neyman Chi-Square\n");
+		return PRECISION(neyman);
+	case 33:
+		debug("Distance: Probabilistic Symmetric Chi-Square\n");
+		return PRECISION(prob_symmetric_chi);
+	case 34:
+		debug("Distance: Divergence\n");
+		return PRECISION(divergence);
+	case 35:
+		debug("Distance: Clark\n");
+		return PRECISION(clark);
+	case 36:
+		debug("Distance: Additive Symmetric Chi-Square\n");
+		return PRECISION(additive_symm_chi);
+	case 37:
+		debug("Distance: Maximum Symmetric Chi-Square\n");
+		return PRECISION(max_symmetric_chi);
+	case 38:
+		debug("Distance: Minimum Symmetric Chi-Square\n");
+		return PRECISION(min_symmetric_chi);
 
 	case 40:
 		/* Kullback-Leibler family
 		 */
 		debug("Distance: Kullback-Leibler\n");
-		return kullback;
+		return PRECISION(kullback);
 	case 41:
 		debug("Distance: Jeffrey's\n");
-		return jeffrey;
+		return PRECISION(jeffrey);
+	case 42:
+		debug("Distance: K divergence\n");
+		return PRECISION(k_divergence);
+	case 43:
+		debug("Distance: Topsoe\n");
+		return PRECISION(topsoe);
+	case 44:
+		debug("Distance: Jensen-Shannon\n");
+		return PRECISION(jensen_shannon);
+	case 45:
+		debug("Distance: Jansen-Shannon (half Topsoe)\n");
+		return PRECISION(jansen_shannon);
+	case 46:
+		debug("Distance: Jensen difference\n");
+		return PRECISION(jensen_difference);
+	case 47:
+		debug("Distance: Taneja\n");
+		return PRECISION(taneja);
+	case 48:
+		debug("Distance: Kumar-Johnson\n");
+		return PRECISION(kumar_johnson);
 
 	case 50:
 		/* Bhattacharyya coefficient family
 		 */
 		debug("Distance: Bhattacharyya distance\n");
-		return bhattacharyya;
+		return PRECISION(bhattacharyya);
 	case 51:
 		debug("Distance: Hellinger\n");
-		return hellinger;
+		return PRECISION(hellinger);
+	case 52:
+		debug("Distance: Matusita\n");
+		return PRECISION(matusita);
+	case 53:
+		debug("Distance: Squared-chord\n");
+		return PRECISION(square_chord);
+
+	case 60:
+	case 61:
+	case 62:
+	case 63:
+	case 64:
+	case 65:
+	case 66:
+		/* Elastic family, see selectelastic()
+		 */
+		return NULL;
+
+	case 70:
+		/* Intersection family
+		 */
+		debug("Distance: Intersection\n");
+		return PRECISION(intersection);
+	case 71:
+		debug("Distance: Wave Hedges\n");
+		return PRECISION(wavehedges);
+	case 72:
+		debug("Distance: Czekanowski\n");
+		return PRECISION(czekanowski);
+	case 73:
+		debug("Distance: Motyka\n");
+		return PRECISION(motyka);
+	case 74:
+		debug("Distance: Tanimoto\n");
+		return PRECISION(tanimoto);
+
+	case 80:
+		/* Vicis family
+		 */
+		debug("Distance: Vicis-Wave Hedges\n");
+		return PRECISION(vicis_wave_hedges);
+	case 81:
+		debug("Distance: Emanon 2\n");
+		return PRECISION(emanon2);
+	case 82:
+		debug("Distance: Emanon 3\n");
+		return PRECISION(emanon3);
 
 	default:
 		{
@@ -371,3 +1325,421 @@ distancefunction selectdistance(int distcode)
 		}
 	}
 }
+
+PRECISION(elasticfunction) PRECISION(selectelastic)(int distcode)
+{
+	/* Return the elastic distance of a distance code, or NULL if the
+	 * distance is not elastic
+	 */
+	switch (distcode) {
+	case 60:
+		debug("Distance: DTW\n");
+		return PRECISION(dtw);
+	case 61:
+		debug("Distance: derivative DTW\n");
+		return PRECISION(ddtw);
+	case 62:
+		debug("Distance: weighted DTW\n");
+		return PRECISION(wdtw);
+	case 63:
+		debug("Distance: ERP\n");
+		return PRECISION(erp);
+	case 64:
+		debug("Distance: LCSS\n");
+		return PRECISION(lcss);
+	case 65:
+		debug("Distance: MSM\n");
+		return PRECISION(msm);
+	case 66:
+		debug("Distance: TWE\n");
+		return PRECISION(twe);
+	default:
+		return NULL;
+	}
+}
+
+/* Copy series "first" to "first + NN1_BLOCK - 1" (0-based, or up to the
+ * last one) of a stack in the layout of TimeBox, with one series per row
+ * and the classes in the first column, into "block", one series after the
+ * other, each one still led by its class
+ */
+void PRECISION(copyblock)(real *stack, int nseries, int len, int first,
+		real *block)
+{
+	int count = nseries - first < NN1_BLOCK ? nseries - first : NN1_BLOCK;
+	real *column;
+	int i, k;
+
+	for (k = 0; k < len; k++) {
+		column = stack + (long long)k * nseries + first;
+		for (i = 0; i < count; i++)
+			block[i * len + k] = column[i];
+	}
+}
+
+/* Compute the statistics "kind" of every series of a stack, laid out as
+ * for nn1fast(), into "out", one series after the other. Return -1 if out
+ * of memory, 0 otherwise
+ */
+int PRECISION(stackstats)(int kind, real *stack, int nseries, int len,
+		int native, double *out)
+{
+	int rows = nn1statsrows(kind, len);
+	real *test, *block = NULL;
+	int current;
+
+	if (native) {
+		block = (real *)malloc(sizeof (real) * NN1_BLOCK * len);
+		if (!block)
+			return -1;
+	}
+	for (current = 1; current <= nseries; current++) {
+		if (native && (current - 1) % NN1_BLOCK == 0) {
+			PRECISION(copyblock)(stack, nseries, len, current - 1,
+					block);
+		}
+		if (native)
+			seekstack(test, block, (current - 1) % NN1_BLOCK + 1, len);
+		else
+			seekstack(test, stack, current, len);
+		PRECISION(seriesstats)(kind, test, len,
+				out + (long long)(current - 1) * rows);
+	}
+	free(block);
+	return 0;
+}
+
+static NN1_INLINE int PRECISION(nn1search)(real *stack, real *needle,
+		int nseries, int len, int native, int skipindex, double epsilon,
+		double *bestidx, PRECISION(distancefunction) distfun,
+		PRECISION(elasticfunction) elasticfun,
+		PRECISION(statsfunction) statsfun, const double *stats,
+		const double *needlestats, int statsrows, double *distance)
+{
+	/* Return the number of nearest neighbors, or -1 if out of memory.
+	 * Unless "native" is set, the stack has one series per column. With
+	 * "native", it is the data set as TimeBox stores it, one series per
+	 * row, and the series are copied NN1_BLOCK at a time into a small
+	 * buffer instead of the whole stack being transposed.
+	 *
+	 * If "statsfun" is not NULL, it is called instead of "distfun" with
+	 * the statistics of the series, "statsrows" per series in "stats",
+	 * and those of the needle. If "elasticfun" is not NULL, it is called
+	 * instead, with cost rows allocated once for the whole search.
+	 *
+	 * This is always inlined, so a constant "distfun", "elasticfun" or
+	 * "statsfun" becomes a direct call in the copy of the loop for that
+	 * distance
+	 */
+	real *test, *block = NULL;
+	double *rows = NULL;
+	double bsf = INFINITY;
+	double dist;
+	int current;
+	int neighbors = 0;
+
+ 	debug("Called nn1fast(PTR, PTR, %d, %d, %d, %d, %e, PTR, PTR, PTR)\n", 
+			nseries, len, native, skipindex, epsilon); 
+
+	/* Skip the needle class
+	 */
+	needle++;
+	if (native) {
+		block = (real *)malloc(sizeof (real) * NN1_BLOCK * len);
+		if (!block)
+			return -1;
+	}
+	if (elasticfun && !(rows = (double *)malloc(elasticsize(len)))) {
+		free(block);
+		return -1;
+	}
+
+	/* Calculate the squared distance from the needle to all series
+	 */
+	for (current = 1; current <= nseries; current++) {
+		if (native && (current - 1) % NN1_BLOCK == 0) {
+			PRECISION(copyblock)(stack, nseries, len, current - 1,
+					block);
+		}
+
+		/* Allow in-loco classification
+		 */
+		if (current == skipindex)
+			continue;
+		if (native)
+			seekstack(test, block, (current - 1) % NN1_BLOCK + 1, len);
+		else
+			seekstack(test, stack, current, len);
+		
+		debug("Distance #%d: ", current);
+		if (statsfun) {
+			dist = statsfun(test, needle, stats +
+					(long long)(current - 1) * statsrows,
+					needlestats, len, bsf, epsilon);
+		}
+		else if (elasticfun) {
+			dist = elasticfun(test, needle, len, bsf, epsilon, rows);
+		}
+		else {
+			dist = distfun(test, needle, len, bsf, epsilon);
+		}
+		if (FLT_GT(bsf, dist, epsilon)) {
+			/* Distance to nearest neighbor got smaller
+			*/
+			bsf = dist;
+			bestidx[0] = current;
+			neighbors = 1;
+		}
+		else if (!FLT_GT(dist, bsf, epsilon)) {
+			/* Another instance just as far from the previous
+			 * neighbors
+			 */
+			bestidx[neighbors++] = current;
+		}
+	}
+
+	free(block);
+	free(rows);
+	*distance = bsf;
+	return neighbors;
+}
+
+int PRECISION(nn1fast)(real *stack, real *needle, int nseries, int len,
+		int native, int skipindex, double epsilon, double *bestidx,
+		PRECISION(distancefunction) distfun, double *distance)
+{
+	/* The search with any distance function, called through a pointer
+	 */
+	return PRECISION(nn1search)(stack, needle, nseries, len, native,
+			skipindex, epsilon, bestidx, distfun, NULL, NULL, NULL,
+			NULL, 0, distance);
+}
+
+/* Defines nn1fast_<name>(), the search with the distance function <name>
+ */
+#define NN1_SEARCH(_name) \
+int PRECISION(nn1fast_ ## _name)(real *stack, real *needle, int nseries, \
+		int len, int native, int skipindex, double epsilon, \
+		double *bestidx, double *distance) \
+{ \
+	return PRECISION(nn1search)(stack, needle, nseries, len, native, \
+			skipindex, epsilon, bestidx, PRECISION(_name), NULL, \
+			NULL, NULL, NULL, 0, distance); \
+}
+
+/* Defines nn1fast_<name>() for the elastic distance <name>
+ */
+#define NN1_ELASTICSEARCH(_name) \
+int PRECISION(nn1fast_ ## _name)(real *stack, real *needle, int nseries, \
+		int len, int native, int skipindex, double epsilon, \
+		double *bestidx, double *distance) \
+{ \
+	return PRECISION(nn1search)(stack, needle, nseries, len, native, \
+			skipindex, epsilon, bestidx, NULL, PRECISION(_name), \
+			NULL, NULL, NULL, 0, distance); \
+}
+
+NN1_SEARCH(euclidean2)
+NN1_SEARCH(manhattan)
+NN1_SEARCH(chebyshev)
+NN1_SEARCH(avg_l1_linf)
+NN1_SEARCH(canberra)
+NN1_SEARCH(lorentzian)
+NN1_SEARCH(sorensen)
+NN1_SEARCH(cosine)
+NN1_SEARCH(jaccard)
+NN1_SEARCH(dice)
+NN1_SEARCH(pearson)
+NN1_SEARCH(squared_chi)
+NN1_SEARCH(kullback)
+NN1_SEARCH(jeffrey)
+NN1_SEARCH(bhattacharyya)
+NN1_SEARCH(hellinger)
+NN1_ELASTICSEARCH(dtw)
+NN1_ELASTICSEARCH(ddtw)
+NN1_ELASTICSEARCH(wdtw)
+NN1_ELASTICSEARCH(erp)
+NN1_ELASTICSEARCH(lcss)
+NN1_ELASTICSEARCH(msm)
+NN1_ELASTICSEARCH(twe)
+NN1_SEARCH(minkowski)
+NN1_SEARCH(soergel)
+NN1_SEARCH(kulczynski)
+NN1_SEARCH(neyman)
+NN1_SEARCH(prob_symmetric_chi)
+NN1_SEARCH(divergence)
+NN1_SEARCH(clark)
+NN1_SEARCH(additive_symm_chi)
+NN1_SEARCH(max_symmetric_chi)
+NN1_SEARCH(min_symmetric_chi)
+NN1_SEARCH(k_divergence)
+NN1_SEARCH(topsoe)
+NN1_SEARCH(jensen_shannon)
+NN1_SEARCH(jansen_shannon)
+NN1_SEARCH(jensen_difference)
+NN1_SEARCH(taneja)
+NN1_SEARCH(kumar_johnson)
+NN1_SEARCH(matusita)
+NN1_SEARCH(square_chord)
+NN1_SEARCH(intersection)
+NN1_SEARCH(wavehedges)
+NN1_SEARCH(czekanowski)
+NN1_SEARCH(motyka)
+NN1_SEARCH(tanimoto)
+NN1_SEARCH(vicis_wave_hedges)
+NN1_SEARCH(emanon2)
+NN1_SEARCH(emanon3)
+
+/* The vectorized distances and their copies of the search
+ */
+#if NN1_HAVE_SIMD
+#pragma GCC push_options
+#pragma GCC target ("avx2")
+#define SIMD_SUFFIX avx2
+#define SIMD_WIDTH 4
+#define SIMD_SQRT(_x) ((vec)_mm256_sqrt_pd((__m256d)(_x)))
+#define SIMD_CVT(_p) ((vec)_mm256_cvtps_pd(_mm_loadu_ps(_p)))
+#include "nn1fast_simd.c"
+#undef SIMD_SUFFIX
+#undef SIMD_WIDTH
+#undef SIMD_SQRT
+#undef SIMD_CVT
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target ("avx512f")
+#define SIMD_SUFFIX avx512
+#define SIMD_WIDTH 8
+#define SIMD_SQRT(_x) ((vec)_mm512_sqrt_pd((__m512d)(_x)))
+#define SIMD_CVT(_p) ((vec)_mm512_cvtps_pd(_mm256_loadu_ps(_p)))
+#include "nn1fast_simd.c"
+#undef SIMD_SUFFIX
+#undef SIMD_WIDTH
+#undef SIMD_SQRT
+#undef SIMD_CVT
+#pragma GCC pop_options
+#endif
+
+#undef NN1_SEARCH
+#undef NN1_ELASTICSEARCH
+
+/* Defines nn1stats_<name>(), the search with the distance <name>_stats and
+ * the statistics of the stack and of the needle
+ */
+#define NN1_STATSSEARCH(_name, _kind) \
+int PRECISION(nn1stats_ ## _name)(real *stack, real *needle, int nseries, \
+		int len, int native, int skipindex, double epsilon, \
+		const double *stats, const double *needlestats, \
+		double *bestidx, double *distance) \
+{ \
+	return PRECISION(nn1search)(stack, needle, nseries, len, native, \
+			skipindex, epsilon, bestidx, NULL, NULL, \
+			PRECISION(_name ## _stats), stats, needlestats, \
+			nn1statsrows(_kind, len), distance); \
+}
+
+NN1_STATSSEARCH(sorensen, NN1_NORM1)
+NN1_STATSSEARCH(cosine, NN1_NORM2)
+NN1_STATSSEARCH(jaccard, NN1_NORM2)
+NN1_STATSSEARCH(dice, NN1_NORM2)
+NN1_STATSSEARCH(kullback, NN1_LOG)
+NN1_STATSSEARCH(jeffrey, NN1_LOG)
+NN1_STATSSEARCH(bhattacharyya, NN1_SQRT)
+NN1_STATSSEARCH(hellinger, NN1_SQRT)
+
+#undef NN1_STATSSEARCH
+
+PRECISION(statssearchfunction) PRECISION(selectstatssearch)(int distcode)
+{
+	/* Return the search with statistics for a distance code, or NULL if
+	 * the distance uses none (see nn1statskind())
+	 */
+	switch (distcode) {
+	case 12: return PRECISION(nn1stats_sorensen);
+	case 20: return PRECISION(nn1stats_cosine);
+	case 21: return PRECISION(nn1stats_jaccard);
+	case 22: return PRECISION(nn1stats_dice);
+	case 40: return PRECISION(nn1stats_kullback);
+	case 41: return PRECISION(nn1stats_jeffrey);
+	case 50: return PRECISION(nn1stats_bhattacharyya);
+	case 51: return PRECISION(nn1stats_hellinger);
+	default: return NULL;
+	}
+}
+
+PRECISION(searchfunction) PRECISION(selectsearch)(int distcode, int simd)
+{
+	/* Return the copy of the search for a distance code, with the
+	 * instruction set "simd" if the distance has a vectorized version.
+	 * The codes are those of selectdistance(), which also raises the
+	 * error for an unknown code
+	 */
+#if NN1_HAVE_SIMD
+	PRECISION(searchfunction) search = NULL;
+
+	if (simd == NN1_AUTO)
+		simd = nn1simdauto();
+	if (simd == NN1_AVX512)
+		search = PRECISION(selectsearch_avx512)(distcode);
+	else if (simd == NN1_AVX2)
+		search = PRECISION(selectsearch_avx2)(distcode);
+	if (search)
+		return search;
+#endif
+	switch (distcode) {
+	case 1: return PRECISION(nn1fast_euclidean2);
+	case 2: return PRECISION(nn1fast_manhattan);
+	case 3: return PRECISION(nn1fast_chebyshev);
+	case 4: return PRECISION(nn1fast_minkowski);
+	case 5: return PRECISION(nn1fast_euclidean2);
+	case 9: return PRECISION(nn1fast_avg_l1_linf);
+	case 10: return PRECISION(nn1fast_canberra);
+	case 11: return PRECISION(nn1fast_lorentzian);
+	case 12: return PRECISION(nn1fast_sorensen);
+	case 13: return PRECISION(nn1fast_soergel);
+	case 14: return PRECISION(nn1fast_kulczynski);
+	case 20: return PRECISION(nn1fast_cosine);
+	case 21: return PRECISION(nn1fast_jaccard);
+	case 22: return PRECISION(nn1fast_dice);
+	case 30: return PRECISION(nn1fast_pearson);
+	case 31: return PRECISION(nn1fast_squared_chi);
+	case 32: return PRECISION(nn1fast_neyman);
+	case 33: return PRECISION(nn1fast_prob_symmetric_chi);
+	case 34: return PRECISION(nn1fast_divergence);
+	case 35: return PRECISION(nn1fast_clark);
+	case 36: return PRECISION(nn1fast_additive_symm_chi);
+	case 37: return PRECISION(nn1fast_max_symmetric_chi);
+	case 38: return PRECISION(nn1fast_min_symmetric_chi);
+	case 40: return PRECISION(nn1fast_kullback);
+	case 41: return PRECISION(nn1fast_jeffrey);
+	case 42: return PRECISION(nn1fast_k_divergence);
+	case 43: return PRECISION(nn1fast_topsoe);
+	case 44: return PRECISION(nn1fast_jensen_shannon);
+	case 45: return PRECISION(nn1fast_jansen_shannon);
+	case 46: return PRECISION(nn1fast_jensen_difference);
+	case 47: return PRECISION(nn1fast_taneja);
+	case 48: return PRECISION(nn1fast_kumar_johnson);
+	case 50: return PRECISION(nn1fast_bhattacharyya);
+	case 51: return PRECISION(nn1fast_hellinger);
+	case 52: return PRECISION(nn1fast_matusita);
+	case 53: return PRECISION(nn1fast_square_chord);
+	case 60: return PRECISION(nn1fast_dtw);
+	case 61: return PRECISION(nn1fast_ddtw);
+	case 62: return PRECISION(nn1fast_wdtw);
+	case 63: return PRECISION(nn1fast_erp);
+	case 64: return PRECISION(nn1fast_lcss);
+	case 65: return PRECISION(nn1fast_msm);
+	case 66: return PRECISION(nn1fast_twe);
+	case 70: return PRECISION(nn1fast_intersection);
+	case 71: return PRECISION(nn1fast_wavehedges);
+	case 72: return PRECISION(nn1fast_czekanowski);
+	case 73: return PRECISION(nn1fast_motyka);
+	case 74: return PRECISION(nn1fast_tanimoto);
+	case 80: return PRECISION(nn1fast_vicis_wave_hedges);
+	case 81: return PRECISION(nn1fast_emanon2);
+	case 82: return PRECISION(nn1fast_emanon3);
+	default:
+		PRECISION(selectdistance)(distcode);
+		return NULL;
+	}
+}
@@ -0,0 +1,574 @@
+/* This file contains the elastic distances of nn1fast_mex.c. It is
+ * #included by nn1fast_distances.c, so it is compiled once for each
+ * precision, with the same macros.
+ *
+ * Every distance is calculated within a Sakoe-Chiba window of w
+ * observations, keeping only two rows of the window of the cost matrix,
+ * so memory is O(w) regardless of the length of the series. A calculation
+ * is abandoned as soon as the cheapest cell of a row is larger than "bsf",
+ * since the cost never decreases along a path, and the lower bounds known
+ * for a distance are tried before its cost matrix. With bsf == INFINITY,
+ * no bound is calculated.
+ *
+ * The distances take these rows in "rows", a buffer of elasticsize() bytes
+ * that the caller allocates once for all the pairs of a search, or of a
+ * thread of calcmatrix_mex.cpp, so no memory is allocated per pair.
+ */
+
+/* This file is part of TimeBox. Copyright 2015-17 Rafael Giusti
+ * Revision 0.3.0
+ */
+
+#ifndef NN1FAST_ELASTIC
+#define NN1FAST_ELASTIC
+
+/* Parameters of the elastic distances, and the exponent of Minkowski. The
+ * MEX function sets them with readelasticparams() before any distance is
+ * calculated
+ */
+struct elasticparams {
+	int window;             /* Sakoe-Chiba window; negative for none */
+	double wdtw_g;          /* steepness of the WDTW weights */
+	double erp_g;           /* gap value of ERP */
+	double lcss_epsilon;    /* matching threshold of LCSS */
+	double msm_c;           /* split and merge cost of MSM */
+	double twe_nu;          /* stiffness of TWE */
+	double twe_lambda;      /* deletion penalty of TWE */
+	double minkowski_p;     /* exponent of Minkowski */
+};
+
+static struct elasticparams elastic;
+
+/* Read a scalar field of the parameters struct, if present
+ */
+static void elasticfield(const mxArray *params, const char *name,
+		double *value)
+{
+	mxArray *field;
+
+	if (!params || !(field = mxGetField(params, 0, name)))
+		return;
+	if (!mxIsDouble(field) || mxIsComplex(field) ||
+			mxGetNumberOfElements(field) != 1) {
+		char buf[1024];
+		sprintf(buf, "Elastic parameter \"%s\" must be a non-complex "
+				"scalar", name);
+		mexErrMsgTxt(buf);
+	}
+	*value = mxGetScalar(field);
+}
+
+/* Reset the parameters to their defaults and read those in "params", a
+ * scalar struct, or NULL. The window may be Inf for no window
+ */
+void readelasticparams(const mxArray *params)
+{
+	double window = -1;
+
+	elastic.wdtw_g = 0.05;
+	elastic.erp_g = 0;
+	elastic.lcss_epsilon = 1;
+	elastic.msm_c = 1;
+	elastic.twe_nu = 0.001;
+	elastic.twe_lambda = 1;
+	elastic.minkowski_p = 2;
+	if (params && (!mxIsStruct(params) ||
+				mxGetNumberOfElements(params) != 1)) {
+		mexErrMsgTxt("Elastic parameters must be a scalar struct");
+	}
+	elasticfield(params, "window", &window);
+	elasticfield(params, "wdtw_g", &elastic.wdtw_g);
+	elasticfield(params, "erp_g", &elastic.erp_g);
+	elasticfield(params, "lcss_epsilon", &elastic.lcss_epsilon);
+	elasticfield(params, "msm_c", &elastic.msm_c);
+	elasticfield(params, "twe_nu", &elastic.twe_nu);
+	elasticfield(params, "twe_lambda", &elastic.twe_lambda);
+	elasticfield(params, "minkowski_p", &elastic.minkowski_p);
+	if (!(elastic.minkowski_p > 0)) {
+		mexErrMsgTxt("Parameter \"minkowski_p\" must be positive");
+	}
+	if (window != -1 && !(window >= 0)) {
+		mexErrMsgTxt("Elastic parameter \"window\" must be "
+				"non-negative");
+	}
+	elastic.window = window > 1e9 ? -1 : (int)window;
+}
+
+/* Window for series of n observations; larger windows change nothing
+ */
+static int elasticwindow(int n)
+{
+	if (elastic.window < 0 || elastic.window > n - 1)
+		return n > 1 ? n - 1 : 0;
+	return elastic.window;
+}
+
+/* Bytes of the rows of the elastic distances for series of "len"
+ * elements, the class included: two rows of 2*w+1 cells, each with one
+ * guard cell at either end, followed by the w+1 weights of WDTW and the
+ * queues of envelopebound(), for the widest window of any distance
+ */
+static size_t elasticsize(int len)
+{
+	int w = elasticwindow(len);
+
+	return sizeof (double) * (2 * (2 * w + 3) + w + 1) +
+		sizeof (int) * 2 * (2 * w + 2);
+}
+
+/* Set both rows of 2*w+1 cells and their guard cells to "value"
+ */
+static void elasticrows(double *rows, int w, double value)
+{
+	int k;
+
+	for (k = 0; k < 2 * (2 * w + 3); k++)
+		rows[k] = value;
+}
+
+/* Cost of a split or a merge in MSM: moving "x" next to its neighbor "y"
+ * against "z"
+ */
+static double msmcost(double x, double y, double z, double c)
+{
+	if ((y <= x && x <= z) || (y >= x && x >= z))
+		return c;
+	return c + (fabs(x - y) < fabs(x - z) ? fabs(x - y) : fabs(x - z));
+}
+
+#define ELASTIC_MIN(_a, _b) ((_a) < (_b) ? (_a) : (_b))
+
+#endif
+
+/* Sliding envelope of "z", its smallest and largest observations within
+ * the window. Returns the sum of the squared distances from the
+ * observations of "s" to the envelope (LB_Keogh) or, if "threshold" is
+ * not negative, the number of observations of "s" within the envelope
+ * widened by "threshold", an upper bound to LCSS. The monotone queues of
+ * Lemire's algorithm are kept in "queue", two rings of 2*w+2 indices
+ */
+double PRECISION(envelopebound)(real *s, real *z, int n, int w,
+		double threshold, int *queue)
+{
+	int size = 2 * w + 2;
+	int *maxq = queue, *minq = queue + size;
+	int maxh = 0, maxt = 0, minh = 0, mint = 0;
+	int i, j = 0;
+	double bound = 0, upper, lower;
+
+	for (i = 0; i < n; i++) {
+		/* Push the observations entering the window and pop those
+		 * leaving it
+		 */
+		for (; j < n && j <= i + w; j++) {
+			while (maxt > maxh && z[maxq[(maxt - 1) % size]] <= z[j])
+				maxt--;
+			maxq[maxt++ % size] = j;
+			while (mint > minh && z[minq[(mint - 1) % size]] >= z[j])
+				mint--;
+			minq[mint++ % size] = j;
+		}
+		while (maxq[maxh % size] < i - w)
+			maxh++;
+		while (minq[minh % size] < i - w)
+			minh++;
+		upper = z[maxq[maxh % size]];
+		lower = z[minq[minh % size]];
+
+		if (threshold >= 0) {
+			if (s[i] <= upper + threshold && s[i] >= lower - threshold)
+				bound++;
+		}
+		else if (s[i] > upper) {
+			bound += (s[i] - upper) * (s[i] - upper);
+		}
+		else if (s[i] < lower) {
+			bound += (s[i] - lower) * (s[i] - lower);
+		}
+	}
+	return bound;
+}
+
+double PRECISION(dtw)(real *s, real *z, int len, double bsf,
+		double epsilon, double *rows)
+{
+	/* Return the DTW distance, the square root of the cost of the best
+	 * path, as calculated by DISTS.DTW_Cpp
+	 */
+	int n = len - 1, w = elasticwindow(n);
+	double *cost, *cost_prev, *tmp;
+	double x, y, d, rowmin, dist;
+	int i, j, k;
+
+	elasticrows(rows, w, INFINITY);
+	cost = rows + 1;
+	cost_prev = cost + 2 * w + 3;
+	if (bsf < INFINITY) {
+		dist = sqrt(PRECISION(envelopebound)(s, z, n, w, -1,
+					(int*)(rows + 4 * w + 6)));
+		if (FLT_GT(dist, bsf, epsilon))
+			return dist;
+	}
+
+	for (i = 0; i < n; i++) {
+		rowmin = INFINITY;
+		for (k = 0; k < 2 * w + 1; k++)
+			cost[k] = INFINITY;
+		for (j = i - w > 0 ? i - w : 0; j < n && j <= i + w; j++) {
+			k = j - i + w;
+			d = ((double)s[i] - z[j]) * ((double)s[i] - z[j]);
+			if (i == 0 && j == 0) {
+				cost[k] = d;
+			}
+			else {
+				x = ELASTIC_MIN(cost_prev[k + 1], cost[k - 1]);
+				y = cost_prev[k];
+				cost[k] = ELASTIC_MIN(x, y) + d;
+			}
+			rowmin = ELASTIC_MIN(rowmin, cost[k]);
+		}
+		if (FLT_GT(sqrt(rowmin), bsf, epsilon))
+			return sqrt(rowmin);
+		tmp = cost;
+		cost = cost_prev;
+		cost_prev = tmp;
+	}
+	dist = sqrt(cost_prev[w]);
+	debug(" %.6f\n", dist);
+	return dist;
+}
+
+/* Derivative of observation i as defined for DDTW by Keogh and Pazzani.
+ * The first and the last observations take the derivatives of their
+ * neighbors
+ */
+double PRECISION(derivative)(real *s, int i, int n)
+{
+	if (n < 3)
+		return 0;
+	if (i == 0)
+		i = 1;
+	else if (i == n - 1)
+		i = n - 2;
+	return (((double)s[i] - s[i - 1]) + ((double)s[i + 1] - s[i - 1]) / 2) / 2;
+}
+
+double PRECISION(ddtw)(real *s, real *z, int len, double bsf,
+		double epsilon, double *rows)
+{
+	/* Return the DTW distance between the derivatives of the series.
+	 * Derivatives are calculated as needed, so no copy of the series is
+	 * made. No lower bound is used
+	 */
+	int n = len - 1, w = elasticwindow(n);
+	double *cost, *cost_prev, *tmp;
+	double x, y, d, ds, rowmin, dist;
+	int i, j, k;
+
+	elasticrows(rows, w, INFINITY);
+	cost = rows + 1;
+	cost_prev = cost + 2 * w + 3;
+
+	for (i = 0; i < n; i++) {
+		rowmin = INFINITY;
+		ds = PRECISION(derivative)(s, i, n);
+		for (k = 0; k < 2 * w + 1; k++)
+			cost[k] = INFINITY;
+		for (j = i - w > 0 ? i - w : 0; j < n && j <= i + w; j++) {
+			k = j - i + w;
+			d = ds - PRECISION(derivative)(z, j, n);
+			d = d * d;
+			if (i == 0 && j == 0) {
+				cost[k] = d;
+			}
+			else {
+				x = ELASTIC_MIN(cost_prev[k + 1], cost[k - 1]);
+				y = cost_prev[k];
+				cost[k] = ELASTIC_MIN(x, y) + d;
+			}
+			rowmin = ELASTIC_MIN(rowmin, cost[k]);
+		}
+		if (FLT_GT(sqrt(rowmin), bsf, epsilon))
+			return sqrt(rowmin);
+		tmp = cost;
+		cost = cost_prev;
+		cost_prev = tmp;
+	}
+	dist = sqrt(cost_prev[w]);
+	debug(" %.6f\n", dist);
+	return dist;
+}
+
+double PRECISION(wdtw)(real *s, real *z, int len, double bsf,
+		double epsilon, double *rows)
+{
+	/* Return the weighted DTW distance of Jeong et al., with the weight
+	 * 1 / (1 + exp(-g * (|i - j| - n / 2))) on each squared difference.
+	 * Weights grow with |i - j|, so LB_Keogh times the smallest weight
+	 * is a lower bound
+	 */
+	int n = len - 1, w = elasticwindow(n);
+	double *cost, *cost_prev, *weight, *tmp;
+	double x, y, d, rowmin, dist;
+	int i, j, k;
+
+	elasticrows(rows, w, INFINITY);
+	cost = rows + 1;
+	cost_prev = cost + 2 * w + 3;
+	weight = rows + 4 * w + 6;
+	for (k = 0; k <= w; k++)
+		weight[k] = 1 / (1 + exp(-elastic.wdtw_g * (k - n / 2.0)));
+	if (bsf < INFINITY) {
+		dist = sqrt(weight[0] * PRECISION(envelopebound)(s, z, n, w,
+					-1, (int*)(weight + w + 1)));
+		if (FLT_GT(dist, bsf, epsilon))
+			return dist;
+	}
+
+	for (i = 0; i < n; i++) {
+		rowmin = INFINITY;
+		for (k = 0; k < 2 * w + 1; k++)
+			cost[k] = INFINITY;
+		for (j = i - w > 0 ? i - w : 0; j < n && j <= i + w; j++) {
+			k = j - i + w;
+			d = ((double)s[i] - z[j]) * ((double)s[i] - z[j]);
+			d *= weight[i > j ? i - j : j - i];
+			if (i == 0 && j == 0) {
+				cost[k] = d;
+			}
+			else {
+				x = ELASTIC_MIN(cost_prev[k + 1], cost[k - 1]);
+				y = cost_prev[k];
+				cost[k] = ELASTIC_MIN(x, y) + d;
+			}
+			rowmin = ELASTIC_MIN(rowmin, cost[k]);
+		}
+		if (FLT_GT(sqrt(rowmin), bsf, epsilon))
+			return sqrt(rowmin);
+		tmp = cost;
+		cost = cost_prev;
+		cost_prev = tmp;
+	}
+	dist = sqrt(cost_prev[w]);
+	debug(" %.6f\n", dist);
+	return dist;
+}
+
+double PRECISION(erp)(real *s, real *z, int len, double bsf,
+		double epsilon, double *rows)
+{
+	/* Return the Edit Distance with Real Penalty of Chen and Ng, with
+	 * the absolute difference as cost and "g" as the gap value. The cost
+	 * matrix has an extra row and column for the gaps before each
+	 * series. The difference of the sums of the series is a lower bound
+	 */
+	int n = len - 1, w = elasticwindow(n + 1);
+	double *cost, *cost_prev, *tmp;
+	double g = elastic.erp_g, gap, match, rowmin, dist;
+	int i, j, k;
+
+	if (bsf < INFINITY) {
+		dist = 0;
+		for (i = 0; i < n; i++)
+			dist += (double)s[i] - z[i];
+		dist = fabs(dist);
+		if (FLT_GT(dist, bsf, epsilon))
+			return dist;
+	}
+	elasticrows(rows, w, INFINITY);
+	cost = rows + 1;
+	cost_prev = cost + 2 * w + 3;
+
+	/* First row: every observation of "z" against a gap
+	 */
+	cost_prev[w] = 0;
+	for (j = 1; j <= n && j <= w; j++)
+		cost_prev[j + w] = cost_prev[j + w - 1] + fabs(z[j - 1] - g);
+
+	gap = 0;
+	for (i = 1; i <= n; i++) {
+		rowmin = INFINITY;
+		for (k = 0; k < 2 * w + 1; k++)
+			cost[k] = INFINITY;
+		gap += fabs(s[i - 1] - g);
+		if (i <= w) {
+			cost[w - i] = gap;
+			rowmin = gap;
+		}
+		for (j = i - w > 1 ? i - w : 1; j <= n && j <= i + w; j++) {
+			k = j - i + w;
+			match = cost_prev[k] + fabs((double)s[i - 1] - z[j - 1]);
+			cost[k] = ELASTIC_MIN(cost_prev[k + 1] + fabs(s[i - 1] - g),
+					cost[k - 1] + fabs(z[j - 1] - g));
+			cost[k] = ELASTIC_MIN(cost[k], match);
+			rowmin = ELASTIC_MIN(rowmin, cost[k]);
+		}
+		if (FLT_GT(rowmin, bsf, epsilon))
+			return rowmin;
+		tmp = cost;
+		cost = cost_prev;
+		cost_prev = tmp;
+	}
+	dist = cost_prev[w];
+	debug(" %.6f\n", dist);
+	return dist;
+}
+
+double PRECISION(lcss)(real *s, real *z, int len, double bsf,
+		double epsilon, double *rows)
+{
+	/* Return 1 - LCSS / n, where LCSS is the length of the longest common
+	 * subsequence of the series, pairing observations no farther apart
+	 * than "epsilon" (the LCSS threshold, not the float tolerance). The
+	 * number of observations of "s" within the envelope of "z" widened by
+	 * the threshold bounds LCSS, and so does the longest subsequence of
+	 * a row plus one pair per remaining row
+	 */
+	int n = len - 1, w = elasticwindow(n + 1);
+	double *cost, *cost_prev, *tmp;
+	double threshold = elastic.lcss_epsilon, rowmax, dist;
+	int i, j, k;
+
+	if (n < 1)
+		return 0;
+	elasticrows(rows, w, 0);
+	cost = rows + 1;
+	cost_prev = cost + 2 * w + 3;
+	if (bsf < INFINITY) {
+		dist = 1 - PRECISION(envelopebound)(s, z, n, w, threshold,
+				(int*)(rows + 4 * w + 6)) / n;
+		if (FLT_GT(dist, bsf, epsilon))
+			return dist;
+	}
+
+	/* Cells out of the window are 0, which does not change the maxima
+	 */
+	for (i = 1; i <= n; i++) {
+		rowmax = 0;
+		for (k = 0; k < 2 * w + 1; k++)
+			cost[k] = 0;
+		for (j = i - w > 1 ? i - w : 1; j <= n && j <= i + w; j++) {
+			k = j - i + w;
+			if (fabs((double)s[i - 1] - z[j - 1]) <= threshold) {
+				cost[k] = cost_prev[k] + 1;
+			}
+			else {
+				/* The diagonal changes nothing, except when both
+				 * neighbors are out of a window of 0
+				 */
+				cost[k] = cost_prev[k + 1] > cost[k - 1] ?
+					cost_prev[k + 1] : cost[k - 1];
+				if (cost_prev[k] > cost[k])
+					cost[k] = cost_prev[k];
+			}
+			rowmax = rowmax > cost[k] ? rowmax : cost[k];
+		}
+		dist = 1 - (rowmax + n - i) / n;
+		if (FLT_GT(dist, bsf, epsilon))
+			return dist;
+		tmp = cost;
+		cost = cost_prev;
+		cost_prev = tmp;
+	}
+	dist = 1 - cost_prev[w] / n;
+	debug(" %.6f\n", dist);
+	return dist;
+}
+
+double PRECISION(msm)(real *s, real *z, int len, double bsf,
+		double epsilon, double *rows)
+{
+	/* Return the Move-Split-Merge distance of Stefan et al., with cost
+	 * "c" for each split or merge. No lower bound is used
+	 */
+	int n = len - 1, w = elasticwindow(n);
+	double *cost, *cost_prev, *tmp;
+	double c = elastic.msm_c, move, rowmin, dist;
+	int i, j, k;
+
+	elasticrows(rows, w, INFINITY);
+	cost = rows + 1;
+	cost_prev = cost + 2 * w + 3;
+
+	for (i = 0; i < n; i++) {
+		rowmin = INFINITY;
+		for (k = 0; k < 2 * w + 1; k++)
+			cost[k] = INFINITY;
+		for (j = i - w > 0 ? i - w : 0; j < n && j <= i + w; j++) {
+			k = j - i + w;
+			move = fabs((double)s[i] - z[j]);
+			if (i == 0 && j == 0) {
+				cost[k] = move;
+			}
+			else if (i == 0) {
+				cost[k] = cost[k - 1] + msmcost(z[j], s[0], z[j - 1], c);
+			}
+			else if (j == 0) {
+				cost[k] = cost_prev[k + 1] + msmcost(s[i], s[i - 1], z[0], c);
+			}
+			else {
+				cost[k] = ELASTIC_MIN(cost_prev[k] + move,
+						cost_prev[k + 1] + msmcost(s[i], s[i - 1], z[j], c));
+				cost[k] = ELASTIC_MIN(cost[k],
+						cost[k - 1] + msmcost(z[j], s[i], z[j - 1], c));
+			}
+			rowmin = ELASTIC_MIN(rowmin, cost[k]);
+		}
+		if (FLT_GT(rowmin, bsf, epsilon))
+			return rowmin;
+		tmp = cost;
+		cost = cost_prev;
+		cost_prev = tmp;
+	}
+	dist = cost_prev[w];
+	debug(" %.6f\n", dist);
+	return dist;
+}
+
+double PRECISION(twe)(real *s, real *z, int len, double bsf,
+		double epsilon, double *rows)
+{
+	/* Return the Time Warp Edit distance of Marteau, with stiffness "nu"
+	 * and penalty "lambda", taking the index of each observation as its
+	 * time stamp. Both series are preceded by a 0, as in the original
+	 * implementation. No lower bound is used
+	 */
+	int n = len - 1, w = elasticwindow(n + 1);
+	double *cost, *cost_prev, *tmp;
+	double nu = elastic.twe_nu, lambda = elastic.twe_lambda;
+	double si, sprev, zj, zprev, match, rowmin, dist;
+	int i, j, k;
+
+	elasticrows(rows, w, INFINITY);
+	cost = rows + 1;
+	cost_prev = cost + 2 * w + 3;
+	cost_prev[w] = 0;
+
+	for (i = 1; i <= n; i++) {
+		rowmin = INFINITY;
+		si = s[i - 1];
+		sprev = i > 1 ? s[i - 2] : 0;
+		for (k = 0; k < 2 * w + 1; k++)
+			cost[k] = INFINITY;
+		for (j = i - w > 1 ? i - w : 1; j <= n && j <= i + w; j++) {
+			k = j - i + w;
+			zj = z[j - 1];
+			zprev = j > 1 ? z[j - 2] : 0;
+			match = cost_prev[k] + fabs(si - zj) + fabs(sprev - zprev) +
+				2 * nu * (i > j ? i - j : j - i);
+			cost[k] = ELASTIC_MIN(
+					cost_prev[k + 1] + fabs(si - sprev) + nu + lambda,
+					cost[k - 1] + fabs(zj - zprev) + nu + lambda);
+			cost[k] = ELASTIC_MIN(cost[k], match);
+			rowmin = ELASTIC_MIN(rowmin, cost[k]);
+		}
+		if (FLT_GT(rowmin, bsf, epsilon))
+			return rowmin;
+		tmp = cost;
+		cost = cost_prev;
+		cost_prev = tmp;
+	}
+	dist = cost_prev[w];
+	debug(" %.6f\n", dist);
+	return dist;
+}
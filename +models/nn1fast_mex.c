@@ -5,19 +5,19 @@
  */
 
 /* This file is part of TimeBox. Copyright 2015-17 Rafael Giusti
- * Revision 0.1.0
+ * Revision 0.8.3
  */
 
 #include "mex.h"
 
 #include <math.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #define DEBUG 0
 
 #if DEBUG
-#include <stdio.h>
 #define DEBUG_PATH "/tmp/timebox-nn1_mex-debug.txt"
 FILE *__debug_file = NULL;
 #define debug(...) do { \
@@ -57,61 +57,155 @@ FILE *__debug_file = NULL;
 #define FLT_GT(_flt1, _flt2, _eps) \
 	(fabs((_flt1) - (_flt2)) > (_eps) && (_flt1) > (_flt2))
 
+/* The distance functions and the search are compiled once for series of
+ * double and once for series of single
+ */
+#define real double
+#define PRECISION(_name) _name
+#include "nn1fast_distances.c"
+#undef real
+#undef PRECISION
+
+#define real float
+#define PRECISION(_name) _name ## _single
 #include "nn1fast_distances.c"
+#undef real
+#undef PRECISION
 
-int nn1fast(double *stack, double *needle, int nseries, int len,
-		int skipindex, double epsilon, double *bestidx,
-		distancefunction distfun, double *distance)
+/* Read the instruction set from field "simd" of the parameters struct, if
+ * present
+ */
+static int readsimd(const mxArray *params)
 {
-	double *test;
-	double bsf = INFINITY;
-	double dist;
-	int current;
-	int neighbors = 0;
+	mxArray *field;
+	char buf[16];
+	int simd;
 
- 	debug("Called nn1fast(PTR, PTR, %d, %d, %d, %e, PTR, PTR, PTR)\n", 
-			nseries, len, skipindex, epsilon); 
+	if (!params || !(field = mxGetField(params, 0, "simd")))
+		return NN1_AUTO;
+	if (!mxIsChar(field) || mxGetString(field, buf, sizeof buf)) {
+		mexErrMsgTxt("Parameter \"simd\" must be a string");
+	}
+	if (!strcmp(buf, "auto"))
+		return NN1_AUTO;
+	if (!strcmp(buf, "scalar"))
+		simd = NN1_SCALAR;
+	else if (!strcmp(buf, "avx2"))
+		simd = NN1_AVX2;
+	else if (!strcmp(buf, "avx512"))
+		simd = NN1_AVX512;
+	else {
+		mexErrMsgTxt("Parameter \"simd\" must be one of \"auto\", "
+				"\"scalar\", \"avx2\", or \"avx512\"");
+		return NN1_AUTO;
+	}
+	if (!nn1simdsupported(simd)) {
+		char msg[1024];
+		sprintf(msg, "This processor does not support the instruction "
+				"set \"%s\"", buf);
+		mexErrMsgTxt(msg);
+	}
+	return simd;
+}
 
-	/* Skip the needle class and point the test pointer to the first
-	 * instance
-	 */
-	needle++;
-	test = stack + 1;
+/* Names of the kinds of statistics, for the field "kind" of STATS
+ */
+static const char *statsnames[] = { "", "norm1", "norm2", "logabs", "sqrt" };
 
-	/* Calculate the squared distance from the needle to all series
-	 */
-	current = 1;
-	while (current <= nseries) {
-		/* Allow in-loco classification
-		 */
-		if (current == skipindex) {
-			current++;
-			seekstack(test, stack, current, len);
-			continue;
-		}
-		
-		debug("Distance #%d: ", current);
-		dist = distfun(test, needle, len, bsf, epsilon);
-		if (FLT_GT(bsf, dist, epsilon)) {
-			/* Distance to nearest neighbor got smaller
-			*/
-			bsf = dist;
-			bestidx[0] = current;
-			neighbors = 1;
-		}
-		else if (!FLT_GT(dist, bsf, epsilon)) {
-			/* Another instance just as far from the previous
-			 * neighbors
-			 */
-			bestidx[neighbors++] = current;
-		}
-		
-		current++;
-		seekstack(test, stack, current, len);
+/* Read the dimensions of the stack, for the stats mode
+ */
+static void readstack(const mxArray *arg, int native, int *nseries, int *len)
+{
+	*nseries = native ? mxGetM(arg) : mxGetN(arg);
+	*len = native ? mxGetN(arg) : mxGetM(arg);
+	if (!(mxIsDouble(arg) || mxIsSingle(arg)) || mxIsComplex(arg) ||
+			*len <= 1) {
+		mexErrMsgTxt("STACK must be a non-complex matrix of double or "
+				"single");
+	}
+}
+
+/* Compute the statistics of every series of the stack for a distance
+ *
+ *     stats = mexFunction('stats', stack, distcode[, native])
+ *
+ * For the distances with statistics, STATS is a struct with the fields
+ * "kind", the name of the statistics, and "values", a matrix of double with
+ * the statistics of one series per column. For any other distance code,
+ * STATS is the empty matrix [], which the searches accept as no statistics
+ */
+static void statsmode(int nleft, mxArray *left[], int nright,
+		const mxArray *right[])
+{
+	const char *fields[] = { "kind", "values" };
+	int nseries, len, kind, native = 0, error;
+	mxArray *values;
+
+	if (nright < 3 || nright > 4)
+		mexErrMsgTxt("Three or four inputs required in 'stats' mode.");
+	if (nleft > 1)
+		mexErrMsgTxt("One output required in 'stats' mode.");
+	if (nright == 4)
+		native = mxGetScalar(right[3]) != 0;
+	readstack(right[1], native, &nseries, &len);
+	if (!mxIsDouble(right[2]) || mxGetNumberOfElements(right[2]) != 1)
+		mexErrMsgTxt("DISTCODE must be a scalar");
+	kind = nn1statskind(mxGetScalar(right[2]));
+	if (kind == NN1_NOSTATS) {
+		left[0] = mxCreateDoubleMatrix(0, 0, mxREAL);
+		return;
 	}
 
-	*distance = bsf;
-	return neighbors;
+	values = mxCreateDoubleMatrix(nn1statsrows(kind, len), nseries,
+			mxREAL);
+	if (mxIsSingle(right[1])) {
+		error = stackstats_single(kind, mxGetData(right[1]), nseries,
+				len, native, mxGetPr(values));
+	}
+	else {
+		error = stackstats(kind, mxGetPr(right[1]), nseries, len,
+				native, mxGetPr(values));
+	}
+	if (error) {
+		mxDestroyArray(values);
+		mexErrMsgTxt("Error allocating memory\n");
+	}
+	left[0] = mxCreateStructMatrix(1, 1, 2, fields);
+	mxSetField(left[0], 0, "kind", mxCreateString(statsnames[kind]));
+	mxSetField(left[0], 0, "values", values);
+}
+
+/* Read the statistics of the stack from STATS, as returned by the stats
+ * mode. Return NULL if STATS is empty
+ */
+static const double *readstats(const mxArray *arg, int distcode,
+		int nseries, int len)
+{
+	mxArray *kind = NULL, *values = NULL;
+	char buf[16];
+	int expected = nn1statskind(distcode);
+
+	if (mxIsEmpty(arg))
+		return NULL;
+	if (!mxIsStruct(arg) || mxGetNumberOfElements(arg) != 1 ||
+			!(kind = mxGetField(arg, 0, "kind")) ||
+			!(values = mxGetField(arg, 0, "values")) ||
+			!mxIsChar(kind) ||
+			mxGetString(kind, buf, sizeof buf)) {
+		mexErrMsgTxt("Eighth input (STATS) must be a struct returned "
+				"by the 'stats' mode");
+	}
+	if (expected == NN1_NOSTATS || strcmp(buf, statsnames[expected])) {
+		mexErrMsgTxt("Eighth input (STATS) was computed for another "
+				"distance");
+	}
+	if (!mxIsDouble(values) || mxIsComplex(values) ||
+			mxGetM(values) != nn1statsrows(expected, len) ||
+			mxGetN(values) != nseries) {
+		mexErrMsgTxt("Eighth input (STATS) was computed for another "
+				"stack");
+	}
+	return mxGetPr(values);
 }
 
 void mexFunction(int nleft, mxArray *left[], int nright, const mxArray *right[])
@@ -120,17 +214,32 @@ void mexFunction(int nleft, mxArray *left[], int nright, const mxArray *right[])
 	 *  Usage:
 	 *
 	 *     [bestidx, distance] = mexFunction(stack, needle, distcode, ...
-	 *                                       skipindex, epsilon);
+	 *                                       skipindex, epsilon[, params[, ...
+	 *                                       native[, stats]]]);
+	 *     stats = mexFunction('stats', stack, distcode[, native]);
 	 *
 	 *  Where the input arguments are:
 	 *
-	 *     stack     - the data set*
-	 *     needle    - the test instance
+	 *     stack     - the data set* (DOUBLE or SINGLE)
+	 *     needle    - the test instance, of the same class as the stack
 	 *     distcode  - the ID distance function ID
 	 *     skipindex - if the test instance is contained in the data set,
 	 *                 skipindex must be the instance of the test instance;
 	 *                 otherwise it should be -1
 	 *     epsilon   - tolerance threshold for float operations
+	 *     params    - optional scalar struct with the parameters of the
+	 *                 elastic distances (codes 60 to 66), with the fields
+	 *                 window (default Inf), wdtw_g (0.05), erp_g (0),
+	 *                 lcss_epsilon (1), msm_c (1), twe_nu (0.001) and
+	 *                 twe_lambda (1); see nn1fast_elastic.c. Its field
+	 *                 minkowski_p (2) is the exponent of Minkowski (code
+	 *                 4), and simd ('auto') sets the instruction set of
+	 *                 the other distances: 'scalar', 'avx2', or 'avx512'
+	 *     native    - optional logical scalar: if true, the stack is in the
+	 *                 layout of TimeBox (default: false)
+	 *     stats     - optional statistics of the stack, as returned by the
+	 *                 'stats' mode (a struct, or [] for a distance with no
+	 *                 statistics)
 	 *
 	 *  And the output arguments are:
 	 *
@@ -141,6 +250,11 @@ void mexFunction(int nleft, mxArray *left[], int nright, const mxArray *right[])
 	 *  TimeBox data sets contains instances in rows and observations in
 	 *  columns. This mex requires the instances in the columns and the
 	 *  observations in the rows. The first row is, therefore, the classes.
+	 *
+	 *  With NATIVE, the stack is instead read as TimeBox stores it, with
+	 *  the instances in the rows and the classes in the first column, so
+	 *  it need not be transposed: the series are copied a small block at a
+	 *  time as the search goes.
 	 *  
 	 *  Example usage:
 	 *
@@ -148,61 +262,127 @@ void mexFunction(int nleft, mxArray *left[], int nright, const mxArray *right[])
 	 *     needle = test(1, :);
 	 *     [bestidx, distance] = mexFunction(stack', needle, 3, -1, 1e-10)
 	 *
-	 *  This runs the 1-NN with Chebyshev distance (L_inf norm).
+	 *  This runs the 1-NN with Chebyshev distance (L_inf norm). This
+	 *  does the same without transposing the data set:
+	 *
+	 *     [bestidx, distance] = mexFunction(stack, needle, 3, -1, ...
+	 *                                       1e-10, struct(), true)
 	 * 
 	 *  The data set is transformed into the expected notation with stack'.
 	 *  The test instance should be kept a row vector.
+	 *
+	 *  If the stack and the needle are SINGLE, the observations are read
+	 *  in single precision, which halves the memory read for every
+	 *  candidate, but distances are still summed in double precision.
+	 *
+	 *  By default, the distances that are not elastic are calculated with
+	 *  the widest vector instructions of the processor, found when the
+	 *  MEX is first called. They may differ from those of the scalar code
+	 *  in the last few digits, as explained in nn1fast_simd.c.
+	 *
+	 *  Sorensen, cosine, Jaccard, Dice, Kullback-Leibler, Jeffrey's,
+	 *  Bhattacharyya and Hellinger need the norm, or the logarithm or
+	 *  the square root of every observation, of each series. With the
+	 *  'stats' mode, these are computed once for all series of a stack,
+	 *  to be passed as STATS to every search of that stack:
+	 *
+	 *     stats = mexFunction('stats', stack, 40, true);
+	 *     [bestidx, distance] = mexFunction(stack, needle, 40, -1, ...
+	 *                                       1e-10, struct(), true, stats)
+	 *
+	 *  The searches with STATS then compute only the terms that involve
+	 *  both series, and those of Sorensen, cosine, Jaccard and Dice are
+	 *  abandoned early; see nn1fast_distances.c. They use no vector
+	 *  instructions. For the other distances, the 'stats' mode returns
+	 *  the empty matrix [] instead of a struct, and a search given [] as
+	 *  STATS is the same as one without it.
 	 */
 
 	int nseries, len;
-	double *stack, *needle;
+	void *stack, *needle;
+	int single;
+	int native;
 	int distcode;
+	int simd;
 	int skipindex;
 	double epsilon;
 	double *bestidx_large, *bestidx, distance;
 	int numneighbors;
-	distancefunction distfun;
+	searchfunction search;
+	searchfunction_single search_single;
+	statssearchfunction statssearch = NULL;
+	statssearchfunction_single statssearch_single = NULL;
+	const double *stats = NULL;
+	double *needlestats = NULL;
+
+	if (nright >= 1 && mxIsChar(right[0])) {
+		char mode[8];
+		if (mxGetString(right[0], mode, sizeof mode) ||
+				strcmp(mode, "stats")) {
+			mexErrMsgTxt("The only mode supported is 'stats'");
+		}
+		statsmode(nleft, left, nright, right);
+		return;
+	}
 
 	start_debugger();
 	debug("Started mexFunction\n\n");
 	debug("Verifying input/output arguments\n");
 
-	if (nright != 5) {
-		debug("Got %d inputs (expected 5)\n", nright);
-		mexErrMsgTxt("Five inputs required.");
+	if (nright < 5 || nright > 8) {
+		debug("Got %d inputs (expected 5 to 8)\n", nright);
+		mexErrMsgTxt("Five to eight inputs required.");
+	}
+
+	/* Seventh argument, if present, tells the layout of the stack
+	 */
+	native = 0;
+	if (nright >= 7) {
+		if (!(mxIsDouble(right[6]) || mxIsLogical(right[6])) ||
+				mxGetNumberOfElements(right[6]) != 1) {
+			mexErrMsgTxt("Seventh input (NATIVE) must be a logical "
+					"scalar");
+		}
+		native = mxGetScalar(right[6]) != 0;
 	}
 	if (nleft != 2) {
 		debug("Got %d outputs (expected 2)\n", nleft);
 		mexErrMsgTxt("Two outputs required.");
 	}
 
-	/* First argument must be a non-complex matrix of double
+	/* First argument must be a non-complex matrix of double or single
 	*/
-	nseries = mxGetN(right[0]);
-	len = mxGetM(right[0]);
-	if (!mxIsDouble(right[0]) || mxIsComplex(right[0]) || len <= 1) {
-		debug("First input error\nmxIsDouble: %d, mxIsComplex: %d, "
-				"len: %d\n", mxIsDouble(right[0]),
+	nseries = native ? mxGetM(right[0]) : mxGetN(right[0]);
+	len = native ? mxGetN(right[0]) : mxGetM(right[0]);
+	single = mxIsSingle(right[0]);
+	if (!(mxIsDouble(right[0]) || single) || mxIsComplex(right[0]) ||
+			len <= 1) {
+		debug("First input error\nmxIsDouble: %d, mxIsSingle: %d, "
+				"mxIsComplex: %d, len: %d\n",
+				mxIsDouble(right[0]), single,
 				mxIsComplex(right[0]), len);
 		mexErrMsgTxt("First input (STACK) must be a non-complex "
-				"matrix of double");
+				"matrix of double or single");
 	}
-	stack = mxGetPr(right[0]);
+	stack = mxGetData(right[0]);
 	debug("Stack: %d series of lenght %d\n", nseries, len);
 
-	/* Second argument must be a non-complex row array of double
+	/* Second argument must be a non-complex row array of the same class
+	 * as the first
 	*/
 	if (mxGetM(right[1]) != 1 || mxGetN(right[1]) != len ||
-			!mxIsDouble(right[1]) || mxIsComplex(right[1])) {
-		debug("Second input error\nmxIsDouble: %d, mxIsComplex: %d, "
-				"mxGetM: %zu, mxGetN: %zu\n",
-				mxIsDouble(right[1]), mxIsComplex(right[1]),
-				mxGetM(right[1]), mxGetN(right[1]));
+			mxGetClassID(right[1]) != mxGetClassID(right[0]) ||
+			mxIsComplex(right[1])) {
+		debug("Second input error\nmxIsDouble: %d, mxIsSingle: %d, "
+				"mxIsComplex: %d, mxGetM: %zu, mxGetN: %zu\n",
+				mxIsDouble(right[1]), mxIsSingle(right[1]),
+				mxIsComplex(right[1]), mxGetM(right[1]),
+				mxGetN(right[1]));
 		mexErrMsgTxt("Second input (NEEDLE) must be a non-complex "
-				"row array of double with same number of "
-				"elements as the first input");
+				"row array of the same class as the first input "
+				"and with same number of elements");
 	}
-	needle = mxGetPr(right[1]);
+	needle = mxGetData(right[1]);
 	debug("Needle: ok\n"); 
 
 	/* Third argument must be a scalar
@@ -240,9 +420,41 @@ void mexFunction(int nleft, mxArray *left[], int nright, const mxArray *right[])
 	epsilon = mxGetScalar(right[4]);
 	debug("epsilon == %e\n", epsilon);
 
-	/* Select the distance function
+	/* Sixth argument, if present, must be a struct
+	 */
+	readelasticparams(nright >= 6 ? right[5] : NULL);
+	simd = readsimd(nright >= 6 ? right[5] : NULL);
+
+	/* Select the search compiled for the distance function
+	 */
+	if (single) {
+		search_single = selectsearch_single(distcode, simd);
+	}
+	else {
+		search = selectsearch(distcode, simd);
+	}
+
+	/* Eighth argument, if present, has the statistics of the stack. The
+	 * search with them also needs those of the needle
 	 */
-	distfun = selectdistance(distcode);
+	if (nright == 8)
+		stats = readstats(right[7], distcode, nseries, len);
+	if (stats) {
+		int kind = nn1statskind(distcode);
+		needlestats = malloc(sizeof (double) * nn1statsrows(kind, len));
+		if (!needlestats)
+			mexErrMsgTxt("Error allocating memory\n");
+		if (single) {
+			seriesstats_single(kind, (float *)needle + 1, len,
+					needlestats);
+			statssearch_single = selectstatssearch_single(distcode);
+		}
+		else {
+			seriesstats(kind, (double *)needle + 1, len,
+					needlestats);
+			statssearch = selectstatssearch(distcode);
+		}
+	}
 
 	/* Make room for the maximum possible number of neighbors (all of them)
 	*/
@@ -250,6 +462,7 @@ void mexFunction(int nleft, mxArray *left[], int nright, const mxArray *right[])
 	if (!bestidx_large) {
 		debug("Could not allocate %zu bytes for %d neighbors\n", 
 				sizeof (double) * nseries, nseries);
+		free(needlestats);
 		mexErrMsgTxt("Error allocating memory\n");
 	}
 
@@ -258,8 +471,30 @@ void mexFunction(int nleft, mxArray *left[], int nright, const mxArray *right[])
 	debug("Input ok\n\n");	
 	debug("Running 1-NN with generic distance\n");
 
-	numneighbors = nn1fast(stack, needle, nseries, len, skipindex,
-			epsilon, bestidx_large, distfun, &distance);
+	if (statssearch_single) {
+		numneighbors = statssearch_single(stack, needle, nseries, len,
+				native, skipindex, epsilon, stats, needlestats,
+				bestidx_large, &distance);
+	}
+	else if (statssearch) {
+		numneighbors = statssearch(stack, needle, nseries, len, native,
+				skipindex, epsilon, stats, needlestats,
+				bestidx_large, &distance);
+	}
+	else if (single) {
+		numneighbors = search_single(stack, needle, nseries, len,
+				native, skipindex, epsilon, bestidx_large,
+				&distance);
+	}
+	else {
+		numneighbors = search(stack, needle, nseries, len, native,
+				skipindex, epsilon, bestidx_large, &distance);
+	}
+	free(needlestats);
+	if (numneighbors < 0) {
+		free(bestidx_large);
+		mexErrMsgTxt("Error allocating memory\n");
+	}
 
 	/* The 1-NN with Euclidean distance actually uses the Euclidean distance
 	 * squared; fixes that here.
@@ -0,0 +1,575 @@
+/* This file contains the vectorized distances of nn1fast_mex.c. It is
+ * #included by nn1fast_distances.c once per instruction set, for each
+ * precision, with the macros of that file and these defined:
+ *
+ *     SIMD_SUFFIX   suffix of the kernel names (e.g., avx2)
+ *     SIMD_WIDTH    number of doubles in a vector register
+ *     SIMD_SQRT(x)  square root of a vector of doubles
+ *     SIMD_CVT(p)   SIMD_WIDTH floats at p converted to a vector of doubles
+ *
+ * and with the instruction set enabled by "#pragma GCC target".
+ *
+ * Every distance of nn1fast_distances.c has a version here, with the same
+ * arguments. The observations are converted to double and SIMD_WIDTH of
+ * them are processed at a time, with GCC vector extensions. The results
+ * differ from those of the scalar code as follows:
+ *
+ *   - Each lane keeps its own partial sums, which are added together at
+ *     the end, so the terms are summed in a different order. A sum of n
+ *     terms may differ by a few units in the last place times log2(n),
+ *     which is well below the usual epsilon for non-negative terms, but
+ *     may be larger for distances whose terms cancel (Pearson, squared
+ *     Chi-Square, Kullback-Leibler).
+ *
+ *   - Single precision observations are converted to double before any
+ *     arithmetic, whereas the scalar code takes their difference or
+ *     product in single precision. The vectorized distances are then the
+ *     more accurate of the two.
+ *
+ *   - The logarithm is computed by log_(), a vectorized version of the
+ *     log() of fdlibm, which is within 1 ulp of the exact result. Square
+ *     roots use the instruction of the processor, which is exact, as is
+ *     sqrt().
+ *
+ *   - Chebyshev is the exact maximum. The scalar code only raises its
+ *     maximum for a difference larger than it by more than epsilon, so it
+ *     may return a distance up to epsilon smaller.
+ *
+ * The early abandoning distances compare their sum with the best so far
+ * once every SIMD_CHECK observations, and so does the average of
+ * Manhattan and Chebyshev, which the scalar code never abandons. The sums
+ * never decrease, so a candidate is abandoned only if its whole distance
+ * would be farther than the best so far.
+ */
+
+/* This file is part of TimeBox. Copyright 2015-17 Rafael Giusti
+ * Revision 0.2.0
+ */
+
+#define SIMD_CAT2(_a, _b) _a ## _b
+#define SIMD_CAT(_a, _b) SIMD_CAT2(_a, _b)
+#define SIMD_NAME(_name) SIMD_CAT(_name, SIMD_SUFFIX)
+#define SIMD_EXPAND(_macro, _name) _macro(_name)
+#define SIMD_KERNEL(_name) SIMD_EXPAND(PRECISION, SIMD_NAME(_name))
+
+/* Two vectors are summed per step. Adding up the lanes to compare the sum
+ * with the best so far takes a few instructions, so it is done less often
+ * than by the scalar code, once every SIMD_CHECK observations, a multiple
+ * of the step
+ */
+#define SIMD_STEP (2 * SIMD_WIDTH)
+#define SIMD_CHECK 64
+
+typedef double SIMD_KERNEL(vec_) __attribute__ ((vector_size (SIMD_WIDTH * sizeof (double))));
+typedef long long SIMD_KERNEL(mask_) __attribute__ ((vector_size (SIMD_WIDTH * sizeof (long long))));
+typedef SIMD_KERNEL(vec_) (*SIMD_KERNEL(term_))(SIMD_KERNEL(vec_),
+		SIMD_KERNEL(vec_), double);
+#define vec SIMD_KERNEL(vec_)
+#define mask SIMD_KERNEL(mask_)
+
+/* Lanes of "_a" where "_m" is set and of "_b" elsewhere
+ */
+#define vselect(_m, _a, _b) \
+	((vec)(((mask)(_m) & (mask)(_a)) | (~(mask)(_m) & (mask)(_b))))
+#define vabs(_x) ((vec)((mask)(_x) & 0x7fffffffffffffffLL))
+
+/* Load SIMD_WIDTH observations, or the first "count" of them and zeros
+ */
+static NN1_INLINE vec SIMD_KERNEL(load_)(const real *p)
+{
+	vec x;
+
+	if (sizeof (real) == sizeof (double))
+		memcpy(&x, p, sizeof x);
+	else
+		x = SIMD_CVT((const float *)p);
+	return x;
+}
+
+static NN1_INLINE vec SIMD_KERNEL(loadtail_)(const real *p, int count)
+{
+	vec x = { 0 };
+	int v;
+
+	for (v = 0; v < count; v++)
+		x[v] = p[v];
+	return x;
+}
+
+/* Mask of the first "count" lanes
+ */
+static NN1_INLINE mask SIMD_KERNEL(tailmask_)(int count)
+{
+	mask m = { 0 };
+	int v;
+
+	for (v = 0; v < count; v++)
+		m[v] = -1;
+	return m;
+}
+
+static NN1_INLINE double SIMD_KERNEL(hsum_)(vec x)
+{
+	double sum = 0;
+	int v;
+
+	for (v = 0; v < SIMD_WIDTH; v++)
+		sum += x[v];
+	return sum;
+}
+
+static NN1_INLINE double SIMD_KERNEL(hmax_)(vec x)
+{
+	double max = 0;
+	int v;
+
+	for (v = 0; v < SIMD_WIDTH; v++) {
+		if (x[v] > max)
+			max = x[v];
+	}
+	return max;
+}
+
+/* Natural logarithm of every lane, following __ieee754_log() of fdlibm:
+ * x = 2^k * (1 + f), with 1 + f in [sqrt(2)/2, sqrt(2)), and
+ * log(1 + f) = f - f^2/2 + s * (f^2/2 + R(s^2)), with s = f / (2 + f) and R
+ * a minimax polynomial. Zero, negative numbers, infinity and NaN give the
+ * same results as log()
+ */
+static NN1_INLINE vec SIMD_KERNEL(log_)(vec x)
+{
+	const double ln2_hi = 6.93147180369123816490e-01;
+	const double ln2_lo = 1.90821492927058770002e-10;
+	const double Lg1 = 6.666666666666735130e-01;
+	const double Lg2 = 3.999999999940941908e-01;
+	const double Lg3 = 2.857142874366239149e-01;
+	const double Lg4 = 2.222219843214978396e-01;
+	const double Lg5 = 1.818357216161805012e-01;
+	const double Lg6 = 1.531383769920937332e-01;
+	const double Lg7 = 1.479819860511658591e-01;
+	vec zero = { 0 };
+	vec f, hfsq, s, z, w, r, k, special;
+	mask u, subnormal, e;
+
+	/* Subnormal numbers are scaled into the normal range by 2^54
+	 */
+	subnormal = (mask)(x < 2.2250738585072014e-308);
+	x = vselect(subnormal, x * 18014398509481984.0, x);
+
+	/* Exponent and mantissa, with the mantissa moved into
+	 * [sqrt(2)/2, sqrt(2)) and the exponent adjusted to match
+	 */
+	u = (mask)x + ((0x3ff00000LL - 0x3fe6a09eLL) << 32);
+	e = (u >> 52) - 0x3ff - (subnormal & 54);
+	u = (u & 0x000fffffffffffffLL) + (0x3fe6a09eLL << 32);
+
+	/* The exponent is converted to double through the bits of 2^52 +
+	 * 2^51 + e
+	 */
+	k = (vec)(e + 0x4338000000000000LL) - 6755399441055744.0;
+
+	f = (vec)u - 1.0;
+	hfsq = 0.5 * f * f;
+	s = f / (2.0 + f);
+	z = s * s;
+	w = z * z;
+	r = z * (Lg1 + w * (Lg3 + w * (Lg5 + w * Lg7))) +
+		w * (Lg2 + w * (Lg4 + w * Lg6));
+	r = s * (hfsq + r) + k * ln2_lo - hfsq + f + k * ln2_hi;
+
+	special = vselect(x == zero, zero - INFINITY,
+			vselect(x < zero, zero + NAN, x));
+	return vselect((mask)(x > zero) & (mask)(x < INFINITY), r, special);
+}
+
+/* The terms of the distances that are sums of one term per observation
+ */
+static NN1_INLINE vec SIMD_KERNEL(euclidean2term_)(vec x, vec y,
+		double epsilon)
+{
+	vec d = x - y;
+	return d * d;
+}
+
+static NN1_INLINE vec SIMD_KERNEL(manhattanterm_)(vec x, vec y,
+		double epsilon)
+{
+	return vabs(x - y);
+}
+
+static NN1_INLINE vec SIMD_KERNEL(canberraterm_)(vec x, vec y,
+		double epsilon)
+{
+	vec u = vabs(x - y);
+	vec b = vabs(x) + vabs(y);
+	return vselect(b < epsilon, u, u / b);
+}
+
+static NN1_INLINE vec SIMD_KERNEL(lorentzianterm_)(vec x, vec y,
+		double epsilon)
+{
+	return SIMD_KERNEL(log_)(1.0 + vabs(x - y));
+}
+
+static NN1_INLINE vec SIMD_KERNEL(pearsonterm_)(vec x, vec y,
+		double epsilon)
+{
+	vec d = x - y;
+	return vselect(vabs(y) < epsilon, x * x, d * d / y);
+}
+
+static NN1_INLINE vec SIMD_KERNEL(squared_chiterm_)(vec x, vec y,
+		double epsilon)
+{
+	vec d = x - y;
+	vec den = x + y;
+	return vselect(vabs(den) < epsilon, d * d, d * d / den);
+}
+
+static NN1_INLINE vec SIMD_KERNEL(kullbackterm_)(vec x, vec y,
+		double epsilon)
+{
+	vec zero = { 0 };
+	vec sz = x * y;
+	mask positive = (mask)(vabs(sz) > epsilon) & (mask)(sz > zero);
+	return vselect(positive, x * SIMD_KERNEL(log_)(x / y), x);
+}
+
+static NN1_INLINE vec SIMD_KERNEL(jeffreyterm_)(vec x, vec y,
+		double epsilon)
+{
+	vec zero = { 0 };
+	vec sz = x * y;
+	mask positive = (mask)(vabs(sz) > epsilon) & (mask)(sz > zero);
+	return vselect(positive, (x - y) * SIMD_KERNEL(log_)(x / y), zero);
+}
+
+static NN1_INLINE vec SIMD_KERNEL(sqrtterm_)(vec x, vec y,
+		double epsilon)
+{
+	/* sqrt(s * z) of Bhattacharyya and Hellinger, which is NaN, as in
+	 * the scalar code, for products in (-epsilon, 0)
+	 */
+	vec zero = { 0 };
+	vec sz = x * y;
+	mask positive = (mask)(vabs(sz) < epsilon) | (mask)(sz > zero);
+	return vselect(positive, SIMD_SQRT(sz), zero);
+}
+
+/* Sum of "term" over the observations. If "abandon" is set, the terms
+ * must not be negative and the sum is abandoned once it is larger than
+ * "bsf". This is always inlined, so "term" is too
+ */
+static NN1_INLINE double SIMD_KERNEL(sum_)(real *s, real *z, int len,
+		double bsf, double epsilon, SIMD_KERNEL(term_) term,
+		int abandon)
+{
+	vec acc0 = { 0 }, acc1 = { 0 }, zero = { 0 };
+	double dist;
+	int i, n = len - 1;
+
+	for (i = 0; i + SIMD_STEP <= n; i += SIMD_STEP) {
+		acc0 += term(SIMD_KERNEL(load_)(s + i),
+				SIMD_KERNEL(load_)(z + i), epsilon);
+		acc1 += term(SIMD_KERNEL(load_)(s + i + SIMD_WIDTH),
+				SIMD_KERNEL(load_)(z + i + SIMD_WIDTH),
+				epsilon);
+		if (abandon && (i + SIMD_STEP) % SIMD_CHECK == 0) {
+			dist = SIMD_KERNEL(hsum_)(acc0 + acc1);
+			if (FLT_GT(dist, bsf, epsilon)) {
+				debug(" %.6f (early abandoned)\n", dist);
+				return dist;
+			}
+		}
+	}
+	for (; i < n; i += SIMD_WIDTH) {
+		int count = n - i < SIMD_WIDTH ? n - i : SIMD_WIDTH;
+		vec t = term(SIMD_KERNEL(loadtail_)(s + i, count),
+				SIMD_KERNEL(loadtail_)(z + i, count), epsilon);
+		acc0 += vselect(SIMD_KERNEL(tailmask_)(count), t, zero);
+	}
+	dist = SIMD_KERNEL(hsum_)(acc0 + acc1);
+	debug(" %.6f\n", dist);
+	return dist;
+}
+
+#define SIMD_SUM(_name, _term, _abandon) \
+static double SIMD_KERNEL(_name)(real *s, real *z, int len, double bsf, \
+		double epsilon) \
+{ \
+	return SIMD_KERNEL(sum_)(s, z, len, bsf, epsilon, \
+			SIMD_KERNEL(_term), _abandon); \
+}
+
+SIMD_SUM(euclidean2_, euclidean2term_, 1)
+SIMD_SUM(manhattan_, manhattanterm_, 1)
+SIMD_SUM(canberra_, canberraterm_, 1)
+SIMD_SUM(lorentzian_, lorentzianterm_, 1)
+SIMD_SUM(pearson_, pearsonterm_, 0)
+SIMD_SUM(squared_chi_, squared_chiterm_, 0)
+SIMD_SUM(kullback_, kullbackterm_, 0)
+SIMD_SUM(jeffrey_, jeffreyterm_, 0)
+
+#undef SIMD_SUM
+
+static double SIMD_KERNEL(chebyshev_)(real *s, real *z, int len,
+		double bsf, double epsilon)
+{
+	vec max = { 0 }, d;
+	double dist;
+	int i, count, n = len - 1;
+
+	for (i = 0; i < n; i += SIMD_WIDTH) {
+		count = n - i < SIMD_WIDTH ? n - i : SIMD_WIDTH;
+		if (count == SIMD_WIDTH) {
+			d = vabs(SIMD_KERNEL(load_)(s + i) -
+					SIMD_KERNEL(load_)(z + i));
+		}
+		else {
+			d = vabs(SIMD_KERNEL(loadtail_)(s + i, count) -
+					SIMD_KERNEL(loadtail_)(z + i, count));
+		}
+		max = vselect(d > max, d, max);
+		if ((i + SIMD_WIDTH) % SIMD_CHECK == 0) {
+			dist = SIMD_KERNEL(hmax_)(max);
+			if (FLT_GT(dist, bsf, epsilon)) {
+				debug(" %.6f (early abandoned)\n", dist);
+				return dist;
+			}
+		}
+	}
+	dist = SIMD_KERNEL(hmax_)(max);
+	debug(" %.6f\n", dist);
+	return dist;
+}
+
+static double SIMD_KERNEL(avg_l1_linf_)(real *s, real *z, int len,
+		double bsf, double epsilon)
+{
+	/* Manhattan and Chebyshev in one pass. Both never decrease, so
+	 * neither does their average
+	 */
+	vec sum = { 0 }, max = { 0 }, d;
+	double dist;
+	int i, count, n = len - 1;
+
+	for (i = 0; i < n; i += SIMD_WIDTH) {
+		count = n - i < SIMD_WIDTH ? n - i : SIMD_WIDTH;
+		if (count == SIMD_WIDTH) {
+			d = vabs(SIMD_KERNEL(load_)(s + i) -
+					SIMD_KERNEL(load_)(z + i));
+		}
+		else {
+			d = vabs(SIMD_KERNEL(loadtail_)(s + i, count) -
+					SIMD_KERNEL(loadtail_)(z + i, count));
+		}
+		sum += d;
+		max = vselect(d > max, d, max);
+		if ((i + SIMD_WIDTH) % SIMD_CHECK == 0) {
+			dist = (SIMD_KERNEL(hsum_)(sum) +
+					SIMD_KERNEL(hmax_)(max)) / 2;
+			if (FLT_GT(dist, bsf, epsilon)) {
+				debug(" %.6f (early abandoned)\n", dist);
+				return dist;
+			}
+		}
+	}
+	dist = (SIMD_KERNEL(hsum_)(sum) + SIMD_KERNEL(hmax_)(max)) / 2;
+	debug(" %.6f\n", dist);
+	return dist;
+}
+
+/* The distances that are a function of a few sums. The zeros loaded past
+ * the last observation add nothing to any of the sums
+ */
+static double SIMD_KERNEL(sorensen_)(real *s, real *z, int len,
+		double bsf, double epsilon)
+{
+	vec num = { 0 }, den = { 0 }, x, y;
+	double dist;
+	int i, count, n = len - 1;
+
+	for (i = 0; i < n; i += SIMD_WIDTH) {
+		count = n - i < SIMD_WIDTH ? n - i : SIMD_WIDTH;
+		if (count == SIMD_WIDTH) {
+			x = SIMD_KERNEL(load_)(s + i);
+			y = SIMD_KERNEL(load_)(z + i);
+		}
+		else {
+			x = SIMD_KERNEL(loadtail_)(s + i, count);
+			y = SIMD_KERNEL(loadtail_)(z + i, count);
+		}
+		num += vabs(x - y);
+		den += vabs(x) + vabs(y);
+	}
+	dist = SIMD_KERNEL(hsum_)(num) / SIMD_KERNEL(hsum_)(den);
+	debug(" %.6f\n", dist);
+	return dist;
+}
+
+static double SIMD_KERNEL(cosine_)(real *s, real *z, int len,
+		double bsf, double epsilon)
+{
+	vec dot = { 0 }, norm1 = { 0 }, norm2 = { 0 }, x, y;
+	double dist;
+	int i, count, n = len - 1;
+
+	for (i = 0; i < n; i += SIMD_WIDTH) {
+		count = n - i < SIMD_WIDTH ? n - i : SIMD_WIDTH;
+		if (count == SIMD_WIDTH) {
+			x = SIMD_KERNEL(load_)(s + i);
+			y = SIMD_KERNEL(load_)(z + i);
+		}
+		else {
+			x = SIMD_KERNEL(loadtail_)(s + i, count);
+			y = SIMD_KERNEL(loadtail_)(z + i, count);
+		}
+		dot += x * y;
+		norm1 += x * x;
+		norm2 += y * y;
+	}
+	dist = 1 - SIMD_KERNEL(hsum_)(dot) /
+		(sqrt(SIMD_KERNEL(hsum_)(norm1)) *
+		 sqrt(SIMD_KERNEL(hsum_)(norm2)));
+	debug(" %.6f\n", dist);
+	return dist;
+}
+
+static double SIMD_KERNEL(jaccard_)(real *s, real *z, int len,
+		double bsf, double epsilon)
+{
+	vec diff = { 0 }, mul = { 0 }, x, y;
+	double d, m, dist;
+	int i, count, n = len - 1;
+
+	for (i = 0; i < n; i += SIMD_WIDTH) {
+		count = n - i < SIMD_WIDTH ? n - i : SIMD_WIDTH;
+		if (count == SIMD_WIDTH) {
+			x = SIMD_KERNEL(load_)(s + i);
+			y = SIMD_KERNEL(load_)(z + i);
+		}
+		else {
+			x = SIMD_KERNEL(loadtail_)(s + i, count);
+			y = SIMD_KERNEL(loadtail_)(z + i, count);
+		}
+		diff += (x - y) * (x - y);
+		mul += x * y;
+	}
+	d = SIMD_KERNEL(hsum_)(diff);
+	m = SIMD_KERNEL(hsum_)(mul);
+	dist = d / (d + m);
+	debug(" %.6f\n", dist);
+	return dist;
+}
+
+static double SIMD_KERNEL(dice_)(real *s, real *z, int len, double bsf,
+		double epsilon)
+{
+	vec num = { 0 }, den = { 0 }, x, y;
+	double dist;
+	int i, count, n = len - 1;
+
+	for (i = 0; i < n; i += SIMD_WIDTH) {
+		count = n - i < SIMD_WIDTH ? n - i : SIMD_WIDTH;
+		if (count == SIMD_WIDTH) {
+			x = SIMD_KERNEL(load_)(s + i);
+			y = SIMD_KERNEL(load_)(z + i);
+		}
+		else {
+			x = SIMD_KERNEL(loadtail_)(s + i, count);
+			y = SIMD_KERNEL(loadtail_)(z + i, count);
+		}
+		num += (x - y) * (x - y);
+		den += x * x + y * y;
+	}
+	dist = SIMD_KERNEL(hsum_)(num) / SIMD_KERNEL(hsum_)(den);
+	debug(" %.6f\n", dist);
+	return dist;
+}
+
+static double SIMD_KERNEL(bhattacharyya_)(real *s, real *z, int len,
+		double bsf, double epsilon)
+{
+	double dist = SIMD_KERNEL(sum_)(s, z, len, bsf, epsilon,
+			SIMD_KERNEL(sqrtterm_), 0);
+	if (fabs(dist) > epsilon && dist > 0) {
+		dist = -log(dist);
+	}
+	return dist;
+}
+
+static double SIMD_KERNEL(hellinger_)(real *s, real *z, int len,
+		double bsf, double epsilon)
+{
+	double dist = SIMD_KERNEL(sum_)(s, z, len, bsf, epsilon,
+			SIMD_KERNEL(sqrtterm_), 0);
+	if (fabs(dist - 1) < epsilon || dist < 1) {
+		dist = 2 * sqrt(1 - dist);
+	}
+	else {
+		dist = 0.0 / 0.0;
+	}
+	return dist;
+}
+
+/* The copies of the search with the distances of this file, for
+ * selectsearch()
+ */
+#define SIMD_SEARCH(_name) SIMD_EXPAND(NN1_SEARCH, SIMD_NAME(_name))
+
+SIMD_SEARCH(euclidean2_)
+SIMD_SEARCH(manhattan_)
+SIMD_SEARCH(chebyshev_)
+SIMD_SEARCH(avg_l1_linf_)
+SIMD_SEARCH(canberra_)
+SIMD_SEARCH(lorentzian_)
+SIMD_SEARCH(sorensen_)
+SIMD_SEARCH(cosine_)
+SIMD_SEARCH(jaccard_)
+SIMD_SEARCH(dice_)
+SIMD_SEARCH(pearson_)
+SIMD_SEARCH(squared_chi_)
+SIMD_SEARCH(kullback_)
+SIMD_SEARCH(jeffrey_)
+SIMD_SEARCH(bhattacharyya_)
+SIMD_SEARCH(hellinger_)
+
+/* Return the copy of the search for a distance code, or NULL if it has no
+ * vectorized version
+ */
+PRECISION(searchfunction) SIMD_KERNEL(selectsearch_)(int distcode)
+{
+	switch (distcode) {
+	case 1: return SIMD_KERNEL(nn1fast_euclidean2_);
+	case 2: return SIMD_KERNEL(nn1fast_manhattan_);
+	case 3: return SIMD_KERNEL(nn1fast_chebyshev_);
+	case 5: return SIMD_KERNEL(nn1fast_euclidean2_);
+	case 9: return SIMD_KERNEL(nn1fast_avg_l1_linf_);
+	case 10: return SIMD_KERNEL(nn1fast_canberra_);
+	case 11: return SIMD_KERNEL(nn1fast_lorentzian_);
+	case 12: return SIMD_KERNEL(nn1fast_sorensen_);
+	case 20: return SIMD_KERNEL(nn1fast_cosine_);
+	case 21: return SIMD_KERNEL(nn1fast_jaccard_);
+	case 22: return SIMD_KERNEL(nn1fast_dice_);
+	case 30: return SIMD_KERNEL(nn1fast_pearson_);
+	case 31: return SIMD_KERNEL(nn1fast_squared_chi_);
+	case 40: return SIMD_KERNEL(nn1fast_kullback_);
+	case 41: return SIMD_KERNEL(nn1fast_jeffrey_);
+	case 50: return SIMD_KERNEL(nn1fast_bhattacharyya_);
+	case 51: return SIMD_KERNEL(nn1fast_hellinger_);
+	default: return NULL;
+	}
+}
+
+#undef SIMD_SEARCH
+#undef vselect
+#undef vabs
+#undef vec
+#undef mask
+#undef SIMD_STEP
+#undef SIMD_CHECK
+#undef SIMD_KERNEL
+#undef SIMD_EXPAND
+#undef SIMD_NAME
+#undef SIMD_CAT
+#undef SIMD_CAT2
@@ -0,0 +1,46 @@
+function stats = nn1faststats(stack, options_or_distname)
+%MODELS.NN1FASTSTATS   Compute the statistics of the series of a data set
+%used by MODELS.NN1FAST, so they are computed only once for all searches.
+%   NN1FASTSTATS(DS,DISTNAME), where DS is an n-by-m matrix of double
+%   representing a data set (in format according to TS.LOAD and TS.SAVE)
+%   and DISTNAME is a distance accepted by MODELS.NN1FAST, returns the
+%   statistics of every series of DS used by that distance, to be passed to
+%   MODELS.NN1FAST in the option "nn::stats".
+%
+%   NN1FASTSTATS(DS,options) does the same, but the distance and the
+%   precision are taken from the options "nn::distance" and
+%   "nn::precision" of the OPTS object "options".
+%
+%   The statistics are the L1 norm of each series (Sorensen), the squared
+%   L2 norm (cosine, Jaccard, and Dice), or the logarithm (Kullback-Leibler
+%   and Jeffrey's) or the square root (Bhattacharyya and Hellinger) of the
+%   absolute value of each observation. For the other distances, the empty
+%   array [] is returned.
+%
+%   Example:
+%
+%       options = opts.set('nn::distance', 'kullback');
+%       options = opts.set(options, 'nn::stats', models.nn1faststats(train, options));
+%       for i = 1:size(test, 1)
+%           neighbor(i) = models.nn1fast(train, test(i, :), options);
+%       end
+%
+%   The statistics belong to DS: they must be computed again if DS changes,
+%   and MODELS.NN1FAST refuses statistics computed for a data set of
+%   another size or for another distance.
+
+%   This file is part of TimeBox. Copyright 2015-17 Rafael Giusti
+%   Revision 0.1.1
+if opts.isa(options_or_distname)
+    options = options_or_distname;
+else
+    options = opts.set('nn::distance', options_or_distname);
+end
+distname = opts.get(options, 'nn::distance', 'euclidean');
+precision = opts.get(options, 'nn::precision', 'double');
+tb.assert(any(strcmp(precision, {'double', 'single'})), 'Option "nn::precision" must be either ''double'' or ''single''');
+
+distcode = models.nn1fast([], [], lower(distname));
+tb.assert(~isempty(distcode), ['Unsupported distance: ' distname]);
+stats = models.nn1fast_mex('stats', cast(stack, precision), distcode, true);
+end
@@ -39,7 +39,7 @@ function [votes, weights, rankings] = weighbydist(dsname, trainclasses, testclas
 %   TimeBox, please check RUNS.DME.MAJORITY.
 
 %   This file is part of TimeBox. Copyright 2015-16 Rafael Giusti
-%   Revision 0.1
+%   Revision 0.2.1
 numclassifiers = numel(basecc);
 numinstances = numel(testclasses);
 
@@ -64,6 +64,17 @@ end
 
 
 function maxdist = estimatespacesize(dsname, distname, repname)
+% Binary caches keep the largest distance of each block of rows, so the
+% matrices need not be read. The maxima of an incomplete cache cover only
+% the blocks already calculated, so those are left to DISTS.CACHED
+[~, binpath] = dists.cachepath(dsname, distname, repname);
+if exist(binpath, 'file')
+    cache = dists.opencache(binpath);
+    if cache.complete
+        maxdist = max(cache.trainmax, cache.testmax);
+        return
+    end
+end
 [traintrain, testtrain] = dists.cached(dsname, distname, repname);
 trainspacesize = max(max(traintrain));    
 testspacesize = max(max(testtrain));
@@ -0,0 +1,73 @@
+function [acc, neighbors, distances] = windowsearch(ds, maxwindow, options)
+%RUNS.WINDOWSEARCH Leave-one-out accuracy of the 1-NN with DTW for every
+%Sakoe-Chiba window.
+%   WINDOWSEARCH(DS) evaluates the data set DS with leave-one-out strategy
+%   and the 1-NN classifier with DTW, for every Sakoe-Chiba window from 0
+%   to the length of the series minus one. It returns a row vector with
+%   the estimated accuracy for each window: the first element is the
+%   accuracy with window 0 (i.e., Euclidean distance), the second is the
+%   accuracy with window 1, and so on.
+%
+%   The result is the same of calling RUNS.LEAVEONEOUT with MODELS.NN1DTW
+%   once per window, but all windows are evaluated in a single pass that
+%   goes from the largest to the smallest window. Since DTW never
+%   decreases as the window shrinks, the distances found for one window
+%   are lower bounds for the next, and a nearest neighbor whose warping
+%   path fits the next window is kept without calculating anything (see
+%   Tan et al., "Efficient search of the best warping window for Dynamic
+%   Time Warping", SDM 2018).
+%
+%   Example:
+%
+%       [train,~] = ts.load('some data set');    % test data ignored
+%       acc = runs.windowsearch(train);
+%       [~, best] = max(acc);
+%       window = best - 1
+%
+%   WINDOWSEARCH(DS,W) evaluates only the windows from 0 to W. If W is as
+%   large as the series or larger, the accuracy for the windows from the
+%   length of the series minus one onwards is that of unconstrained DTW.
+%
+%   WINDOWSEARCH(DS,W,OPTS) or WINDOWSEARCH(DS,OPTS) take options from the
+%   OPTS object.
+%
+%   [ACC,N] = WINDOWSEARCH(DS,...) also returns a matrix with the index of
+%   the nearest neighbor of each instance (rows) for each window (columns).
+%
+%   [ACC,N,D] = WINDOWSEARCH(DS,...) also returns the distances to the
+%   nearest neighbors.
+%
+%   The distances to all pairs of instances are kept during the search, so
+%   the memory required is 16*n^2 bytes for a data set of n instances.
+%
+%   Options:
+%       nn::threads         (default: 1)
+%       nn::simd            (default: 'auto')
+%       nn::precision       (default: 'double')
+%
+%   The options are the same of MODELS.NN1DTW.
+
+%   This file is part of TimeBox. Copyright 2015-16 Rafael Giusti
+%   Revision 1.2.1
+serieslen = size(ds, 2) - 1;
+if ~exist('maxwindow', 'var') || isempty(maxwindow)
+    maxwindow = serieslen - 1;
+elseif opts.isa(maxwindow)
+    options = maxwindow;
+    maxwindow = serieslen - 1;
+end
+if ~exist('options', 'var')
+    options = opts.empty;
+end
+tb.assert(maxwindow >= 0 && isfinite(maxwindow) && maxwindow == round(maxwindow), 'The maximum Sakoe-Chiba window must be a non-negative integer');
+
+precision = opts.get(options, 'nn::precision', 'double');
+tb.assert(any(strcmp(precision, {'double', 'single'})), 'Option "nn::precision" must be either ''double'' or ''single''');
+mexoptions = struct('threads', opts.get(options, 'nn::threads', 1), ...
+    'simd', opts.get(options, 'nn::simd', 'auto'), 'native', true);
+
+[neighbors, distances] = models.nn1dtw_mex('windows', cast(ds, precision), maxwindow, mexoptions);
+labels = ds(:, 1);
+hits = tb.sameclass(labels(neighbors), repmat(labels, 1, maxwindow + 1), options);
+acc = mean(hits, 1);
+end